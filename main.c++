@@ -1,12 +1,34 @@
+#include <dirent.h>
+#include <endian.h>
 #include <fcntl.h>
+#include <linux/mempolicy.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 /* Constants for Meta Commands  */
 typedef enum {
@@ -23,21 +45,38 @@ typedef enum {
   PREPARE_NEGATIVE_ID
 } PREPARE_RESULT;
 
+/* Column bitmask, used to project SELECT onto a subset of Row */
+typedef enum {
+  COLUMN_ID = 1 << 0,
+  COLUMN_USERNAME = 1 << 1,
+  COLUMN_EMAIL = 1 << 2,
+  ALL_COLUMNS = COLUMN_ID | COLUMN_USERNAME | COLUMN_EMAIL
+} COLUMN_MASK;
+
 /* Constants for Command type */
-typedef enum { COMMAND_SELECT, COMMAND_INSERT } COMMAND_TYPE;
+typedef enum { COMMAND_SELECT, COMMAND_INSERT, COMMAND_ANALYZE } COMMAND_TYPE;
 
 typedef enum {
   EXECUTE_SUCCESS,
   EXECUTE_DUPLICATE_KEY,
-  EXECUTE_TABLE_FULL
+  EXECUTE_TABLE_FULL,
+  EXECUTE_READ_ONLY,
+  EXECUTE_UNKNOWN_TABLE
 } EXECUTE_RESULT;
 
-typedef enum { NODE_INTERNAL, NODE_LEAF } NodeType;
+typedef enum {
+  NODE_INTERNAL,
+  NODE_LEAF,
+  NODE_LEAF_PACKED,
+  NODE_LEAF_PAX,
+  NODE_INTERNAL_BUFFERED,
+  NODE_MESSAGE_BUFFER
+} NodeType;
 
 /* Row Structure and Constants :
           Row Structure:
           +----------------+
-          | id (4 bytes)   |
+          | id (8 bytes)   |
           +----------------+
           | username (32)  |
           +----------------+
@@ -47,7 +86,7 @@ typedef enum { NODE_INTERNAL, NODE_LEAF } NodeType;
 #define COLUMN_USERNAME_SIZE 32
 #define COLUMN_EMAIL_SIZE 255
 typedef struct {
-  uint32_t id;
+  uint64_t id;
   char username[COLUMN_USERNAME_SIZE + 1];
   char email[COLUMN_EMAIL_SIZE + 1];
 } Row;
@@ -62,9 +101,43 @@ const uint32_t USERNAME_OFFSET = ID_OFFSET + ID_SIZE;
 const uint32_t EMAIL_OFFSET = USERNAME_OFFSET + USERNAME_SIZE;
 const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
 
+/**
+ * @brief Primary key encoding
+ * @details Keys are stored in a memcomparable form : the 64-bit `id` is
+ * written big-endian, so two encoded keys order exactly like their ids under
+ * a plain memcmp and node search never needs to know the key's type.
+ * @example
+ *      id = 258        -> 00 00 00 00 00 00 01 02
+ */
+const uint32_t KEY_SIZE = sizeof(uint64_t);
+
+void encodeKeyColumn(uint64_t value, uint8_t *dst) {
+  for (uint32_t i = 0; i < KEY_SIZE; ++i) {
+    dst[i] = (uint8_t)(value >> (8 * (KEY_SIZE - 1 - i)));
+  }
+}
+
+uint64_t decodeKeyColumn(const uint8_t *src) {
+  uint64_t value = 0;
+  for (uint32_t i = 0; i < KEY_SIZE; ++i) {
+    value = (value << 8) | src[i];
+  }
+  return value;
+}
+
+/* Encodes the primary key of a row into \p dst (KEY_SIZE bytes) */
+inline void encodeRowKey(const Row *row, uint8_t *dst) {
+  encodeKeyColumn(row->id, dst);
+}
+
+inline int compareKeys(const uint8_t *a, const uint8_t *b) {
+  return memcmp(a, b, KEY_SIZE);
+}
+
 /* Paging System */
 const uint32_t PAGE_SIZE = 4096; // 4 KB (common OS page size)
-#define TABLE_MAX_PAGES 100
+#define TABLE_MAX_PAGES 65536 // 256 MB, more than fits the buffer pool
+const uint32_t PAGER_MIN_RESERVED_PAGES = 64; // See pagerReserve()
 
 /**
  * @brief Common Node header layout
@@ -95,34 +168,42 @@ const uint8_t COMMON_NODE_HEADER_SIZE =
 
 /**
  * @brief Leaf node header layout
- * @details These nodes need to store how many "cells" they contain
- * @note A "cell" is a key-value pair. Total: 4 bytes
- * (LEAF_NODE_NUM_CELLS_SIZE). Combined header for a leaf node is 6 + 4 = 10
- * bytes (LEAF_NODE_HEADER_SIZE)
+ * @details These nodes need to store how many "cells" they contain and the
+ * page number of their right sibling, so a scan can walk the leaves in key
+ * order without going back up the tree.
+ * @note A "cell" is a key-value pair. Total: 4 + 4 bytes. Combined header for
+ * a leaf node is 6 + 8 = 14 bytes (LEAF_NODE_HEADER_SIZE). A next leaf of 0
+ * means "no sibling", page 0 is always the root.
  * @example
  *       +-----------------------------+  ← Offset 6 (COMMON_NODE_HEADER_SIZE)
  *       | Number of Cells (4 bytes)   |  ← Offset 6 ... 9
  *       +-----------------------------+
+ *       | Next Leaf (4 bytes)         |  ← Offset 10 ... 13
+ *       +-----------------------------+
  * @
  */
 const uint32_t LEAF_NODE_NUM_CELLS_SIZE = sizeof(uint32_t);
 const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
-const uint32_t LEAF_NODE_HEADER_SIZE =
-    COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE;
+const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET =
+    LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;
+const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
+                                       LEAF_NODE_NUM_CELLS_SIZE +
+                                       LEAF_NODE_NEXT_LEAF_SIZE;
 
 /**
  * @brief Leaf node body
- * @details Leaf node is an array of cells. Each cell is a key followed by a
- * value (a serialised row)
- * @note Total cell size: 4 + ROW_SIZE bytes (LEAF_NODE_CELL_SIZE)
+ * @details Leaf node is an array of cells. Each cell is a memcomparable key
+ * followed by a value (a serialised row)
+ * @note Total cell size: KEY_SIZE + ROW_SIZE bytes (LEAF_NODE_CELL_SIZE)
  * @example
  *      +-----------------------------+  ← Within cell: Offset 0
- *      | Key (4 bytes)               |  ← Offset 0 ... 3
+ *      | Key (8 bytes)               |  ← Offset 0 ... 7
  *      +-----------------------------+
- *      | Value (ROW_SIZE bytes)      |  ← Offset 4 ... (4 + ROW_SIZE - 1)
+ *      | Value (ROW_SIZE bytes)      |  ← Offset 8 ... (8 + ROW_SIZE - 1)
  *      +-----------------------------+
  */
-const uint32_t LEAF_NODE_KEY_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_KEY_SIZE = KEY_SIZE;
 const uint32_t LEAF_NODE_KEY_OFFSET = 0;
 const uint32_t LEAF_NODE_VALUE_SIZE = ROW_SIZE;
 const uint32_t LEAF_NODE_VALUE_OFFSET =
@@ -132,6 +213,166 @@ const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
 const uint32_t LEAF_NODE_MAX_CELLS =
     LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
 
+/**
+ * @brief Packed leaf node layout (NODE_LEAF_PACKED)
+ * @details Optional leaf format for integer keys. Keys are stored once, as a
+ * frame of reference : the smallest key (Base) plus a bit-packed array of
+ * fixed-width deltas. Values follow the delta array and omit the id column,
+ * since the id is the key.
+ * @note Shares the 14 byte leaf header, so numCells and nextLeaf sit at the
+ * same offsets as in a plain leaf. Delta i lives at bit i * Bit Width of the
+ * delta array, little-endian. The whole node is re-encoded on every change.
+ * @example
+ *       +-----------------------------+  ← Offset 0
+ *       | Leaf Node Header (14 bytes) |
+ *       +-----------------------------+  ← Offset 14
+ *       | Base (8 bytes)              |  ← Offset 14 ... 21
+ *       +-----------------------------+
+ *       | Bit Width (1 byte)          |  ← Offset 22
+ *       +-----------------------------+  ← Offset 23
+ *       | Deltas (ceil(n * w / 8))    |
+ *       +-----------------------------+
+ *       | Values (n * (ROW_SIZE - 8)) |
+ *       +-----------------------------+
+ */
+const uint32_t LEAF_PACKED_BASE_SIZE = sizeof(uint64_t);
+const uint32_t LEAF_PACKED_BASE_OFFSET = LEAF_NODE_HEADER_SIZE;
+const uint32_t LEAF_PACKED_BIT_WIDTH_SIZE = sizeof(uint8_t);
+const uint32_t LEAF_PACKED_BIT_WIDTH_OFFSET =
+    LEAF_PACKED_BASE_OFFSET + LEAF_PACKED_BASE_SIZE;
+const uint32_t LEAF_PACKED_HEADER_SIZE =
+    LEAF_PACKED_BIT_WIDTH_OFFSET + LEAF_PACKED_BIT_WIDTH_SIZE;
+const uint32_t LEAF_PACKED_VALUE_SIZE = ROW_SIZE - ID_SIZE;
+const uint32_t LEAF_PACKED_MAX_CELLS =
+    (PAGE_SIZE - LEAF_PACKED_HEADER_SIZE) / LEAF_PACKED_VALUE_SIZE;
+
+/**
+ * @brief PAX leaf node layout (NODE_LEAF_PAX)
+ * @details Same header and packed keys as NODE_LEAF_PACKED, but the values
+ * are split into one minipage per column : all usernames back to back, then
+ * all emails. A scan of one column reads one contiguous array instead of
+ * striding over whole rows.
+ * @note Holds as many cells as a packed leaf (LEAF_PACKED_MAX_CELLS).
+ * @example
+ *       +-----------------------------+  ← Offset 0
+ *       | Packed Leaf Header (23 b)   |
+ *       +-----------------------------+
+ *       | Deltas (ceil(n * w / 8))    |  ← id minipage
+ *       +-----------------------------+
+ *       | Usernames (n * 33 bytes)    |  ← username minipage
+ *       +-----------------------------+
+ *       | Emails (n * 256 bytes)      |  ← email minipage
+ *       +-----------------------------+
+ */
+const uint32_t LEAF_MAX_CELLS_ANY_FORMAT =
+    LEAF_PACKED_MAX_CELLS > LEAF_NODE_MAX_CELLS ? LEAF_PACKED_MAX_CELLS
+                                                : LEAF_NODE_MAX_CELLS;
+
+/**
+ * @brief Internal node header layout
+ * @details Internal nodes route a search to one of their children using
+ * separator keys. Separators are suffix-truncated (see truncateSeparator())
+ * and every separator of a node shares the common prefix stored once in the
+ * header, so a cell only carries the few bytes that actually differ.
+ * @note A separator is rebuilt as prefix + slot + zero padding up to KEY_SIZE.
+ * Slot Width is the same for every cell of a node and is recomputed whenever
+ * the node is re-encoded. Total header: 6 + 4 + 4 + 1 + 1 + KEY_SIZE = 24
+ * bytes (INTERNAL_NODE_HEADER_SIZE)
+ * @example
+ *       +-----------------------------+  ← Offset 6 (COMMON_NODE_HEADER_SIZE)
+ *       | Number of Keys (4 bytes)    |  ← Offset 6 ... 9
+ *       +-----------------------------+
+ *       | Right Child (4 bytes)       |  ← Offset 10 ... 13
+ *       +-----------------------------+
+ *       | Prefix Length (1 byte)      |  ← Offset 14
+ *       +-----------------------------+
+ *       | Slot Width (1 byte)         |  ← Offset 15
+ *       +-----------------------------+
+ *       | Common Prefix (8 bytes)     |  ← Offset 16 ... 23
+ *       +-----------------------------+
+ */
+const uint32_t INTERNAL_NODE_NUM_KEYS_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_NUM_KEYS_OFFSET = COMMON_NODE_HEADER_SIZE;
+const uint32_t INTERNAL_NODE_RIGHT_CHILD_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_RIGHT_CHILD_OFFSET =
+    INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE;
+const uint32_t INTERNAL_NODE_PREFIX_LEN_SIZE = sizeof(uint8_t);
+const uint32_t INTERNAL_NODE_PREFIX_LEN_OFFSET =
+    INTERNAL_NODE_RIGHT_CHILD_OFFSET + INTERNAL_NODE_RIGHT_CHILD_SIZE;
+const uint32_t INTERNAL_NODE_SLOT_WIDTH_SIZE = sizeof(uint8_t);
+const uint32_t INTERNAL_NODE_SLOT_WIDTH_OFFSET =
+    INTERNAL_NODE_PREFIX_LEN_OFFSET + INTERNAL_NODE_PREFIX_LEN_SIZE;
+const uint32_t INTERNAL_NODE_PREFIX_SIZE = KEY_SIZE;
+const uint32_t INTERNAL_NODE_PREFIX_OFFSET =
+    INTERNAL_NODE_SLOT_WIDTH_OFFSET + INTERNAL_NODE_SLOT_WIDTH_SIZE;
+const uint32_t INTERNAL_NODE_HEADER_SIZE =
+    INTERNAL_NODE_PREFIX_OFFSET + INTERNAL_NODE_PREFIX_SIZE;
+
+/**
+ * @brief Internal node body
+ * @details An array of cells, each a child pointer followed by the separator
+ * slot. Child i holds every key below separator i, the right child holds
+ * every key at or above the last separator.
+ * @note A cell is 4 + Slot Width bytes, between 4 and 4 + KEY_SIZE.
+ * INTERNAL_NODE_MAX_KEYS caps a node so that either half of a split still
+ * fits at the widest slot width.
+ * @example
+ *      +-----------------------------+  ← Within cell: Offset 0
+ *      | Child Page (4 bytes)        |  ← Offset 0 ... 3
+ *      +-----------------------------+
+ *      | Separator Slot (0-8 bytes)  |  ← Offset 4 ... (4 + Slot Width - 1)
+ *      +-----------------------------+
+ */
+const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_SPACE_FOR_CELLS =
+    PAGE_SIZE - INTERNAL_NODE_HEADER_SIZE;
+const uint32_t INTERNAL_NODE_MAX_KEYS =
+    2 * (INTERNAL_NODE_SPACE_FOR_CELLS / (INTERNAL_NODE_CHILD_SIZE + KEY_SIZE)) -
+    2;
+
+/**
+ * @brief Buffered internal node (Bε-tree)
+ * @details Same as an internal node, with one more header field pointing to
+ * a message buffer page (0 until the first message arrives). Inserts are
+ * parked as messages in the buffer of the highest buffered node and only
+ * pushed one level down, in a batch, when that buffer fills up.
+ * @note The extra field costs 4 bytes of cell space, either half of a split
+ * at INTERNAL_NODE_MAX_KEYS still fits.
+ * @example
+ *       +-----------------------------+  ← Offset 0
+ *       | Internal Node Header (24 b) |
+ *       +-----------------------------+
+ *       | Buffer Page (4 bytes)       |  ← Offset 24 ... 27
+ *       +-----------------------------+
+ */
+const uint32_t INTERNAL_NODE_BUFFER_PAGE_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_BUFFER_PAGE_OFFSET = INTERNAL_NODE_HEADER_SIZE;
+const uint32_t INTERNAL_NODE_BUFFERED_HEADER_SIZE =
+    INTERNAL_NODE_BUFFER_PAGE_OFFSET + INTERNAL_NODE_BUFFER_PAGE_SIZE;
+const uint32_t INTERNAL_NODE_BUFFERED_SPACE_FOR_CELLS =
+    PAGE_SIZE - INTERNAL_NODE_BUFFERED_HEADER_SIZE;
+
+/**
+ * @brief Message buffer page layout
+ * @details Messages (key + serialised row, one per pending insert) sorted by
+ * key, so the messages bound for one child are contiguous.
+ * @example
+ *       +-----------------------------+  ← Offset 0
+ *       | Common Node Header (6 b)    |
+ *       +-----------------------------+
+ *       | Number of Messages (4 b)    |  ← Offset 6 ... 9
+ *       +-----------------------------+
+ *       | Message 0 | Message 1 | ... |  ← KEY_SIZE + ROW_SIZE each
+ *       +-----------------------------+
+ */
+const uint32_t MESSAGE_BUFFER_NUM_MESSAGES_SIZE = sizeof(uint32_t);
+const uint32_t MESSAGE_BUFFER_NUM_MESSAGES_OFFSET = COMMON_NODE_HEADER_SIZE;
+const uint32_t MESSAGE_BUFFER_HEADER_SIZE =
+    MESSAGE_BUFFER_NUM_MESSAGES_OFFSET + MESSAGE_BUFFER_NUM_MESSAGES_SIZE;
+const uint32_t MESSAGE_SIZE = KEY_SIZE + ROW_SIZE;
+const uint32_t MESSAGE_BUFFER_MAX_MESSAGES =
+    (PAGE_SIZE - MESSAGE_BUFFER_HEADER_SIZE) / MESSAGE_SIZE;
+
 NodeType getNodeType(void *node) {
   uint8_t value = *((uint8_t *)node + NODE_TYPE_OFFSET);
   return (NodeType)value;
@@ -142,9 +383,164 @@ void setNodeType(void *node, NodeType type) {
   *((uint8_t *)node + NODE_TYPE_OFFSET) = value;
 }
 
+bool isNodeRoot(void *node) {
+  uint8_t value = *((uint8_t *)node + IS_ROOT_OFFSET);
+  return (bool)value;
+}
+
+// The is-root byte of the root, page 0, doubles as the file format version :
+// files from before 64-bit memcomparable keys hold 0 or 1 there
+const uint8_t NODE_ROOT_FORMAT = 2;
+
+void setNodeRoot(void *node, bool isRoot) {
+  uint8_t value = isRoot ? NODE_ROOT_FORMAT : 0;
+  *((uint8_t *)node + IS_ROOT_OFFSET) = value;
+}
+
+uint32_t *nodeParent(void *node) {
+  return (uint32_t *)((char *)node + PARENT_POINTER_OFFSET);
+}
+
 /* Forward declarations */
 typedef struct Pager Pager; // Forward declaration
 void *getPage(Pager *pager, uint32_t pageNum);
+void pagerFlush(Pager *pager, uint32_t pageNum);
+void bufferPoolEvict(Pager *pager, uint32_t frameNum);
+void bufferPoolShrink(Pager *pager);
+void pagerReserve(Pager *pager, uint32_t numPages);
+
+/**
+ * @brief Buffer pool
+ * @details Without it every page fetched stays cached until the DB is
+ * closed. With it pages live in a fixed set of PAGE_SIZE aligned frames
+ * (one anonymous mapping), so memory use is bounded and the file may be
+ * opened with O_DIRECT, bypassing the kernel page cache.
+ * @note Callers hold page pointers for the length of an operation (one
+ * statement, or one leaf of a scan), so a frame fetched during the current
+ * operation (epoch) is never evicted. Otherwise the victim is picked by 2Q
+ * (see partitionVictim()) and written back only if its checksum changed since
+ * it was loaded. If every frame is in use by the operation the pool grows by
+ * one frame.
+ */
+const uint32_t BUFFER_POOL_MIN_PAGES = 32;
+const uint32_t BUFFER_POOL_DEFAULT_PAGES = 1024; // 4 MB
+const uint32_t NO_PAGE = UINT32_MAX;
+const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024; // 2 MB (x86-64, arm64)
+
+/* What backs the pool region */
+typedef enum {
+  POOL_SMALL_PAGES,
+  POOL_HUGETLB,
+  POOL_TRANSPARENT_HUGE_PAGES
+} POOL_BACKING;
+
+/**
+ * @brief 2Q replacement. A page loaded for the first time enters A1in, a
+ *        FIFO, and leaves it after its turn unless it was seen again in the
+ *        meantime : one pass over the table can only flush A1in, not the hot
+ *        pages. A page evicted from A1in is remembered (page number only) in
+ *        the ghost list A1out; loaded again while remembered, it is hot and
+ *        goes to Am, an LRU list. Scans mark their pages use once, which puts
+ *        them at the front of A1in and keeps them out of A1out.
+ *
+ * A1in : [ use once ... | ... first time ] ← loaded
+ *          evicted first
+ * Am   : [ least recently used ... most recently used ] ← hit or ghost hit
+ */
+typedef enum { QUEUE_FREE, QUEUE_A1IN, QUEUE_AM } FRAME_QUEUE;
+
+/* Intrusive list of frames, linked through Frame::prev and Frame::next */
+typedef struct {
+  int32_t head; // -1 if empty
+  int32_t tail;
+  uint32_t size;
+} FrameList;
+
+/**
+ * @brief Frames local to one NUMA node. Pages are loaded into a frame of
+ *        the partition of the thread that needs them, so a thread mostly
+ *        touches memory of its own node.
+ */
+typedef struct {
+  int node;
+  uint8_t *memory; // One mapping, bound to node
+  size_t length;
+  POOL_BACKING backing;
+  std::vector<uint32_t> frameNums; // Indexes in Pager::frames
+  std::vector<uint32_t> freeFrames;
+  FrameList a1in;
+  FrameList am;
+} PoolPartition;
+
+typedef struct {
+  uint8_t *data;      // PAGE_SIZE bytes, PAGE_SIZE aligned
+  uint32_t pageNum;   // NO_PAGE while the frame is free
+  uint64_t epoch;     // Last operation that fetched the page
+  uint64_t checksum;  // Of the page as loaded from disk
+  uint32_t partition; // Index in Pager::partitions
+  uint8_t queue;      // FRAME_QUEUE
+  bool useOnce;       // Only fetched by scans so far
+  int32_t prev;
+  int32_t next;
+  int32_t parentFrame;  // Frame whose children points here, -1 if none
+  uint32_t parentSlot;  // Index in the parent frame's children
+  std::vector<int32_t> children; // Child number → frame (see getChildPage())
+} Frame;
+
+/**
+ * @brief Durability, chosen per connection (.pragma synchronous)
+ * @details OFF never syncs : a crash of the OS may lose or, for shadow
+ * paged files, corrupt recent commits. NORMAL syncs at checkpoints only :
+ * WAL commits reach the disk within a checkpoint interval, shadow paged
+ * commits (each one a checkpoint) and plain files on close. FULL also
+ * syncs the log before a WAL mode statement returns.
+ */
+typedef enum {
+  SYNCHRONOUS_OFF,
+  SYNCHRONOUS_NORMAL,
+  SYNCHRONOUS_FULL
+} SYNCHRONOUS;
+
+/* Where a compressed page lives in the DB file */
+typedef struct {
+  uint64_t offset;
+  uint32_t length;   // Compressed length, 0 if the page was never written
+  uint32_t capacity; // Bytes reserved at offset, length rounded up
+} PageExtent;
+
+/**
+ * @brief `<db>-shm`, mapped by every process using a WAL mode file
+ * @details The header tells which commits are in the log, framePage which
+ * page each frame holds, so a process catches up with the others' commits
+ * without reading the log (see walRefresh()). A writer changes the header
+ * while version is odd, readers retry until they saw an even, unchanged
+ * version. A statement holds one of WAL_SHM_READERS reader slots, its
+ * mark the end of the log it looks at : backfill leaves the pages of later
+ * frames alone, and the log is only emptied while no slot is held.
+ * @note Coordination goes through OFD locks (fcntl) on single bytes of the
+ * file, released by the kernel when a process dies :
+ *      DMS        : shared by every process, exclusive while the first one
+ *                   replays the log or the last one checkpoints it away
+ *      WRITE      : held by the statement that may commit
+ *      CHECKPOINT : held while the DB file is backfilled or the log reset
+ *      READERS    : one per reader slot
+ */
+const uint32_t WAL_SHM_READERS = 8;
+const uint32_t WAL_SHM_MAX_FRAMES = 1 << 20; // 4 GB of log
+const uint32_t WAL_SHM_LOCK_DMS = 0;
+const uint32_t WAL_SHM_LOCK_WRITE = 1;
+const uint32_t WAL_SHM_LOCK_CHECKPOINT = 2;
+const uint32_t WAL_SHM_LOCK_READERS = 3;
+
+typedef struct {
+  char magic[8]; // Zeroed by the last process before it removes the file
+  std::atomic<uint64_t> version;
+  std::atomic<uint64_t> salt;
+  std::atomic<uint64_t> walEnd;
+  std::atomic<uint32_t> numPages;
+  std::atomic<uint64_t> readerMarks[WAL_SHM_READERS];
+  std::atomic<uint32_t> framePage[WAL_SHM_MAX_FRAMES];
+} WalShm;
 
 /**
  * @brief Takes page number \p x and it \return block of memory containing the
@@ -156,14 +552,212 @@ struct Pager {
   int fd;
   uint32_t fileSize;
   uint32_t numPages;
-  void *pages[TABLE_MAX_PAGES];
+  std::vector<void *> pages; // Page number → cached copy, see pagerReserve()
+  SYNCHRONOUS synchronous;
+
+  /* Compressed files only (see pagerOpen()) */
+  bool compressed;
+  std::vector<PageExtent> pageMap;     // Indexed by page number
+  std::vector<PageExtent> freeExtents; // Holes left by relocated pages
+  uint64_t fileEnd;                    // First byte past the last extent
+
+  /* Shadow paged files only (see shadowPagerCommit()) */
+  bool shadow;
+  uint64_t txnId;                     // Last committed transaction
+  uint32_t numSlots;                  // Slots in the file, metas included
+  std::vector<uint32_t> shadowMap;    // Page number → slot, 0 if unwritten
+  std::vector<uint64_t> pageHashes;   // Checksum of each committed page
+  std::vector<uint32_t> mapSlots;     // Slots holding the committed map
+  std::vector<uint32_t> freeSlots;    // Not used by the committed state
+  std::vector<uint32_t> touchedPages; // Fetched since the last commit
+  std::vector<bool> isTouched;
+
+  /* WAL mode only (see walCommit()), pages logged are tracked through
+     touchedPages and pageHashes as for shadow paging */
+  bool wal;
+  int walFd;
+  std::string walPath;
+  uint64_t walSalt;
+  uint64_t walEnd;            // Past the last committed frame
+  uint64_t walSynced;         // Frames before it are on disk
+  bool walSyncing;            // A group commit leader is syncing
+  std::condition_variable walSyncDone;
+  uint32_t walAutoCheckpoint; // Frames that wake the checkpointer
+  uint64_t checkpoints;
+  std::vector<uint64_t> walIndex;      // Page number → newest frame, 0 if none
+  std::vector<uint64_t> walBackfilled; // Page number → frame in the DB file
+
+  /* Processes sharing the log (see WalShm), this one's view in walIndex */
+  int shmFd;
+  WalShm *shm; // Null if not mapped
+  std::string shmPath;
+  int readerSlot;   // Held by the running statement, -1 if none
+  bool writeLocked; // The running statement holds WRITE
+
+  /* Log replay, still running when dbOpen() returns (see walOpen()) */
+  std::atomic<bool> walRecovering;
+  std::mutex recoveryMutex; // Guards everything below
+  std::condition_variable recoveryProgress;
+  std::vector<std::thread> recoveryWorkers;
+  std::vector<uint32_t> walFramePage;   // Frame → page number
+  std::vector<uint32_t> walFrameCommit; // Frame → last frame of its commit
+  std::vector<uint32_t> workerProgress; // Frames below it checked
+  uint32_t firstInvalidFrame;
+  uint32_t workersLeft;
+
+  /* In-memory DBs only (see isMemoryDb()) */
+  bool inMemory;
+  std::vector<uint8_t *> arenaChunks; // ARENA_CHUNK_PAGES pages each
+
+  /* Buffer pool only (see bufferPoolVictim()) */
+  bool usePool;
+  bool direct;                    // File opened with O_DIRECT
+  std::vector<PoolPartition> partitions; // One per NUMA node
+  std::vector<Frame> frames;             // All partitions, grown ones last
+  uint32_t numMappedFrames;              // Frames inside partition regions
+  uint32_t peakFrames; // Most frames at once, grown ones included
+  std::vector<int32_t> pageFrame; // Page number → frame, -1 if not resident
+  uint64_t epoch;
+  uint64_t evictions;
+  uint64_t writeBacks;
+  bool useOnce;                           // A scan is fetching the pages
+  std::deque<std::pair<uint32_t, uint64_t>> ghosts; // A1out, oldest first
+  std::vector<uint64_t> ghostSeq; // Page number → its A1out entry, 0 if none
+  uint64_t nextGhostSeq;
+
+  /* Background writer and checkpointer (see pagerStartBackground()) */
+  std::mutex lock;           // Held by whoever uses pages or the files
+  std::mutex checkpointLock; // Held by the writer or the checkpointer
+  std::condition_variable wake;
+  std::thread writer;
+  std::thread checkpointer;
+  bool stopping;
+  uint32_t writerRate; // Pages per second, 0 to pause the writer
+  uint64_t backgroundWrites;
+  uint64_t fileWrites; // Writes to the DB file, see prefetchLoop()
+
+  /* Warm cache, plain and WAL mode files (see saveWarmManifest()) */
+  std::string warmPath; // Empty if there is none
+  std::thread prefetcher;
+  uint64_t prefetched;
+
+  /* Change tracking and online backups (see dbBackup()) */
+  bool trackChanges; // Commits look at touchedPages, see pageChanged()
+  uint64_t lsn;      // Given to the pages the current statement changes
+  bool lsnUsed;      // Some page got it
+  std::vector<uint64_t> pageLsn; // Page number → last change, 0 if none
+  std::vector<std::pair<std::string, uint64_t>> backupLsns; // File → lsn
+  uint32_t backupRate; // Pages per second, 0 for no limit
+  std::thread backupThread;
+  std::atomic<bool> backupRunning;
+  std::string backupStatus; // Outcome of the last backup
+
+  /* Read replicas only (see replicaPoll()) */
+  bool replica;
+  std::string primaryPath;
+  int primaryFd;
+  int primaryWalFd;       // -1 while the primary has no log
+  ino_t primaryWalInode;  // The log is a new file once the primary reopens
+  uint64_t followedSalt;  // Log generation applied from, 0 if none
+  uint64_t followedOffset; // Past the last commit applied
+  uint32_t shippedPages;  // numPages as of that commit
+  std::vector<uint64_t> shippedHashes; // Page number → checksum shipped
+  std::thread shipper;
+  uint64_t shippedCommits;
+  uint64_t resyncs;
 };
 
-/* Tables */
+/* Parses all of \p text as a decimal number of at most \p max */
+bool parseUnsigned(const std::string &text, uint64_t max, uint64_t &value) {
+  if (text.empty() || !isdigit((unsigned char)text[0])) {
+    return false; // strtoull would take a sign or spaces
+  }
+  char *end;
+  errno = 0;
+  unsigned long long parsed = std::strtoull(text.c_str(), &end, 10);
+  if (errno == ERANGE || *end != '\0' || parsed > max) {
+    return false;
+  }
+  value = parsed;
+  return true;
+}
+
+/* Options chosen when the DB file is opened */
 typedef struct {
+  bool compress = false; // Only used when a new DB file is created
+  bool lsm = false;      // Only used when a new DB file is created
+  bool shadow = false;   // Only used when a new DB file is created
+  bool direct = false;   // O_DIRECT, plain DB files only. Implies a pool
+  uint32_t poolPages = 0; // Buffer pool frames, 0 to cache every page
+  bool hugePages = false; // Back the buffer pool with huge pages
+  bool wal = false;       // Log commits to <db>-wal, plain DB files only
+  std::string replicaOf;  // Primary DB file to follow read only, if any
+  uint32_t shards = 0;    // Only used when a new database is created
+  uint64_t partitionWidth = 0; // Same, ids per range partition
+} OpenOptions;
+
+/**
+ * @brief Sets the member of \p options a command line option names
+ * @return false for an unknown option or a value that is not a number
+ */
+bool parseOpenOption(const std::string &option, OpenOptions &options) {
+  uint64_t number;
+  auto numberAfter = [&](const char *prefix, uint64_t max) {
+    return parseUnsigned(option.substr(strlen(prefix)), max, number);
+  };
+  if (option == "--compress") {
+    options.compress = true;
+  } else if (option == "--lsm") {
+    options.lsm = true;
+  } else if (option == "--shadow") {
+    options.shadow = true;
+  } else if (option == "--direct") {
+    options.direct = true;
+  } else if (option == "--wal") {
+    options.wal = true;
+  } else if (option == "--huge-pages") {
+    options.hugePages = true;
+  } else if (option.rfind("--pool-pages=", 0) == 0) {
+    if (!numberAfter("--pool-pages=", UINT32_MAX)) {
+      return false;
+    }
+    options.poolPages = number;
+  } else if (option.rfind("--replica-of=", 0) == 0) {
+    options.replicaOf = option.substr(strlen("--replica-of="));
+  } else if (option.rfind("--shards=", 0) == 0) {
+    if (!numberAfter("--shards=", UINT32_MAX)) {
+      return false;
+    }
+    options.shards = number;
+  } else if (option.rfind("--partition-width=", 0) == 0) {
+    if (!numberAfter("--partition-width=", UINT64_MAX)) {
+      return false;
+    }
+    options.partitionWidth = number;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+typedef struct LsmTree LsmTree;           // Forward declaration
+typedef struct ShardPool ShardPool;       // Forward declaration
+typedef struct PartitionMap PartitionMap; // Forward declaration
+typedef struct Catalog Catalog;           // Forward declaration
+
+/* Tables */
+typedef struct Table {
   uint32_t numRows;
   uint32_t rootPageNum;
   Pager *pager;
+  NodeType leafFormat;     // Format used whenever a leaf is (re)written
+  NodeType internalFormat; // Same for internal nodes (buffered or not)
+  LsmTree *lsm;            // Set (and pager null) for LSM tables
+  uint32_t numShards;      // Set (pager and lsm null) for sharded tables
+  struct Table **shards;   // One table per DB file, see dbOpen()
+  ShardPool *shardPool;
+  PartitionMap *partitionMap; // Set (pager and lsm null) if partitioned
+  Catalog *catalog;           // Tables attached, see tableCatalog()
 } Table;
 
 /* Represents location in the Table */
@@ -189,15 +783,15 @@ typedef struct {
  *      | Leaf Node Body (Array of Cells)                   |
  *      |   ┌─────────────────────────┐                     |
  *      |   | Cell 0:                 |                     |
- *      |   |   - Key (4 bytes)       |                     |
+ *      |   |   - Key (8 bytes)       |                     |
  *      |   |   - Value (ROW_SIZE)    |                     |
  *      |   ├─────────────────────────┤                     |
  *      |   | Cell 1:                 |                     |
- *      |   |   - Key (4 bytes)       |                     |
+ *      |   |   - Key (8 bytes)       |                     |
  *      |   |   - Value (ROW_SIZE)    |                     |
  *      |   ├─────────────────────────┤       ...           |
  *      |   | Cell n:                 |                     |
- *      |   |   - Key (4 bytes)       |                     |
+ *      |   |   - Key (8 bytes)       |                     |
  *      |   |   - Value (ROW_SIZE)    |                     |
  *      |   └─────────────────────────┘                     |
  *      +---------------------------------------------------+
@@ -211,456 +805,7700 @@ void *leafNodeCell(void *node, uint32_t cellNum) {
   return (char *)node + LEAF_NODE_HEADER_SIZE + cellNum * LEAF_NODE_CELL_SIZE;
 }
 
-uint32_t *leafNodeKey(void *node, uint32_t cellNum) {
-  return (uint32_t *)leafNodeCell(node, cellNum);
+bool isLeafNode(void *node) {
+  NodeType type = getNodeType(node);
+  return type == NODE_LEAF || type == NODE_LEAF_PACKED || type == NODE_LEAF_PAX;
 }
 
-void *leafNodeValue(void *node, uint32_t cellNum) {
-  return (char *)leafNodeCell(node, cellNum) + LEAF_NODE_KEY_SIZE;
+/* Packed and PAX leaves both store keys as a frame of reference */
+bool hasPackedKeys(void *node) {
+  NodeType type = getNodeType(node);
+  return type == NODE_LEAF_PACKED || type == NODE_LEAF_PAX;
 }
 
-void initializeLeafNode(void *node) {
-  setNodeType(node, NODE_LEAF);
-  *leafNodeNumCells(node) = 0;
+uint8_t *leafNodeKey(void *node, uint32_t cellNum) {
+  return (uint8_t *)leafNodeCell(node, cellNum);
 }
 
-/* Priting Rows */
-inline void printRow(Row *row) {
-  std::cout << "ID: " << row->id << ", Username: " << row->username
-            << ", Email: " << row->email << "\n";
+void *leafNodeValue(void *node, uint32_t cellNum) {
+  return (char *)leafNodeCell(node, cellNum) + LEAF_NODE_KEY_SIZE;
 }
 
-void printConstants() {
-  std::cout << "ROW_SIZE : " << ROW_SIZE << "\n";
-  std::cout << "COMMON_NODE_HEADER_SIZE : " << (int)COMMON_NODE_HEADER_SIZE
-            << "\n";
-  std::cout << "LEAF_NODE_HEADER_SIZE : " << LEAF_NODE_HEADER_SIZE << "\n";
-  std::cout << "LEAF_NODE_CELL_SIZE : " << LEAF_NODE_CELL_SIZE << "\n";
-  std::cout << "LEAF_NODE_SPACE_FOR_CELLS : " << LEAF_NODE_SPACE_FOR_CELLS
-            << "\n";
-  std::cout << "LEAF_NODE_MAX_CELLS : " << LEAF_NODE_MAX_CELLS << "\n";
+uint32_t *leafNodeNextLeaf(void *node) {
+  return (uint32_t *)((char *)node + LEAF_NODE_NEXT_LEAF_OFFSET);
 }
 
-void printLeafNode(void *node) {
-  uint32_t numCells = *leafNodeNumCells(node);
-  std::cout << "Leaf (Size : " << numCells << ")" << "\n";
-  for (uint32_t i = 0; i < numCells; ++i) {
-    uint32_t key = *leafNodeKey(node, i);
-    std::cout << "    - " << i << " : " << key << "\n";
-  }
+void initializeLeafNode(void *node) {
+  setNodeType(node, NODE_LEAF);
+  setNodeRoot(node, false);
+  *leafNodeNumCells(node) = 0;
+  *leafNodeNextLeaf(node) = 0; // 0 represents no sibling
 }
 
-typedef struct {
-  COMMAND_TYPE type;
-  Row toBeInserted; // only used by INSERT command
-} Command;
-
 /**
- * @brief Opens DB file and keeps track of its size. Also initialize the page
- *        cache to all null
- *
- * @param fileName
- * @return Pager*
+ * @brief Functions for accessing a Packed Leaf Node.
  */
-Pager *pagerOpen(const std::string &fileName) {
-  int fileDesc = open(fileName.c_str(),
-                      O_RDWR |     // Read/Write mode
-                          O_CREAT, // Create file if it doesn't exist
-                      S_IWUSR |    // User write permission
-                          S_IRUSR  // User read permission
-  );
 
-  if (fileDesc == -1) {
-    std::cerr << "Unable to open file " << fileName << '\n';
-    exit(EXIT_FAILURE);
-  }
+uint64_t *leafPackedBase(void *node) {
+  return (uint64_t *)((char *)node + LEAF_PACKED_BASE_OFFSET);
+}
 
-  off_t fileLength = lseek(fileDesc, 0, SEEK_END);
+uint8_t *leafPackedBitWidth(void *node) {
+  return (uint8_t *)node + LEAF_PACKED_BIT_WIDTH_OFFSET;
+}
 
-  Pager *pager = (Pager *)malloc(sizeof(Pager));
-  pager->fd = fileDesc;
-  pager->fileSize = fileLength;
-  pager->numPages = (fileLength / PAGE_SIZE);
+uint8_t *leafPackedDeltas(void *node) {
+  return (uint8_t *)node + LEAF_PACKED_HEADER_SIZE;
+}
 
-  if (fileLength % PAGE_SIZE != 0 && fileLength > 0) {
-    std::cerr
-        << "DB file doesn't have whole number of Pages. Corrupted file.\n";
-    exit(EXIT_FAILURE);
-  }
+inline uint32_t packedDeltaBytes(uint32_t count, uint32_t bitWidth) {
+  return (count * bitWidth + 7) / 8;
+}
 
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; ++i) {
-    pager->pages[i] = nullptr;
-  }
-  return pager;
+void *leafPackedValue(void *node, uint32_t cellNum) {
+  uint32_t numCells = *leafNodeNumCells(node);
+  return (char *)node + LEAF_PACKED_HEADER_SIZE +
+         packedDeltaBytes(numCells, *leafPackedBitWidth(node)) +
+         cellNum * LEAF_PACKED_VALUE_SIZE;
 }
 
 /**
- * @brief Handles cache miss of the asked page \p pageNum
- *
- * @param pager
- * @param pageNum
- * @return void pointer to the page
+ * @brief Extracts delta \p index from a bit-packed array.
+ * @note  Up to 56 bits wide a delta is one unaligned 64-bit load, a shift and
+ *        a mask, with no branch on the index, so unpacking a whole array
+ *        vectorises. Wider deltas straddle a second word. The load may run
+ *        past the array into the values that follow, which are masked out.
  */
-void *getPage(Pager *pager, uint32_t pageNum) {
-  if (pageNum > TABLE_MAX_PAGES) {
-    std::cout << "Tried to fetch page out of bounds. " << pageNum << " > "
-              << TABLE_MAX_PAGES << '\n';
-    exit(EXIT_FAILURE);
+inline uint64_t packedDeltaAt(const uint8_t *deltas, uint32_t bitWidth,
+                              uint32_t index) {
+  if (bitWidth == 0) {
+    return 0;
   }
+  uint64_t mask = bitWidth == 64 ? ~(uint64_t)0 : ((uint64_t)1 << bitWidth) - 1;
+  uint64_t bit = (uint64_t)index * bitWidth;
+  uint64_t word;
+  memcpy(&word, deltas + bit / 8, sizeof(word));
+  uint64_t value = le64toh(word) >> (bit % 8);
+  if (bitWidth > 56 && (bit % 8) + bitWidth > 64) {
+    value |= (uint64_t)deltas[bit / 8 + 8] << (64 - bit % 8);
+  }
+  return value & mask;
+}
 
-  // Cache Miss. Allocate memory & load from file
-  if (pager->pages[pageNum] == nullptr) {
-    void *page = malloc(PAGE_SIZE);
-    uint32_t noOfPages = pager->fileSize / PAGE_SIZE;
-
-    // We might need to read a partial page at the end of the file
-    if (pageNum <= noOfPages) {
-      lseek(pager->fd, pageNum * PAGE_SIZE, SEEK_SET);
-      ssize_t bytes = read(pager->fd, page, PAGE_SIZE);
-      if (bytes < 0) {
-        std::cerr << "Error reading file: " << std::strerror(errno) << '\n';
-        exit(EXIT_FAILURE);
-      }
-    }
-    pager->pages[pageNum] = page;
+/* Unpacks \p count deltas into \p dst */
+void unpackDeltas(const uint8_t *deltas, uint32_t bitWidth, uint32_t count,
+                  uint64_t *dst) {
+  for (uint32_t i = 0; i < count; ++i) {
+    dst[i] = packedDeltaAt(deltas, bitWidth, i);
+  }
+}
 
-    if (pageNum >= pager->numPages) {
-      pager->numPages = pageNum + 1;
+/* Packs \p count deltas of \p bitWidth bits each into \p dst */
+void packDeltas(const uint64_t *src, uint32_t count, uint32_t bitWidth,
+                uint8_t *dst) {
+  memset(dst, 0, packedDeltaBytes(count, bitWidth));
+  for (uint32_t i = 0; i < count; ++i) {
+    uint64_t bit = (uint64_t)i * bitWidth;
+    for (uint32_t done = 0; done < bitWidth;) {
+      uint32_t offset = (bit + done) % 8;
+      uint32_t take = std::min(8 - offset, bitWidth - done);
+      uint8_t chunk = (uint8_t)((src[i] >> done) & ((1u << take) - 1));
+      dst[(bit + done) / 8] |= (uint8_t)(chunk << offset);
+      done += take;
     }
   }
-  return pager->pages[pageNum];
 }
 
-Table *dbOpen(const std::string &fileName) {
-  Pager *pager = pagerOpen(fileName);
+inline uint32_t bitWidthFor(uint64_t maxDelta) {
+  uint32_t bitWidth = 0;
+  while (bitWidth < 64 && (maxDelta >> bitWidth) != 0) {
+    ++bitWidth;
+  }
+  return bitWidth;
+}
 
-  Table *table = (Table *)malloc(sizeof(Table));
-  table->pager = pager;
-  table->rootPageNum = 0;
+/* Start of the username minipage of a PAX leaf */
+char *leafPaxUsernames(void *node) {
+  uint32_t numCells = *leafNodeNumCells(node);
+  return (char *)node + LEAF_PACKED_HEADER_SIZE +
+         packedDeltaBytes(numCells, *leafPackedBitWidth(node));
+}
 
-  if (pager->numPages == 0) { // New DB file. Initialize page 0 as leaf node.
-    void *rootNode = getPage(pager, 0);
-    initializeLeafNode(rootNode);
-  }
+/* Start of the email minipage of a PAX leaf */
+char *leafPaxEmails(void *node) {
+  return leafPaxUsernames(node) + *leafNodeNumCells(node) * USERNAME_SIZE;
+}
 
-  return table;
+/* Integer key of cell \p cellNum of a packed leaf */
+inline uint64_t leafPackedKeyAt(void *node, uint32_t cellNum) {
+  return *leafPackedBase(node) +
+         packedDeltaAt(leafPackedDeltas(node), *leafPackedBitWidth(node),
+                       cellNum);
 }
 
-/* Create new Cursor for the Start of Table */
-Cursor *tableStart(Table *table) {
-  Cursor *cursor = (Cursor *)malloc(sizeof(Cursor));
-  cursor->table = table;
-  cursor->pageNum = table->rootPageNum;
-  cursor->endOfTable = false;
-  void *rootNode = getPage(table->pager, table->rootPageNum);
-  uint32_t numCells = *leafNodeNumCells(rootNode);
-  cursor->cellNum = 0;
+/**
+ * @brief Generic leaf accessors, valid for every leaf format.
+ */
 
-  // If table is empty, set endOfTable to true
-  if (numCells == 0) {
-    cursor->endOfTable = true;
+void leafNodeGetKey(void *node, uint32_t cellNum, uint8_t *dst) {
+  if (hasPackedKeys(node)) {
+    encodeKeyColumn(leafPackedKeyAt(node, cellNum), dst);
+  } else {
+    memcpy(dst, leafNodeKey(node, cellNum), KEY_SIZE);
   }
-
-  return cursor;
 }
 
-/* Create new Cursor for the End of Table */
-Cursor *tableEnd(Table *table) {
-  Cursor *cursor = (Cursor *)malloc(sizeof(Cursor));
-  cursor->table = table;
-  cursor->pageNum = table->rootPageNum;
+/* Copies cell \p cellNum out as a serialised row (ROW_SIZE bytes) */
+void leafNodeGetValue(void *node, uint32_t cellNum, void *dst) {
+  if (getNodeType(node) == NODE_LEAF_PACKED) {
+    uint64_t id = leafPackedKeyAt(node, cellNum);
+    memcpy((char *)dst + ID_OFFSET, &id, ID_SIZE);
+    memcpy((char *)dst + ID_SIZE, leafPackedValue(node, cellNum),
+           LEAF_PACKED_VALUE_SIZE);
+  } else if (getNodeType(node) == NODE_LEAF_PAX) {
+    uint64_t id = leafPackedKeyAt(node, cellNum);
+    memcpy((char *)dst + ID_OFFSET, &id, ID_SIZE);
+    memcpy((char *)dst + USERNAME_OFFSET,
+           leafPaxUsernames(node) + cellNum * USERNAME_SIZE, USERNAME_SIZE);
+    memcpy((char *)dst + EMAIL_OFFSET,
+           leafPaxEmails(node) + cellNum * EMAIL_SIZE, EMAIL_SIZE);
+  } else {
+    memcpy(dst, leafNodeValue(node, cellNum), LEAF_NODE_VALUE_SIZE);
+  }
+}
 
-  void *rootNode = getPage(table->pager, table->rootPageNum);
-  uint32_t numCells = *leafNodeNumCells(rootNode);
-  cursor->cellNum = numCells;
-  cursor->endOfTable = true;
+/**
+ * @brief Decoded form of a leaf node, used to insert into, split or convert
+ *        leaves of any format.
+ * @note  keys holds full encoded keys (KEY_SIZE each) and values full
+ *        serialised rows (ROW_SIZE each), in key order.
+ */
+typedef struct {
+  std::vector<uint8_t> keys;
+  std::vector<uint8_t> values;
+} LeafNodeImage;
 
-  return cursor;
+inline uint32_t leafImageNumCells(const LeafNodeImage &image) {
+  return image.keys.size() / KEY_SIZE;
 }
 
-void cursorAdvance(Cursor *cursor) {
-  void *node = getPage(cursor->table->pager, cursor->pageNum);
-  cursor->cellNum += 1;
-
-  if (cursor->cellNum >= *leafNodeNumCells(node)) {
-    cursor->endOfTable = true;
+void leafNodeDecode(void *node, LeafNodeImage &image) {
+  uint32_t numCells = *leafNodeNumCells(node);
+  image.keys.resize(numCells * KEY_SIZE);
+  image.values.resize(numCells * ROW_SIZE);
+  for (uint32_t i = 0; i < numCells; ++i) {
+    leafNodeGetKey(node, i, &image.keys[i * KEY_SIZE]);
+    leafNodeGetValue(node, i, &image.values[i * ROW_SIZE]);
   }
 }
 
 /**
- * @brief Find the leaf node for the given table's key
- *
- * @param table
- * @param pageNum
- * @param key
- * @return Cursor pointer
+ * @brief Writes \p image into \p node using leaf \p format. The root flag,
+ *        parent and next leaf are kept.
+ * @return false (leaving the node untouched) if the image does not fit
+ */
+bool leafNodeEncode(void *node, const LeafNodeImage &image, NodeType format) {
+  uint32_t numCells = leafImageNumCells(image);
+
+  if (format == NODE_LEAF) {
+    if (numCells > LEAF_NODE_MAX_CELLS) {
+      return false;
+    }
+    setNodeType(node, NODE_LEAF);
+    *leafNodeNumCells(node) = numCells;
+    for (uint32_t i = 0; i < numCells; ++i) {
+      memcpy(leafNodeKey(node, i), &image.keys[i * KEY_SIZE], KEY_SIZE);
+      memcpy(leafNodeValue(node, i), &image.values[i * ROW_SIZE], ROW_SIZE);
+    }
+    return true;
+  }
+
+  std::vector<uint64_t> deltas(numCells);
+  uint64_t base =
+      numCells > 0 ? decodeKeyColumn(&image.keys[0]) : 0;
+  for (uint32_t i = 0; i < numCells; ++i) {
+    deltas[i] = decodeKeyColumn(&image.keys[i * KEY_SIZE]) - base;
+  }
+  uint32_t bitWidth = numCells > 0 ? bitWidthFor(deltas[numCells - 1]) : 0;
+  if (LEAF_PACKED_HEADER_SIZE + packedDeltaBytes(numCells, bitWidth) +
+          numCells * LEAF_PACKED_VALUE_SIZE >
+      PAGE_SIZE) {
+    return false;
+  }
+
+  setNodeType(node, format);
+  *leafNodeNumCells(node) = numCells;
+  *leafPackedBase(node) = base;
+  *leafPackedBitWidth(node) = bitWidth;
+  packDeltas(deltas.data(), numCells, bitWidth, leafPackedDeltas(node));
+  for (uint32_t i = 0; i < numCells; ++i) {
+    const uint8_t *value = &image.values[i * ROW_SIZE];
+    if (format == NODE_LEAF_PAX) {
+      memcpy(leafPaxUsernames(node) + i * USERNAME_SIZE,
+             value + USERNAME_OFFSET, USERNAME_SIZE);
+      memcpy(leafPaxEmails(node) + i * EMAIL_SIZE, value + EMAIL_OFFSET,
+             EMAIL_SIZE);
+    } else {
+      memcpy(leafPackedValue(node, i), value + ID_SIZE,
+             LEAF_PACKED_VALUE_SIZE);
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief A leaf worth of rows, one array per column. Only the columns asked
+ *        for are filled.
+ */
+typedef struct {
+  uint32_t numRows;
+  uint64_t ids[LEAF_MAX_CELLS_ANY_FORMAT];
+  char usernames[LEAF_MAX_CELLS_ANY_FORMAT][USERNAME_SIZE];
+  char emails[LEAF_MAX_CELLS_ANY_FORMAT][EMAIL_SIZE];
+} ColumnBatch;
+
+/* Where a SELECT sends its rows, one batch at a time */
+typedef std::function<void(const ColumnBatch *)> BatchSink;
+
+/**
+ * @brief Reads the \p columns of every cell of a leaf into \p batch.
+ * @note  For PAX leaves each column is one unpack or one memcpy of a
+ *        minipage. Row formats have to gather the column cell by cell.
+ */
+void leafNodeReadColumns(void *node, uint32_t columns, ColumnBatch *batch) {
+  uint32_t numCells = *leafNodeNumCells(node);
+  batch->numRows = numCells;
+  if (columns == 0) {
+    return; // Rows are only counted
+  }
+
+  if (getNodeType(node) == NODE_LEAF_PAX) {
+    if (columns & COLUMN_ID) {
+      unpackDeltas(leafPackedDeltas(node), *leafPackedBitWidth(node), numCells,
+                   batch->ids);
+      uint64_t base = *leafPackedBase(node);
+      for (uint32_t i = 0; i < numCells; ++i) {
+        batch->ids[i] += base;
+      }
+    }
+    if (columns & COLUMN_USERNAME) {
+      memcpy(batch->usernames, leafPaxUsernames(node),
+             numCells * USERNAME_SIZE);
+    }
+    if (columns & COLUMN_EMAIL) {
+      memcpy(batch->emails, leafPaxEmails(node), numCells * EMAIL_SIZE);
+    }
+    return;
+  }
+
+  uint8_t value[ROW_SIZE];
+  for (uint32_t i = 0; i < numCells; ++i) {
+    leafNodeGetValue(node, i, value);
+    if (columns & COLUMN_ID) {
+      memcpy(&batch->ids[i], value + ID_OFFSET, ID_SIZE);
+    }
+    if (columns & COLUMN_USERNAME) {
+      memcpy(batch->usernames[i], value + USERNAME_OFFSET, USERNAME_SIZE);
+    }
+    if (columns & COLUMN_EMAIL) {
+      memcpy(batch->emails[i], value + EMAIL_OFFSET, EMAIL_SIZE);
+    }
+  }
+}
+
+/**
+ * @brief Functions for accessing an Internal Node.
+ * @example
+ *      +---------------------------------------------------+
+ *      | Common Node Header (6 bytes)                      |
+ *      +---------------------------------------------------+
+ *      | Internal Node Header (18 bytes)                   |
+ *      |   - Number of Keys, Right Child                   |
+ *      |   - Prefix Length, Slot Width, Common Prefix      |
+ *      +---------------------------------------------------+
+ *      | Internal Node Body (Array of Cells)               |
+ *      |   | Child 0 | Slot 0 | Child 1 | Slot 1 | ...     |
+ *      +---------------------------------------------------+
+ */
+
+uint32_t *internalNodeNumKeys(void *node) {
+  return (uint32_t *)((char *)node + INTERNAL_NODE_NUM_KEYS_OFFSET);
+}
+
+uint32_t *internalNodeRightChild(void *node) {
+  return (uint32_t *)((char *)node + INTERNAL_NODE_RIGHT_CHILD_OFFSET);
+}
+
+uint8_t *internalNodePrefixLen(void *node) {
+  return (uint8_t *)node + INTERNAL_NODE_PREFIX_LEN_OFFSET;
+}
+
+uint8_t *internalNodeSlotWidth(void *node) {
+  return (uint8_t *)node + INTERNAL_NODE_SLOT_WIDTH_OFFSET;
+}
+
+uint8_t *internalNodePrefix(void *node) {
+  return (uint8_t *)node + INTERNAL_NODE_PREFIX_OFFSET;
+}
+
+/* Buffer page of a buffered internal node, 0 if it has none yet */
+uint32_t *internalNodeBufferPage(void *node) {
+  return (uint32_t *)((char *)node + INTERNAL_NODE_BUFFER_PAGE_OFFSET);
+}
+
+inline uint32_t internalNodeHeaderSize(NodeType type) {
+  return type == NODE_INTERNAL_BUFFERED ? INTERNAL_NODE_BUFFERED_HEADER_SIZE
+                                        : INTERNAL_NODE_HEADER_SIZE;
+}
+
+inline uint32_t internalNodeCellSize(void *node) {
+  return INTERNAL_NODE_CHILD_SIZE + *internalNodeSlotWidth(node);
+}
+
+void *internalNodeCell(void *node, uint32_t cellNum) {
+  return (char *)node + internalNodeHeaderSize(getNodeType(node)) +
+         cellNum * internalNodeCellSize(node);
+}
+
+/* Child \p childNum, where childNum == numKeys is the right child */
+uint32_t *internalNodeChild(void *node, uint32_t childNum) {
+  uint32_t numKeys = *internalNodeNumKeys(node);
+  if (childNum > numKeys) {
+    std::cerr << "Tried to access childNum " << childNum << " > numKeys "
+              << numKeys << '\n';
+    exit(EXIT_FAILURE);
+  }
+  if (childNum == numKeys) {
+    return internalNodeRightChild(node);
+  }
+  return (uint32_t *)internalNodeCell(node, childNum);
+}
+
+uint8_t *internalNodeSlot(void *node, uint32_t keyNum) {
+  return (uint8_t *)internalNodeCell(node, keyNum) + INTERNAL_NODE_CHILD_SIZE;
+}
+
+/* Rebuilds the full separator \p keyNum (prefix + slot + zero padding) */
+void internalNodeKey(void *node, uint32_t keyNum, uint8_t *dst) {
+  uint8_t prefixLen = *internalNodePrefixLen(node);
+  uint8_t slotWidth = *internalNodeSlotWidth(node);
+  memset(dst, 0, KEY_SIZE);
+  memcpy(dst, internalNodePrefix(node), prefixLen);
+  memcpy(dst + prefixLen, internalNodeSlot(node, keyNum), slotWidth);
+}
+
+/**
+ * @brief Compares a full search key against separator \p keyNum without
+ *        materialising the separator.
+ * @return <0, 0 or >0 as \p key is below, equal to or above the separator
+ */
+int internalNodeCompareKey(void *node, uint32_t keyNum, const uint8_t *key) {
+  uint8_t prefixLen = *internalNodePrefixLen(node);
+  uint8_t slotWidth = *internalNodeSlotWidth(node);
+  int cmp = memcmp(key, internalNodePrefix(node), prefixLen);
+  if (cmp != 0) {
+    return cmp;
+  }
+  cmp = memcmp(key + prefixLen, internalNodeSlot(node, keyNum), slotWidth);
+  if (cmp != 0) {
+    return cmp;
+  }
+  // Separator is zero padded. Any non-zero byte left makes the key larger.
+  for (uint32_t i = prefixLen + slotWidth; i < KEY_SIZE; ++i) {
+    if (key[i] != 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Index of the child that may contain \p key (numKeys for right child) */
+uint32_t internalNodeFindChild(void *node, const uint8_t *key) {
+  uint32_t numKeys = *internalNodeNumKeys(node);
+
+  // Binary search for the first separator strictly above the key
+  uint32_t minInd = 0;
+  uint32_t maxInd = numKeys;
+  while (minInd != maxInd) {
+    uint32_t ind = (minInd + maxInd) / 2;
+    if (internalNodeCompareKey(node, ind, key) < 0) {
+      maxInd = ind;
+    } else {
+      minInd = ind + 1;
+    }
+  }
+  return minInd;
+}
+
+void initializeInternalNode(void *node, NodeType format) {
+  setNodeType(node, format);
+  if (format == NODE_INTERNAL_BUFFERED) {
+    *internalNodeBufferPage(node) = 0;
+  }
+  setNodeRoot(node, false);
+  *internalNodeNumKeys(node) = 0;
+  *internalNodeRightChild(node) = 0;
+  *internalNodePrefixLen(node) = 0;
+  *internalNodeSlotWidth(node) = 0;
+}
+
+/**
+ * @brief Decoded form of an internal node, used while restructuring it.
+ * @note  keys holds numKeys full separators back to back (KEY_SIZE each) and
+ *        children holds numKeys + 1 page numbers, the last one being the
+ *        right child. bufferPageNum is carried over to a buffered node.
+ */
+typedef struct {
+  std::vector<uint32_t> children;
+  std::vector<uint8_t> keys;
+  uint32_t bufferPageNum = 0;
+} InternalNodeImage;
+
+inline uint32_t internalImageNumKeys(const InternalNodeImage &image) {
+  return image.keys.size() / KEY_SIZE;
+}
+
+void internalNodeDecode(void *node, InternalNodeImage &image) {
+  uint32_t numKeys = *internalNodeNumKeys(node);
+  image.children.resize(numKeys + 1);
+  image.keys.resize(numKeys * KEY_SIZE);
+  for (uint32_t i = 0; i < numKeys; ++i) {
+    image.children[i] = *internalNodeChild(node, i);
+    internalNodeKey(node, i, &image.keys[i * KEY_SIZE]);
+  }
+  image.children[numKeys] = *internalNodeRightChild(node);
+  image.bufferPageNum = getNodeType(node) == NODE_INTERNAL_BUFFERED
+                            ? *internalNodeBufferPage(node)
+                            : 0;
+}
+
+/* Number of significant bytes once trailing zero bytes are dropped */
+uint32_t keySignificantLength(const uint8_t *key) {
+  uint32_t len = KEY_SIZE;
+  while (len > 0 && key[len - 1] == 0) {
+    --len;
+  }
+  return len;
+}
+
+/**
+ * @brief Writes \p image into \p node in \p format, choosing the common
+ *        prefix and the narrowest slot width that holds every separator.
+ * @return false (leaving the node untouched) if the image does not fit
+ * @note  Re-encoding a buffered node as plain drops its buffer, which must be
+ *        empty by then.
+ */
+bool internalNodeEncode(void *node, const InternalNodeImage &image,
+                        NodeType format) {
+  uint32_t numKeys = internalImageNumKeys(image);
+  uint32_t prefixLen = 0;
+  uint32_t slotWidth = 0;
+
+  if (numKeys > 0) {
+    // Keys are sorted, so the prefix of the set is the one of its extremes
+    const uint8_t *first = &image.keys[0];
+    const uint8_t *last = &image.keys[(numKeys - 1) * KEY_SIZE];
+    while (prefixLen < KEY_SIZE && first[prefixLen] == last[prefixLen]) {
+      ++prefixLen;
+    }
+    uint32_t maxLen = prefixLen;
+    for (uint32_t i = 0; i < numKeys; ++i) {
+      uint32_t len = keySignificantLength(&image.keys[i * KEY_SIZE]);
+      if (len > maxLen) {
+        maxLen = len;
+      }
+    }
+    slotWidth = maxLen - prefixLen;
+  }
+
+  uint32_t cellSize = INTERNAL_NODE_CHILD_SIZE + slotWidth;
+  uint32_t spaceForCells = format == NODE_INTERNAL_BUFFERED
+                               ? INTERNAL_NODE_BUFFERED_SPACE_FOR_CELLS
+                               : INTERNAL_NODE_SPACE_FOR_CELLS;
+  if (numKeys > INTERNAL_NODE_MAX_KEYS || numKeys * cellSize > spaceForCells) {
+    return false;
+  }
+
+  setNodeType(node, format);
+  if (format == NODE_INTERNAL_BUFFERED) {
+    *internalNodeBufferPage(node) = image.bufferPageNum;
+  }
+  *internalNodeNumKeys(node) = numKeys;
+  *internalNodePrefixLen(node) = prefixLen;
+  *internalNodeSlotWidth(node) = slotWidth;
+  memset(internalNodePrefix(node), 0, INTERNAL_NODE_PREFIX_SIZE);
+  if (numKeys > 0) {
+    memcpy(internalNodePrefix(node), &image.keys[0], prefixLen);
+  }
+  for (uint32_t i = 0; i < numKeys; ++i) {
+    *internalNodeChild(node, i) = image.children[i];
+    memcpy(internalNodeSlot(node, i), &image.keys[i * KEY_SIZE + prefixLen],
+           slotWidth);
+  }
+  *internalNodeRightChild(node) = image.children[numKeys];
+  return true;
+}
+
+/**
+ * @brief Suffix truncation : computes the shortest separator that still
+ *        splits \p leftMax from \p rightMin (leftMax < sep <= rightMin).
+ * @note  That is rightMin cut right after the first byte where the two keys
+ *        differ, zero padded to KEY_SIZE.
+ */
+void truncateSeparator(const uint8_t *leftMax, const uint8_t *rightMin,
+                       uint8_t *sep) {
+  uint32_t common = 0;
+  while (common < KEY_SIZE && leftMax[common] == rightMin[common]) {
+    ++common;
+  }
+  memset(sep, 0, KEY_SIZE);
+  memcpy(sep, rightMin, common < KEY_SIZE ? common + 1 : KEY_SIZE);
+}
+
+/* Priting Rows */
+inline void printRow(Row *row) {
+  std::cout << "ID: " << row->id << ", Username: " << row->username
+            << ", Email: " << row->email << "\n";
+}
+
+void printConstants() {
+  std::cout << "ROW_SIZE : " << ROW_SIZE << "\n";
+  std::cout << "KEY_SIZE : " << KEY_SIZE << "\n";
+  std::cout << "COMMON_NODE_HEADER_SIZE : " << (int)COMMON_NODE_HEADER_SIZE
+            << "\n";
+  std::cout << "LEAF_NODE_HEADER_SIZE : " << LEAF_NODE_HEADER_SIZE << "\n";
+  std::cout << "LEAF_NODE_CELL_SIZE : " << LEAF_NODE_CELL_SIZE << "\n";
+  std::cout << "LEAF_NODE_SPACE_FOR_CELLS : " << LEAF_NODE_SPACE_FOR_CELLS
+            << "\n";
+  std::cout << "LEAF_NODE_MAX_CELLS : " << LEAF_NODE_MAX_CELLS << "\n";
+  std::cout << "LEAF_PACKED_MAX_CELLS : " << LEAF_PACKED_MAX_CELLS << "\n";
+  std::cout << "INTERNAL_NODE_HEADER_SIZE : " << INTERNAL_NODE_HEADER_SIZE
+            << "\n";
+  std::cout << "INTERNAL_NODE_MAX_KEYS : " << INTERNAL_NODE_MAX_KEYS << "\n";
+  std::cout << "MESSAGE_BUFFER_MAX_MESSAGES : " << MESSAGE_BUFFER_MAX_MESSAGES
+            << "\n";
+}
+
+typedef struct {
+  COMMAND_TYPE type;
+  Row toBeInserted; // only used by INSERT command
+  uint32_t columns; // COLUMN_MASK, only used by SELECT command
+  bool countRows;   // SELECT COUNT(*), columns is then 0
+  uint64_t minId;   // SELECT ... WHERE : the ids asked for, none if
+  uint64_t maxId;   // minId > maxId. 0 and UINT64_MAX without WHERE
+  std::string fromTable; // SELECT ... FROM, `main` without FROM. The
+                         // table of ANALYZE, every table if empty
+  std::string joinTable; // JOIN ... ON fromTable.fromColumn =
+  uint32_t fromColumn;   // joinTable.joinColumn, empty without JOIN
+  uint32_t joinColumn;
+  bool explain; // EXPLAIN SELECT : the plan is printed instead of run
+} Command;
+
+/**
+ * @brief Page codec : a byte oriented run-length scheme (PackBits). Rows are
+ *        mostly the NUL padding of username and email, which collapses to a
+ *        couple of bytes per run.
+ * @details The stream is a sequence of runs, each starting with a control
+ * byte c :
+ *      c <  128 : c + 1 literal bytes follow
+ *      c >= 128 : the next byte is repeated c - 125 times (3 ... 130)
+ * @return compressed length, or PAGE_SIZE if the page does not shrink (it is
+ *         then stored raw)
+ */
+const uint32_t CODEC_MAX_LITERAL_RUN = 128;
+const uint32_t CODEC_MIN_REPEAT_RUN = 3;
+const uint32_t CODEC_MAX_REPEAT_RUN = 130;
+
+uint32_t compressPage(const uint8_t *src, uint8_t *dst) {
+  uint32_t in = 0, out = 0;
+  uint32_t literalStart = 0;
+
+  auto flushLiterals = [&](uint32_t end) {
+    while (literalStart < end) {
+      uint32_t count = std::min(end - literalStart, CODEC_MAX_LITERAL_RUN);
+      dst[out++] = (uint8_t)(count - 1);
+      memcpy(dst + out, src + literalStart, count);
+      out += count;
+      literalStart += count;
+    }
+  };
+
+  while (in < PAGE_SIZE) {
+    uint32_t run = 1;
+    while (in + run < PAGE_SIZE && run < CODEC_MAX_REPEAT_RUN &&
+           src[in + run] == src[in]) {
+      ++run;
+    }
+    if (run >= CODEC_MIN_REPEAT_RUN) {
+      flushLiterals(in);
+      dst[out++] = (uint8_t)(run + 125);
+      dst[out++] = src[in];
+      in += run;
+      literalStart = in;
+    } else {
+      in += run;
+    }
+    // Worst case output so far, pending literals included
+    uint32_t pending = in - literalStart;
+    if (out + pending + pending / CODEC_MAX_LITERAL_RUN + 3 >= PAGE_SIZE) {
+      return PAGE_SIZE; // Not worth it, keep the page raw
+    }
+  }
+  flushLiterals(PAGE_SIZE);
+  return out < PAGE_SIZE ? out : PAGE_SIZE;
+}
+
+void decompressPage(const uint8_t *src, uint32_t length, uint8_t *dst) {
+  if (length == PAGE_SIZE) {
+    memcpy(dst, src, PAGE_SIZE);
+    return;
+  }
+  uint32_t in = 0, out = 0;
+  while (in < length) {
+    uint8_t control = src[in++];
+    uint32_t count = control < 128 ? control + 1u : control - 125u;
+    if (out + count > PAGE_SIZE ||
+        in + (control < 128 ? count : 1) > length) {
+      std::cerr << "Corrupted compressed page.\n";
+      exit(EXIT_FAILURE);
+    }
+    if (control < 128) {
+      memcpy(dst + out, src + in, count);
+      in += count;
+    } else {
+      memset(dst + out, src[in++], count);
+    }
+    out += count;
+  }
+  if (out != PAGE_SIZE) {
+    std::cerr << "Corrupted compressed page.\n";
+    exit(EXIT_FAILURE);
+  }
+}
+
+/**
+ * @brief Compressed DB file layout
+ * @details Pages have variable size once compressed, so they cannot sit at
+ * pageNum * PAGE_SIZE. The file starts with a header block, followed by
+ * page extents placed anywhere, and a page map saying where each page is.
+ * The map is rewritten at a new place on close and the header then points
+ * to it.
+ * @note Extents are reserved in EXTENT_GRANULE steps, so a page growing a
+ * little can be rewritten in place. Holes left by relocated pages (and by
+ * the previous map) are reused first fit.
+ * @example
+ *      +-----------------------------+  ← Offset 0
+ *      | Magic (8 bytes)             |  ← "SQLCPPZ" + NUL
+ *      | Number of Pages (4 bytes)   |
+ *      | Map Offset (8 bytes)        |
+ *      | Map Length (4 bytes)        |
+ *      +-----------------------------+  ← Offset PAGE_SIZE (header block)
+ *      | Page extents, map ...       |
+ *      +-----------------------------+
+ *
+ *      Map entry : | Offset (8) | Length (4) | Capacity (4) |
+ */
+const char COMPRESSED_MAGIC[8] = "SQLCPPZ";
+const uint32_t COMPRESSED_MAGIC_SIZE = sizeof(COMPRESSED_MAGIC);
+const uint32_t COMPRESSED_NUM_PAGES_OFFSET = COMPRESSED_MAGIC_SIZE;
+const uint32_t COMPRESSED_MAP_OFFSET_OFFSET = COMPRESSED_NUM_PAGES_OFFSET + 4;
+const uint32_t COMPRESSED_MAP_LENGTH_OFFSET = COMPRESSED_MAP_OFFSET_OFFSET + 8;
+const uint32_t COMPRESSED_HEADER_BLOCK_SIZE = PAGE_SIZE;
+const uint32_t EXTENT_GRANULE = 64;
+
+/**
+ * @brief Fails opening a database with \p message : fatal, unless the caller
+ *        passed \p error to get the message back (`.attach` does).
+ */
+void openError(std::string *error, const std::string &message) {
+  if (error == nullptr) {
+    std::cerr << message << '\n';
+    exit(EXIT_FAILURE);
+  }
+  *error = message;
+}
+
+/* Whether \p length bytes at \p offset were read, see openError() */
+bool pagerReadAt(Pager *pager, void *dst, uint32_t length, uint64_t offset,
+                 std::string *error = nullptr) {
+  ssize_t bytes = pread(pager->fd, dst, length, offset);
+  if (bytes != (ssize_t)length) {
+    openError(error, std::string("Error reading file: ") +
+                         (bytes < 0 ? std::strerror(errno) : "short read"));
+    return false;
+  }
+  return true;
+}
+
+void pagerWriteAt(Pager *pager, const void *src, uint32_t length,
+                  uint64_t offset) {
+  ssize_t bytes = pwrite(pager->fd, src, length, offset);
+  if (bytes != (ssize_t)length) {
+    std::cerr << "Error writing to file: "
+              << (bytes < 0 ? std::strerror(errno) : "short write") << '\n';
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* fdatasync() of the DB file or the log, skipped with synchronous = OFF */
+void pagerSync(Pager *pager, int fd) {
+  if (pager->synchronous == SYNCHRONOUS_OFF) {
+    return;
+  }
+  if (fdatasync(fd) == -1) {
+    std::cerr << "Error syncing " << (fd == pager->walFd ? "WAL" : "DB file")
+              << ": " << std::strerror(errno) << '\n';
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Reserves \p length bytes, first fit in the holes, else at the end */
+PageExtent allocateExtent(Pager *pager, uint32_t length) {
+  uint32_t capacity = (length + EXTENT_GRANULE - 1) / EXTENT_GRANULE *
+                      EXTENT_GRANULE;
+  PageExtent extent = {pager->fileEnd, length, capacity};
+
+  for (size_t i = 0; i < pager->freeExtents.size(); ++i) {
+    PageExtent &hole = pager->freeExtents[i];
+    if (hole.capacity >= capacity) {
+      extent.offset = hole.offset;
+      hole.offset += capacity;
+      hole.capacity -= capacity;
+      if (hole.capacity == 0) {
+        pager->freeExtents.erase(pager->freeExtents.begin() + i);
+      }
+      return extent;
+    }
+  }
+  pager->fileEnd += capacity;
+  return extent;
+}
+
+void releaseExtent(Pager *pager, const PageExtent &extent) {
+  if (extent.capacity > 0) {
+    pager->freeExtents.push_back({extent.offset, 0, extent.capacity});
+  }
+}
+
+/**
+ * @brief Loads header and page map of a compressed DB file, and rebuilds the
+ *        list of holes from the gaps between extents.
+ * @return false if the file is corrupted, see openError()
+ */
+bool compressedPagerLoad(Pager *pager, std::string *error) {
+  uint8_t header[COMPRESSED_MAP_LENGTH_OFFSET + 4];
+  if (!pagerReadAt(pager, header, sizeof(header), 0, error)) {
+    return false;
+  }
+  uint64_t mapOffset;
+  uint32_t mapLength;
+  memcpy(&pager->numPages, header + COMPRESSED_NUM_PAGES_OFFSET, 4);
+  memcpy(&mapOffset, header + COMPRESSED_MAP_OFFSET_OFFSET, 8);
+  memcpy(&mapLength, header + COMPRESSED_MAP_LENGTH_OFFSET, 4);
+
+  if (mapLength != pager->numPages * sizeof(PageExtent)) {
+    openError(error, "Corrupted page map in compressed DB file.");
+    return false;
+  }
+  pager->pageMap.resize(pager->numPages);
+  if (mapLength > 0 && !pagerReadAt(pager, pager->pageMap.data(), mapLength,
+                                    mapOffset, error)) {
+    return false;
+  }
+
+  std::vector<PageExtent> used(pager->pageMap);
+  used.push_back({mapOffset, mapLength, mapLength});
+  std::sort(used.begin(), used.end(),
+            [](const PageExtent &a, const PageExtent &b) {
+              return a.offset < b.offset;
+            });
+  uint64_t cursor = COMPRESSED_HEADER_BLOCK_SIZE;
+  for (const PageExtent &extent : used) {
+    if (extent.capacity == 0) {
+      continue;
+    }
+    if (extent.offset > cursor) {
+      pager->freeExtents.push_back(
+          {cursor, 0, (uint32_t)(extent.offset - cursor)});
+    }
+    cursor = std::max(cursor, extent.offset + extent.capacity);
+  }
+  pager->fileEnd = cursor;
+
+  // The map is rewritten on close, its old place becomes a hole then
+  pagerReserve(pager, pager->numPages);
+  pager->freeExtents.push_back({mapOffset, 0, mapLength});
+  return true;
+}
+
+/* Writes the page map to a fresh extent, then points the header at it */
+void compressedPagerSaveMap(Pager *pager) {
+  uint32_t mapLength = pager->numPages * sizeof(PageExtent);
+  PageExtent mapExtent = allocateExtent(pager, mapLength);
+  if (mapLength > 0) {
+    pagerWriteAt(pager, pager->pageMap.data(), mapLength, mapExtent.offset);
+  }
+
+  uint8_t header[COMPRESSED_MAP_LENGTH_OFFSET + 4];
+  memcpy(header, COMPRESSED_MAGIC, COMPRESSED_MAGIC_SIZE);
+  memcpy(header + COMPRESSED_NUM_PAGES_OFFSET, &pager->numPages, 4);
+  memcpy(header + COMPRESSED_MAP_OFFSET_OFFSET, &mapExtent.offset, 8);
+  memcpy(header + COMPRESSED_MAP_LENGTH_OFFSET, &mapLength, 4);
+  pagerWriteAt(pager, header, sizeof(header), 0);
+}
+
+/**
+ * @brief Shadow paged DB file layout (copy-on-write, crash safe)
+ * @details Pages are never overwritten in place. A commit writes every
+ * modified page to a free slot, then the page map (logical page number →
+ * slot) to fresh slots, syncs, and finally writes a meta block saying where
+ * the map is. There are two meta blocks used in turn, on open the valid one
+ * with the highest transaction id wins, so a crash at any point leaves the
+ * previous commit intact and nothing needs replaying.
+ * @note Slots freed by a commit (older page versions, the previous map) are
+ * only handed out again once that commit's meta block is on disk. Every
+ * statement is one commit.
+ * @example
+ *      +-----------------------------+  ← Slot 0 (offset 0)
+ *      | Meta Block 0                |  ← even transaction ids
+ *      +-----------------------------+  ← Slot 1 (offset PAGE_SIZE)
+ *      | Meta Block 1                |  ← odd transaction ids
+ *      +-----------------------------+  ← Slot 2
+ *      | Pages and map chunks, in    |
+ *      | any order, one per slot     |
+ *      +-----------------------------+
+ *
+ *      Meta block : | Magic (8) | Transaction Id (8) | Checksum (8) |
+ *                   | Number of Pages (4) | Number of Map Slots (4) |
+ *                   | Map Slots (4 each) ...                        |
+ */
+const char SHADOW_MAGIC[8] = "SQLCPPW";
+const uint32_t SHADOW_MAGIC_SIZE = sizeof(SHADOW_MAGIC);
+const uint32_t SHADOW_TXN_ID_OFFSET = SHADOW_MAGIC_SIZE;
+const uint32_t SHADOW_CHECKSUM_OFFSET = SHADOW_TXN_ID_OFFSET + 8;
+const uint32_t SHADOW_NUM_PAGES_OFFSET = SHADOW_CHECKSUM_OFFSET + 8;
+const uint32_t SHADOW_NUM_MAP_SLOTS_OFFSET = SHADOW_NUM_PAGES_OFFSET + 4;
+const uint32_t SHADOW_MAP_SLOTS_OFFSET = SHADOW_NUM_MAP_SLOTS_OFFSET + 4;
+const uint32_t SHADOW_MAX_MAP_SLOTS =
+    (PAGE_SIZE - SHADOW_MAP_SLOTS_OFFSET) / sizeof(uint32_t);
+const uint32_t SHADOW_MAP_ENTRIES_PER_SLOT = PAGE_SIZE / sizeof(uint32_t);
+const uint32_t SHADOW_META_SLOTS = 2;
+
+/* FNV-1a over \p length bytes, continuing from \p hash if given */
+uint64_t checksum64(const void *src, size_t length,
+                    uint64_t hash = 0xCBF29CE484222325ull) {
+  const uint8_t *bytes = (const uint8_t *)src;
+  for (size_t i = 0; i < length; ++i) {
+    hash = (hash ^ bytes[i]) * 0x100000001B3ull;
+  }
+  return hash;
+}
+
+/**
+ * @brief Sizes the tables indexed by page number, pages and those of the
+ *        modes \p pager uses, for pages below \p numPages. They grow by half
+ *        again each time, so pagers only pay for the pages their file has.
+ */
+void pagerReserve(Pager *pager, uint32_t numPages) {
+  size_t size = pager->pages.size();
+  if (numPages > size) {
+    size = std::max<size_t>({numPages, size + size / 2,
+                             PAGER_MIN_RESERVED_PAGES});
+    size = std::min<size_t>(size, TABLE_MAX_PAGES);
+  }
+  // Replay workers point pages back at older frames meanwhile
+  std::unique_lock<std::mutex> recoveryGuard;
+  if (pager->walRecovering) {
+    recoveryGuard = std::unique_lock<std::mutex>(pager->recoveryMutex);
+  }
+  pager->pages.resize(std::max(pager->pages.size(), size), nullptr);
+  pager->isTouched.resize(std::max(pager->isTouched.size(), size), false);
+  pager->pageLsn.resize(std::max(pager->pageLsn.size(), size), 0);
+  if (pager->compressed) {
+    pager->pageMap.resize(std::max(pager->pageMap.size(), size),
+                          PageExtent{0, 0, 0});
+  }
+  if (pager->wal) {
+    pager->walIndex.resize(std::max(pager->walIndex.size(), size), 0);
+    pager->walBackfilled.resize(std::max(pager->walBackfilled.size(), size),
+                                0);
+  }
+  // Shadow paging sizes its own, see shadowPagerCommit()
+  if (!pager->shadow && (pager->wal || pager->trackChanges)) {
+    pager->pageHashes.resize(std::max(pager->pageHashes.size(), size), 0);
+  }
+  if (pager->usePool) {
+    pager->pageFrame.resize(std::max(pager->pageFrame.size(), size), -1);
+    pager->ghostSeq.resize(std::max(pager->ghostSeq.size(), size), 0);
+  }
+  if (pager->replica && pager->shippedHashes.size() < size) {
+    uint8_t zeroes[PAGE_SIZE] = {0}; // What the file holds past its end
+    pager->shippedHashes.resize(size, checksum64(zeroes, PAGE_SIZE));
+  }
+}
+
+/* Checksum of a meta block, its checksum field read as zero */
+uint64_t shadowMetaChecksum(const uint8_t *meta) {
+  uint8_t copy[PAGE_SIZE];
+  memcpy(copy, meta, PAGE_SIZE);
+  memset(copy + SHADOW_CHECKSUM_OFFSET, 0, 8);
+  return checksum64(copy, PAGE_SIZE);
+}
+
+/* True if \p meta is an intact meta block */
+bool shadowMetaValid(const uint8_t *meta) {
+  uint64_t checksum;
+  uint32_t numMapSlots;
+  memcpy(&checksum, meta + SHADOW_CHECKSUM_OFFSET, 8);
+  memcpy(&numMapSlots, meta + SHADOW_NUM_MAP_SLOTS_OFFSET, 4);
+  return memcmp(meta, SHADOW_MAGIC, SHADOW_MAGIC_SIZE) == 0 &&
+         numMapSlots <= SHADOW_MAX_MAP_SLOTS &&
+         checksum == shadowMetaChecksum(meta);
+}
+
+uint32_t shadowAllocateSlot(Pager *pager) {
+  if (!pager->freeSlots.empty()) {
+    uint32_t slot = pager->freeSlots.back();
+    pager->freeSlots.pop_back();
+    return slot;
+  }
+  return pager->numSlots++;
+}
+
+/**
+ * @brief Loads the newest intact meta block and its page map, then collects
+ *        every slot the map does not use as free.
+ * @return false if no meta block is valid, see openError()
+ */
+bool shadowPagerLoad(Pager *pager, std::string *error) {
+  uint8_t metas[SHADOW_META_SLOTS][PAGE_SIZE];
+  int32_t newest = -1;
+  uint64_t newestTxnId = 0;
+  for (uint32_t i = 0; i < SHADOW_META_SLOTS; ++i) {
+    memset(metas[i], 0, PAGE_SIZE);
+    if (pread(pager->fd, metas[i], PAGE_SIZE, i * PAGE_SIZE) != PAGE_SIZE ||
+        !shadowMetaValid(metas[i])) {
+      continue;
+    }
+    uint64_t txnId;
+    memcpy(&txnId, metas[i] + SHADOW_TXN_ID_OFFSET, 8);
+    if (newest < 0 || txnId > newestTxnId) {
+      newest = i;
+      newestTxnId = txnId;
+    }
+  }
+  if (newest < 0) {
+    openError(error, "No valid meta block in shadow paged DB file.");
+    return false;
+  }
+
+  const uint8_t *meta = metas[newest];
+  uint32_t numMapSlots;
+  pager->txnId = newestTxnId;
+  memcpy(&pager->numPages, meta + SHADOW_NUM_PAGES_OFFSET, 4);
+  memcpy(&numMapSlots, meta + SHADOW_NUM_MAP_SLOTS_OFFSET, 4);
+  pager->mapSlots.resize(numMapSlots);
+  memcpy(pager->mapSlots.data(), meta + SHADOW_MAP_SLOTS_OFFSET,
+         numMapSlots * sizeof(uint32_t));
+
+  pager->shadowMap.assign(numMapSlots * SHADOW_MAP_ENTRIES_PER_SLOT, 0);
+  for (uint32_t i = 0; i < numMapSlots; ++i) {
+    if (!pagerReadAt(pager, &pager->shadowMap[i * SHADOW_MAP_ENTRIES_PER_SLOT],
+                     PAGE_SIZE, (uint64_t)pager->mapSlots[i] * PAGE_SIZE,
+                     error)) {
+      return false;
+    }
+  }
+  pager->shadowMap.resize(pager->numPages);
+  pager->pageHashes.assign(pager->numPages, 0);
+  pagerReserve(pager, pager->numPages);
+
+  // Slots past the end of a torn write are simply reused
+  pager->numSlots =
+      std::max<uint64_t>(SHADOW_META_SLOTS, pager->fileSize / PAGE_SIZE);
+  std::vector<bool> used(pager->numSlots, false);
+  for (uint32_t slot : pager->shadowMap) {
+    if (slot != 0) {
+      used[slot] = true;
+    }
+  }
+  for (uint32_t slot : pager->mapSlots) {
+    used[slot] = true;
+  }
+  for (uint32_t slot = SHADOW_META_SLOTS; slot < pager->numSlots; ++slot) {
+    if (!used[slot]) {
+      pager->freeSlots.push_back(slot);
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Online backups (`.backup <file>`, dbBackup())
+ * @details The backup is a plain DB file holding the pages as of one
+ * commit, whatever the format of the source. It is copied BACKUP_CHUNK_PAGES
+ * at a time, Pager::lock only held while a chunk is read, so statements keep
+ * running meanwhile, and at most backupRate pages per second. Each commit
+ * that changes pages numbers them with its lsn (log sequence number), so a
+ * pass can tell which pages changed behind it : the next pass copies those
+ * again, until a pass sees no commit at all. The last of BACKUP_MAX_PASSES
+ * holds the lock throughout instead.
+ * @note An incremental backup (into a file this connection backed up to
+ * before) starts with the pages changed since that backup was taken. Lsns
+ * are not kept on disk, the first backup after opening is a full one.
+ * Plain and compressed files only track changes from their first backup
+ * on (see pagerTrackChanges()), shadow paged and WAL mode ones always do.
+ * @example
+ *      pass 1 : pages 0 .. numPages         lsn 40 → 43, pages 7, 12 changed
+ *      pass 2 : pages with lsn >= 40 (7, 12) lsn 43 → 43, done
+ */
+const uint32_t BACKUP_CHUNK_PAGES = 16;
+const uint32_t BACKUP_MAX_PASSES = 4;
+const uint32_t BACKUP_DEFAULT_RATE = 2560; // Pages per second, 10 MB/s
+
+/**
+ * @brief Notes that the current statement changed \p pageNum, every
+ *        commit that changed a page getting its own lsn.
+ */
+inline void pageChanged(Pager *pager, uint32_t pageNum) {
+  pager->pageLsn[pageNum] = pager->lsn;
+  pager->lsnUsed = true;
+}
+
+/**
+ * @brief Commits the pages touched since the last commit : the ones whose
+ *        content changed go to new slots, followed by a new map and the
+ *        meta block. Does nothing if no page changed.
+ */
+void shadowPagerCommit(Pager *pager) {
+  bool changed = pager->numPages != pager->shadowMap.size();
+  pager->shadowMap.resize(pager->numPages, 0);
+  pager->pageHashes.resize(pager->numPages, 0);
+  std::vector<uint32_t> released;
+
+  for (uint32_t pageNum : pager->touchedPages) {
+    pager->isTouched[pageNum] = false;
+    if (pager->pages[pageNum] == nullptr) {
+      continue; // Evicted, so it was unchanged
+    }
+    uint64_t hash = checksum64(pager->pages[pageNum], PAGE_SIZE);
+    uint32_t oldSlot = pager->shadowMap[pageNum];
+    if (oldSlot != 0 && hash == pager->pageHashes[pageNum]) {
+      continue;
+    }
+    uint32_t slot = shadowAllocateSlot(pager);
+    pagerWriteAt(pager, pager->pages[pageNum], PAGE_SIZE,
+                 (uint64_t)slot * PAGE_SIZE);
+    if (oldSlot != 0) {
+      released.push_back(oldSlot);
+    }
+    pager->shadowMap[pageNum] = slot;
+    pager->pageHashes[pageNum] = hash;
+    pageChanged(pager, pageNum);
+    changed = true;
+  }
+  pager->touchedPages.clear();
+  if (!changed) {
+    return;
+  }
+
+  // The whole map is rewritten, never updated in place either
+  released.insert(released.end(), pager->mapSlots.begin(),
+                  pager->mapSlots.end());
+  pager->mapSlots.clear();
+  uint8_t chunk[PAGE_SIZE];
+  for (uint32_t first = 0; first < pager->numPages;
+       first += SHADOW_MAP_ENTRIES_PER_SLOT) {
+    uint32_t count =
+        std::min(SHADOW_MAP_ENTRIES_PER_SLOT, pager->numPages - first);
+    memset(chunk, 0, PAGE_SIZE);
+    memcpy(chunk, &pager->shadowMap[first], count * sizeof(uint32_t));
+    uint32_t slot = shadowAllocateSlot(pager);
+    pagerWriteAt(pager, chunk, PAGE_SIZE, (uint64_t)slot * PAGE_SIZE);
+    pager->mapSlots.push_back(slot);
+  }
+  if (pager->mapSlots.size() > SHADOW_MAX_MAP_SLOTS) {
+    std::cerr << "Page map too large for the meta block.\n";
+    exit(EXIT_FAILURE);
+  }
+  pagerSync(pager, pager->fd);
+
+  pager->txnId += 1;
+  uint8_t meta[PAGE_SIZE];
+  uint32_t numMapSlots = pager->mapSlots.size();
+  memset(meta, 0, PAGE_SIZE);
+  memcpy(meta, SHADOW_MAGIC, SHADOW_MAGIC_SIZE);
+  memcpy(meta + SHADOW_TXN_ID_OFFSET, &pager->txnId, 8);
+  memcpy(meta + SHADOW_NUM_PAGES_OFFSET, &pager->numPages, 4);
+  memcpy(meta + SHADOW_NUM_MAP_SLOTS_OFFSET, &numMapSlots, 4);
+  memcpy(meta + SHADOW_MAP_SLOTS_OFFSET, pager->mapSlots.data(),
+         numMapSlots * sizeof(uint32_t));
+  uint64_t checksum = shadowMetaChecksum(meta);
+  memcpy(meta + SHADOW_CHECKSUM_OFFSET, &checksum, 8);
+  pagerWriteAt(pager, meta, PAGE_SIZE,
+               (pager->txnId % SHADOW_META_SLOTS) * PAGE_SIZE);
+  pagerSync(pager, pager->fd);
+
+  pager->freeSlots.insert(pager->freeSlots.end(), released.begin(),
+                          released.end());
+}
+
+/**
+ * @brief Write-ahead log (WAL mode, plain DB files)
+ * @details A commit appends the after-image of every page changed by the
+ * statement to `<db>-wal` instead of writing the DB file, so statements do
+ * sequential writes only. The newest frame of each page is found through
+ * walIndex, and getPage() reads pages from there first. The background
+ * writer copies those pages into the DB file (backfill), and a checkpoint,
+ * once everything is copied and synced, empties the log again.
+ * @note Each frame checksum covers the frame's offset and the salt of the
+ * header, rewritten (salt + 1) on every reset, so frames can be checked
+ * independently of each other (see walOpen()) and a frame left over from
+ * an older log never passes. On open the log is replayed up to the last
+ * intact commit frame, anything after it is a torn commit and is dropped.
+ * Only frames on disk (synced) are backfilled, so the DB file never holds
+ * half a commit.
+ * @example
+ *      Header : | Magic (8) | Salt (8) |
+ *      Frame  : | Page Number (4) | DB Size in Pages (4), 0 unless last frame
+ *               | of a commit | Salt (8) | Checksum (8) | Page (PAGE_SIZE) |
+ */
+const char WAL_MAGIC[8] = "SQLCPPJ";
+const uint32_t WAL_HEADER_SIZE = 16;
+const uint32_t WAL_FRAME_HEADER_SIZE = 24;
+const uint32_t WAL_FRAME_SIZE = WAL_FRAME_HEADER_SIZE + PAGE_SIZE;
+const uint32_t WAL_DEFAULT_AUTOCHECKPOINT = 1000; // Frames, about 4 MB
+
+inline uint32_t walNumFrames(const Pager *pager) {
+  return (pager->walEnd - WAL_HEADER_SIZE) / WAL_FRAME_SIZE;
+}
+
+/**
+ * @brief Fills the header of the frame at \p offset and \return its
+ *        checksum, never 0
+ */
+uint64_t walFrameHeader(uint8_t *header, uint32_t pageNum, uint32_t dbSize,
+                        uint64_t salt, uint64_t offset, const void *page) {
+  memcpy(header, &pageNum, 4);
+  memcpy(header + 4, &dbSize, 4);
+  memcpy(header + 8, &salt, 8);
+  uint64_t checksum = checksum64(
+      page, PAGE_SIZE, checksum64(header, 16, checksum64(&offset, 8)));
+  checksum += checksum == 0;
+  memcpy(header + 16, &checksum, 8);
+  return checksum;
+}
+
+/**
+ * @brief Takes (F_RDLCK, F_WRLCK) or releases (F_UNLCK) lock byte \p byte
+ *        of the -shm file, see WalShm. Locks of this process never conflict
+ *        with each other.
+ * @return false if another process holds it and \p wait is not set
+ */
+bool shmLock(Pager *pager, uint32_t byte, short type, bool wait) {
+  struct flock lock = {};
+  lock.l_type = type;
+  lock.l_whence = SEEK_SET;
+  lock.l_start = byte;
+  lock.l_len = 1;
+  while (fcntl(pager->shmFd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &lock) == -1) {
+    if (errno == EINTR) {
+      continue;
+    }
+    if (!wait && (errno == EAGAIN || errno == EACCES)) {
+      return false;
+    }
+    std::cerr << "Error locking -shm: " << std::strerror(errno) << '\n';
+    exit(EXIT_FAILURE);
+  }
+  return true;
+}
+
+/* Whether another process holds lock byte \p byte */
+bool shmLockHeld(Pager *pager, uint32_t byte) {
+  struct flock lock = {};
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+  lock.l_start = byte;
+  lock.l_len = 1;
+  if (fcntl(pager->shmFd, F_OFD_GETLK, &lock) == -1) {
+    std::cerr << "Error locking -shm: " << std::strerror(errno) << '\n';
+    exit(EXIT_FAILURE);
+  }
+  return lock.l_type != F_UNLCK;
+}
+
+/**
+ * @brief Tells the other processes about the frames just appended from
+ *        \p firstFrame on, holding \p pageNums, or about a reset.
+ */
+void walShmPublish(Pager *pager, uint32_t firstFrame,
+                   const std::vector<uint32_t> &pageNums) {
+  WalShm *shm = pager->shm;
+  if (shm == nullptr) {
+    return;
+  }
+  for (size_t i = 0; i < pageNums.size(); ++i) {
+    shm->framePage[firstFrame + i].store(pageNums[i],
+                                         std::memory_order_relaxed);
+  }
+  shm->version.fetch_add(1);
+  shm->salt.store(pager->walSalt, std::memory_order_relaxed);
+  shm->walEnd.store(pager->walEnd, std::memory_order_relaxed);
+  shm->numPages.store(pager->numPages, std::memory_order_relaxed);
+  shm->version.fetch_add(1);
+}
+
+/**
+ * @brief Publishes the log as replayed by the first process to open it,
+ *        then lets the other processes in (DMS shared).
+ */
+void walShmReady(Pager *pager) {
+  std::vector<uint32_t> pageNums;
+  for (uint64_t offset = WAL_HEADER_SIZE; offset < pager->walEnd;
+       offset += WAL_FRAME_SIZE) {
+    uint32_t pageNum;
+    if (pread(pager->walFd, &pageNum, 4, offset) != 4) {
+      std::cerr << "Error reading WAL: " << std::strerror(errno) << '\n';
+      exit(EXIT_FAILURE);
+    }
+    pageNums.push_back(pageNum);
+  }
+  walShmPublish(pager, 0, pageNums);
+  memcpy(pager->shm->magic, WAL_MAGIC, 8);
+  shmLock(pager, WAL_SHM_LOCK_DMS, F_RDLCK, true);
+}
+
+/* Empties the log, under a new salt. The DB file must hold every frame. */
+void walReset(Pager *pager) {
+  pager->walSalt += 1;
+  uint8_t header[WAL_HEADER_SIZE];
+  memcpy(header, WAL_MAGIC, 8);
+  memcpy(header + 8, &pager->walSalt, 8);
+  if (ftruncate(pager->walFd, 0) == -1 ||
+      pwrite(pager->walFd, header, WAL_HEADER_SIZE, 0) != WAL_HEADER_SIZE) {
+    std::cerr << "Error resetting WAL: " << std::strerror(errno) << '\n';
+    exit(EXIT_FAILURE);
+  }
+  pager->walEnd = WAL_HEADER_SIZE;
+  pager->walSynced = WAL_HEADER_SIZE;
+  std::fill(pager->walIndex.begin(), pager->walIndex.end(), 0);
+  std::fill(pager->walBackfilled.begin(), pager->walBackfilled.end(), 0);
+  walShmPublish(pager, 0, {});
+}
+
+/**
+ * @brief First frame not known to be intact yet : every frame before it
+ *        was checked. Caller holds recoveryMutex.
+ */
+uint32_t walCheckedFrames(const Pager *pager) {
+  uint32_t checked = pager->firstInvalidFrame;
+  for (uint32_t progress : pager->workerProgress) {
+    checked = std::min(checked, progress);
+  }
+  return checked;
+}
+
+/* True once \p pageNum may be read. Caller holds recoveryMutex. */
+bool walPageRecovered(const Pager *pager, uint32_t pageNum) {
+  if (!pager->walRecovering || pager->walIndex[pageNum] == 0) {
+    return true;
+  }
+  uint32_t frame =
+      (pager->walIndex[pageNum] - WAL_HEADER_SIZE) / WAL_FRAME_SIZE;
+  return pager->walFrameCommit[frame] < walCheckedFrames(pager);
+}
+
+/* Blocks until the replay of the log is done */
+void walWaitRecovered(Pager *pager) {
+  if (!pager->walRecovering) {
+    return;
+  }
+  std::unique_lock<std::mutex> guard(pager->recoveryMutex);
+  pager->recoveryProgress.wait(guard,
+                               [pager] { return !pager->walRecovering; });
+}
+
+/**
+ * @brief Cuts the log after the last commit before the first torn frame,
+ *        pointing the pages of dropped frames back at their previous frame.
+ *        Called by the last worker, holding recoveryMutex.
+ * @note Pages touched here were never readable during the replay, so no
+ *       statement looked at their walIndex entry.
+ */
+void walFinishRecovery(Pager *pager) {
+  uint32_t numFrames = pager->walFramePage.size();
+  uint32_t kept = 0;
+  for (uint32_t i = 0; i < pager->firstInvalidFrame; ++i) {
+    if (pager->walFrameCommit[i] == i) {
+      kept = i + 1;
+    }
+  }
+  std::vector<bool> dropped(pager->walIndex.size(), false);
+  for (uint32_t i = kept; i < numFrames; ++i) {
+    dropped[pager->walFramePage[i]] = true;
+    pager->walIndex[pager->walFramePage[i]] = 0;
+  }
+  for (uint32_t i = 0; i < kept; ++i) {
+    if (dropped[pager->walFramePage[i]]) {
+      pager->walIndex[pager->walFramePage[i]] =
+          WAL_HEADER_SIZE + (uint64_t)i * WAL_FRAME_SIZE;
+    }
+  }
+
+  pager->walEnd = WAL_HEADER_SIZE + (uint64_t)kept * WAL_FRAME_SIZE;
+  pager->walSynced = pager->walEnd;
+  if (ftruncate(pager->walFd, pager->walEnd) == -1) {
+    std::cerr << "Error truncating WAL: " << std::strerror(errno) << '\n';
+    exit(EXIT_FAILURE);
+  }
+  pager->walFramePage.clear();
+  pager->walFrameCommit.clear();
+  pager->walRecovering = false;
+  if (pager->shm != nullptr) {
+    walShmReady(pager);
+  }
+}
+
+/**
+ * @brief Checks the frames of the pages with pageNum % numWorkers ==
+ *        \p worker, in log order, up to the first torn frame anyone found.
+ */
+void walRecoveryWorker(Pager *pager, uint32_t worker, uint32_t numWorkers) {
+  uint32_t numFrames = pager->walFramePage.size();
+  uint8_t *frame = (uint8_t *)malloc(WAL_FRAME_SIZE);
+  uint8_t expected[WAL_FRAME_HEADER_SIZE];
+  for (uint32_t i = 0; i < numFrames; ++i) {
+    if (pager->walFramePage[i] % numWorkers != worker) {
+      continue;
+    }
+    {
+      std::lock_guard<std::mutex> guard(pager->recoveryMutex);
+      pager->workerProgress[worker] = i;
+      if (i > pager->firstInvalidFrame) {
+        break;
+      }
+    }
+    pager->recoveryProgress.notify_all();
+
+    uint64_t offset = WAL_HEADER_SIZE + (uint64_t)i * WAL_FRAME_SIZE;
+    uint32_t pageNum, dbSize;
+    bool intact =
+        pread(pager->walFd, frame, WAL_FRAME_SIZE, offset) == WAL_FRAME_SIZE;
+    memcpy(&pageNum, frame, 4);
+    memcpy(&dbSize, frame + 4, 4);
+    intact = intact && walFrameHeader(expected, pageNum, dbSize,
+                                      pager->walSalt, offset,
+                                      frame + WAL_FRAME_HEADER_SIZE) &&
+             memcmp(expected, frame, WAL_FRAME_HEADER_SIZE) == 0;
+    if (!intact) {
+      std::lock_guard<std::mutex> guard(pager->recoveryMutex);
+      pager->firstInvalidFrame = std::min(pager->firstInvalidFrame, i);
+      break;
+    }
+  }
+  free(frame);
+
+  {
+    std::lock_guard<std::mutex> guard(pager->recoveryMutex);
+    pager->workerProgress[worker] = numFrames;
+    if (--pager->workersLeft == 0) {
+      walFinishRecovery(pager);
+    }
+  }
+  pager->recoveryProgress.notify_all();
+}
+
+/**
+ * @brief Opens (or creates) the log of the DB file and starts replaying it.
+ * @details Only the frame headers are read here : every frame up to the
+ * last commit frame whose header carries the salt goes into walIndex, and
+ * pages it holds past the end of the DB file count towards numPages. The
+ * pages themselves are checked by walRecoveryWorker() threads, frames
+ * partitioned by page number, while dbOpen() returns.
+ * @note A page whose newest frame is in a commit entirely checked is
+ * readable straight away (see walPageRecovered()), others wait. Commits
+ * wait for the whole log : only then is the first torn frame known, its
+ * commit and every later one dropped and the log cut there.
+ */
+void walOpen(Pager *pager, const std::string &walPath) {
+  pager->walFd = open(walPath.c_str(), O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+  if (pager->walFd == -1) {
+    std::cerr << "Unable to open file " << walPath << '\n';
+    exit(EXIT_FAILURE);
+  }
+  pager->wal = true;
+  pager->walPath = walPath;
+  pagerReserve(pager, pager->numPages);
+  pager->walAutoCheckpoint = WAL_DEFAULT_AUTOCHECKPOINT;
+  pager->walRecovering = false;
+
+  uint8_t header[WAL_HEADER_SIZE];
+  if (pread(pager->walFd, header, WAL_HEADER_SIZE, 0) != WAL_HEADER_SIZE ||
+      memcmp(header, WAL_MAGIC, 8) != 0) {
+    pager->walSalt = (uint64_t)time(nullptr) << 20;
+    walReset(pager);
+    return;
+  }
+  memcpy(&pager->walSalt, header + 8, 8);
+
+  uint32_t numFrames = 0; // Up to the last commit frame
+  std::vector<bool> isCommit;
+  uint8_t frameHeader[WAL_FRAME_HEADER_SIZE];
+  for (uint64_t offset = WAL_HEADER_SIZE;
+       pread(pager->walFd, frameHeader, WAL_FRAME_HEADER_SIZE, offset) ==
+       WAL_FRAME_HEADER_SIZE;
+       offset += WAL_FRAME_SIZE) {
+    uint32_t pageNum, dbSize;
+    uint64_t salt;
+    memcpy(&pageNum, frameHeader, 4);
+    memcpy(&dbSize, frameHeader + 4, 4);
+    memcpy(&salt, frameHeader + 8, 8);
+    if (salt != pager->walSalt || pageNum >= TABLE_MAX_PAGES) {
+      break;
+    }
+    pagerReserve(pager, pageNum + 1);
+    pager->walFramePage.push_back(pageNum);
+    isCommit.push_back(dbSize != 0);
+    if (dbSize != 0) {
+      numFrames = pager->walFramePage.size();
+      pager->numPages = std::max(pager->numPages, dbSize);
+    }
+  }
+  pager->walFramePage.resize(numFrames);
+  pager->walFrameCommit.resize(numFrames);
+  for (uint32_t i = numFrames; i-- > 0;) {
+    pager->walFrameCommit[i] = isCommit[i] ? i : pager->walFrameCommit[i + 1];
+  }
+  for (uint32_t i = 0; i < numFrames; ++i) {
+    pager->walIndex[pager->walFramePage[i]] =
+        WAL_HEADER_SIZE + (uint64_t)i * WAL_FRAME_SIZE;
+  }
+  pager->walEnd = WAL_HEADER_SIZE; // Set once the replay is done
+  pager->walSynced = WAL_HEADER_SIZE;
+  if (numFrames == 0) {
+    walReset(pager);
+    return;
+  }
+
+  uint32_t numWorkers = std::max(
+      1u, std::min(std::thread::hardware_concurrency(), numFrames / 64 + 1));
+  pager->walRecovering = true;
+  pager->firstInvalidFrame = numFrames;
+  pager->workerProgress.assign(numWorkers, 0);
+  pager->workersLeft = numWorkers;
+  for (uint32_t worker = 0; worker < numWorkers; ++worker) {
+    pager->recoveryWorkers.emplace_back(walRecoveryWorker, pager, worker,
+                                        numWorkers);
+  }
+}
+
+/**
+ * @brief Appends the pages touched since the last commit whose content
+ *        changed, the last frame marked as the commit. Does nothing if no
+ *        page changed.
+ */
+void walCommit(Pager *pager) {
+  std::vector<uint32_t> changed;
+  for (uint32_t pageNum : pager->touchedPages) {
+    pager->isTouched[pageNum] = false;
+    if (pager->pages[pageNum] == nullptr) {
+      continue; // Evicted, so it was unchanged
+    }
+    uint64_t hash = checksum64(pager->pages[pageNum], PAGE_SIZE);
+    if (hash == pager->pageHashes[pageNum]) {
+      continue;
+    }
+    pager->pageHashes[pageNum] = hash;
+    pageChanged(pager, pageNum);
+    changed.push_back(pageNum);
+  }
+  pager->touchedPages.clear();
+  if (changed.empty()) {
+    return;
+  }
+  walWaitRecovered(pager); // The log ends where the replay cuts it
+  if (pager->shm != nullptr &&
+      walNumFrames(pager) + changed.size() > WAL_SHM_MAX_FRAMES) {
+    std::cerr << "WAL too long for its -shm index, a reader is holding "
+                 "back checkpoints.\n";
+    exit(EXIT_FAILURE);
+  }
+
+  uint32_t firstFrame = walNumFrames(pager);
+  std::vector<uint8_t> frames(changed.size() * WAL_FRAME_SIZE);
+  for (size_t i = 0; i < changed.size(); ++i) {
+    uint8_t *frame = &frames[i * WAL_FRAME_SIZE];
+    uint32_t dbSize = i + 1 == changed.size() ? pager->numPages : 0;
+    memcpy(frame + WAL_FRAME_HEADER_SIZE, pager->pages[changed[i]], PAGE_SIZE);
+    walFrameHeader(frame, changed[i], dbSize, pager->walSalt,
+                   pager->walEnd + i * WAL_FRAME_SIZE,
+                   frame + WAL_FRAME_HEADER_SIZE);
+  }
+  ssize_t bytes =
+      pwrite(pager->walFd, frames.data(), frames.size(), pager->walEnd);
+  if (bytes != (ssize_t)frames.size()) {
+    std::cerr << "Error writing to WAL: "
+              << (bytes < 0 ? std::strerror(errno) : "short write") << '\n';
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < changed.size(); ++i) {
+    pager->walIndex[changed[i]] = pager->walEnd + i * WAL_FRAME_SIZE;
+    if (pager->usePool) {
+      // Logged, so the frame can be evicted without a write
+      pager->frames[pager->pageFrame[changed[i]]].checksum =
+          pager->pageHashes[changed[i]];
+    }
+  }
+  pager->walEnd += frames.size();
+  walShmPublish(pager, firstFrame, changed);
+  if (walNumFrames(pager) >= pager->walAutoCheckpoint) {
+    pager->wake.notify_all();
+  }
+}
+
+/**
+ * @brief Waits until the log is on disk up to \p end (of the log generation
+ *        \p salt), group commit style : the first caller to find it short
+ *        syncs everything appended so far, any caller arriving meanwhile
+ *        waits for that sync and is covered by it if its frames were in.
+ * @note Called without Pager::lock held, the lock is only taken around
+ *       the bookkeeping.
+ */
+void walSyncTo(Pager *pager, uint64_t salt, uint64_t end) {
+  std::unique_lock<std::mutex> guard(pager->lock);
+  while (pager->walSalt == salt && pager->walSynced < end) {
+    if (pager->walSyncing) {
+      pager->walSyncDone.wait(guard);
+      continue;
+    }
+    pager->walSyncing = true;
+    uint64_t target = pager->walEnd;
+    guard.unlock();
+    pagerSync(pager, pager->walFd);
+    guard.lock();
+    pager->walSyncing = false;
+    if (pager->walSalt == salt) {
+      pager->walSynced = std::max(pager->walSynced, target);
+    }
+    pager->walSyncDone.notify_all();
+  }
+}
+
+/**
+ * @brief Plain and compressed files write pages back whenever, so a
+ *        commit only notes which pages the statement changed, once they
+ *        are tracked (see pagerTrackChanges()).
+ */
+void trackPageChanges(Pager *pager) {
+  for (uint32_t pageNum : pager->touchedPages) {
+    pager->isTouched[pageNum] = false;
+    if (pager->pages[pageNum] == nullptr) {
+      continue; // Evicted, noted then if it had changed
+    }
+    uint64_t hash = checksum64(pager->pages[pageNum], PAGE_SIZE);
+    if (hash != pager->pageHashes[pageNum]) {
+      pager->pageHashes[pageNum] = hash;
+      pageChanged(pager, pageNum);
+    }
+  }
+  pager->touchedPages.clear();
+}
+
+/**
+ * @brief Read replicas (`<db> --replica-of=<primary>`)
+ * @details A follower process keeps its own plain DB file a copy of a WAL
+ * mode primary, tailing `<primary>-wal` : every REPLICA_POLL_INTERVAL_MS
+ * the shipper thread reads the frames appended since the last commit it
+ * applied, checks them as recovery does (see walOpen()) and applies each
+ * intact commit under Pager::lock, so a statement sees one commit of the
+ * primary or the next. Applied pages are written to the follower's file
+ * straight away, it is a warm standby once closed.
+ * @note A checkpoint of the primary empties its log under a new salt, the
+ * commits the follower had not read yet are then only in the primary's DB
+ * file. The follower resyncs : it reads the whole DB file, keeps the pages
+ * that differ from what it shipped, adds the new log up to its last commit
+ * and applies all of it at once, provided the salt did not change again
+ * meanwhile (the DB file might then miss pages the log had). The same is
+ * done when the primary has no log, e.g. once it closed.
+ * @note Statements never change the follower : INSERT fails, and the pages
+ * a SELECT changes when it flushes message buffers are read back from the
+ * file on commit (see replicaDiscardChanges()).
+ */
+const uint32_t REPLICA_POLL_INTERVAL_MS = 50;
+const uint32_t REPLICA_READ_PAGES = 64; // Pages per read of a resync
+
+/**
+ * @brief Puts back the pages the statement changed, and drops those it
+ *        added : the follower only holds what it shipped.
+ */
+void replicaDiscardChanges(Pager *pager) {
+  for (uint32_t pageNum : pager->touchedPages) {
+    pager->isTouched[pageNum] = false;
+    if (pager->pages[pageNum] == nullptr) {
+      continue;
+    }
+    if (pageNum >= pager->shippedPages) {
+      free(pager->pages[pageNum]);
+      pager->pages[pageNum] = nullptr;
+      continue;
+    }
+    if (checksum64(pager->pages[pageNum], PAGE_SIZE) !=
+        pager->pageHashes[pageNum]) {
+      memset(pager->pages[pageNum], 0, PAGE_SIZE);
+      if (pread(pager->fd, pager->pages[pageNum], PAGE_SIZE,
+                (off_t)pageNum * PAGE_SIZE) < 0) {
+        std::cerr << "Error reading file: " << std::strerror(errno) << '\n';
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+  pager->touchedPages.clear();
+  pager->numPages = pager->shippedPages;
+}
+
+/* Commits the statement just executed, for the formats that have commits */
+void pagerCommit(Pager *pager) {
+  if (pager->shadow) {
+    shadowPagerCommit(pager);
+  } else if (pager->wal) {
+    walCommit(pager);
+  } else if (pager->replica) {
+    replicaDiscardChanges(pager);
+  } else if (pager->trackChanges) {
+    trackPageChanges(pager);
+  }
+  if (pager->lsnUsed) {
+    pager->lsn += 1;
+    pager->lsnUsed = false;
+  }
+  if (pager->usePool) {
+    bufferPoolShrink(pager);
+  }
+}
+
+/* Reads the salt of the primary's log, false while it is being reset */
+bool replicaReadSalt(Pager *pager, uint64_t &salt) {
+  uint8_t header[WAL_HEADER_SIZE];
+  if (pread(pager->primaryWalFd, header, WAL_HEADER_SIZE, 0) !=
+          WAL_HEADER_SIZE ||
+      memcmp(header, WAL_MAGIC, 8) != 0) {
+    return false;
+  }
+  memcpy(&salt, header + 8, 8);
+  return true;
+}
+
+/**
+ * @brief Applies the commits of the log generation \p salt (0 : no log)
+ *        past the last one applied, after the pages of the primary's DB
+ *        file if \p resync. Does nothing if the salt changed meanwhile.
+ */
+void replicaCatchUp(Pager *pager, uint64_t salt, bool resync) {
+  std::vector<uint32_t> pageNums; // Applied in order, the last copy wins
+  std::vector<uint8_t> pages;
+  uint32_t dbPages = 0;
+  if (resync) {
+    off_t fileLength = lseek(pager->primaryFd, 0, SEEK_END);
+    dbPages = std::min<uint64_t>(fileLength / PAGE_SIZE, TABLE_MAX_PAGES);
+    std::vector<uint8_t> run(REPLICA_READ_PAGES * PAGE_SIZE);
+    for (uint32_t first = 0; first < dbPages; first += REPLICA_READ_PAGES) {
+      uint32_t count = std::min(REPLICA_READ_PAGES, dbPages - first);
+      ssize_t length = (ssize_t)count * PAGE_SIZE;
+      if (pread(pager->primaryFd, run.data(), length,
+                (off_t)first * PAGE_SIZE) != length) {
+        return; // Truncated meanwhile, try again
+      }
+      for (uint32_t i = 0; i < count; ++i) {
+        const uint8_t *page = &run[i * PAGE_SIZE];
+        if (first + i >= pager->shippedHashes.size() ||
+            checksum64(page, PAGE_SIZE) != pager->shippedHashes[first + i]) {
+          pageNums.push_back(first + i);
+          pages.insert(pages.end(), page, page + PAGE_SIZE);
+        }
+      }
+    }
+  }
+
+  uint64_t offset = resync ? WAL_HEADER_SIZE : pager->followedOffset;
+  uint64_t committedOffset = offset;
+  size_t committed = pageNums.size();
+  uint64_t commits = 0;
+  if (salt != 0) {
+    std::vector<uint8_t> frame(WAL_FRAME_SIZE);
+    uint8_t expected[WAL_FRAME_HEADER_SIZE];
+    while (pread(pager->primaryWalFd, frame.data(), WAL_FRAME_SIZE, offset) ==
+           WAL_FRAME_SIZE) {
+      uint32_t pageNum, dbSize;
+      memcpy(&pageNum, frame.data(), 4);
+      memcpy(&dbSize, frame.data() + 4, 4);
+      if (pageNum >= TABLE_MAX_PAGES ||
+          !walFrameHeader(expected, pageNum, dbSize, salt, offset,
+                          frame.data() + WAL_FRAME_HEADER_SIZE) ||
+          memcmp(expected, frame.data(), WAL_FRAME_HEADER_SIZE) != 0) {
+        break; // Not written yet, or torn
+      }
+      pageNums.push_back(pageNum);
+      pages.insert(pages.end(), frame.begin() + WAL_FRAME_HEADER_SIZE,
+                   frame.end());
+      offset += WAL_FRAME_SIZE;
+      if (dbSize != 0) {
+        committed = pageNums.size();
+        committedOffset = offset;
+        dbPages = std::max(dbPages, dbSize);
+        commits += 1;
+      }
+    }
+    uint64_t currentSalt;
+    if (resync &&
+        (!replicaReadSalt(pager, currentSalt) || currentSalt != salt)) {
+      return; // Checkpointed meanwhile, the next poll resyncs again
+    }
+  }
+  if (!resync && commits == 0) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> guard(pager->lock);
+  uint32_t reserved = dbPages;
+  for (size_t i = 0; i < committed; ++i) {
+    reserved = std::max(reserved, pageNums[i] + 1);
+  }
+  pagerReserve(pager, reserved);
+  for (size_t i = 0; i < committed; ++i) {
+    uint32_t pageNum = pageNums[i];
+    if (pager->pages[pageNum] == nullptr) {
+      pager->pages[pageNum] = malloc(PAGE_SIZE);
+    }
+    memcpy(pager->pages[pageNum], &pages[i * PAGE_SIZE], PAGE_SIZE);
+    pagerFlush(pager, pageNum);
+    uint64_t hash = checksum64(pager->pages[pageNum], PAGE_SIZE);
+    pager->pageHashes[pageNum] = hash;
+    pager->shippedHashes[pageNum] = hash;
+    pageChanged(pager, pageNum);
+  }
+  pager->numPages = std::max(pager->numPages, dbPages);
+  pager->shippedPages = pager->numPages;
+  pagerCommit(pager); // Gives the next commit its own lsn
+  pager->followedSalt = salt;
+  pager->followedOffset = committedOffset;
+  pager->shippedCommits += commits;
+  pager->resyncs += resync;
+}
+
+/**
+ * @brief Applies what the primary committed since the last poll, following
+ *        its log to a new file if the primary was reopened.
+ */
+void replicaPoll(Pager *pager) {
+  std::string walPath = pager->primaryPath + "-wal";
+  struct stat walStat;
+  if (stat(walPath.c_str(), &walStat) != 0) {
+    if (pager->primaryWalFd != -1) {
+      close(pager->primaryWalFd);
+      pager->primaryWalFd = -1;
+    }
+    if (pager->followedSalt != 0 || pager->resyncs == 0) {
+      replicaCatchUp(pager, 0, true); // Closed, the DB file has it all
+    }
+    return;
+  }
+  if (pager->primaryWalFd == -1 || walStat.st_ino != pager->primaryWalInode) {
+    if (pager->primaryWalFd != -1) {
+      close(pager->primaryWalFd);
+    }
+    pager->primaryWalFd = open(walPath.c_str(), O_RDONLY);
+    if (pager->primaryWalFd == -1) {
+      return;
+    }
+    pager->primaryWalInode = walStat.st_ino;
+  }
+  uint64_t salt;
+  if (!replicaReadSalt(pager, salt)) {
+    return; // Being reset, or just created
+  }
+  // A log shorter than what was applied was cut by the primary's recovery
+  replicaCatchUp(pager, salt,
+                 salt != pager->followedSalt ||
+                     (uint64_t)walStat.st_size < pager->followedOffset);
+}
+
+void replicaLoop(Pager *pager) {
+  while (true) {
+    {
+      std::unique_lock<std::mutex> guard(pager->lock);
+      pager->wake.wait_for(guard,
+                           std::chrono::milliseconds(REPLICA_POLL_INTERVAL_MS),
+                           [pager] { return pager->stopping; });
+      if (pager->stopping) {
+        return;
+      }
+    }
+    replicaPoll(pager);
+  }
+}
+
+/**
+ * @brief Makes the plain DB file of \p pager a follower of \p primaryPath
+ *        and catches up with it, before any statement runs.
+ */
+void replicaOpen(Pager *pager, const std::string &primaryPath) {
+  pager->primaryFd = open(primaryPath.c_str(), O_RDONLY);
+  if (pager->primaryFd == -1) {
+    std::cerr << "Unable to open primary " << primaryPath << '\n';
+    exit(EXIT_FAILURE);
+  }
+  char magic[COMPRESSED_MAGIC_SIZE] = {0};
+  char shadowMagic[SHADOW_MAGIC_SIZE] = {0};
+  if (pread(pager->primaryFd, magic, COMPRESSED_MAGIC_SIZE, 0) < 0 ||
+      pread(pager->primaryFd, shadowMagic, SHADOW_MAGIC_SIZE, PAGE_SIZE) < 0 ||
+      memcmp(magic, COMPRESSED_MAGIC, COMPRESSED_MAGIC_SIZE) == 0 ||
+      memcmp(magic, SHADOW_MAGIC, SHADOW_MAGIC_SIZE) == 0 ||
+      memcmp(shadowMagic, SHADOW_MAGIC, SHADOW_MAGIC_SIZE) == 0) {
+    std::cerr << "Replicas need a plain (WAL mode) primary.\n";
+    exit(EXIT_FAILURE);
+  }
+  pager->replica = true;
+  pager->primaryPath = primaryPath;
+  pager->primaryWalFd = -1;
+  pager->trackChanges = true;
+  pagerReserve(pager, pager->numPages);
+
+  // What the file holds was shipped by an earlier run, or is zeroes
+  uint8_t page[PAGE_SIZE];
+  for (uint32_t i = 0; i < pager->numPages; ++i) {
+    if (pread(pager->fd, page, PAGE_SIZE, (off_t)i * PAGE_SIZE) !=
+        PAGE_SIZE) {
+      std::cerr << "Error reading file: " << std::strerror(errno) << '\n';
+      exit(EXIT_FAILURE);
+    }
+    pager->shippedHashes[i] = checksum64(page, PAGE_SIZE);
+  }
+  pager->shippedPages = pager->numPages;
+
+  replicaPoll(pager);
+  if (pager->numPages == 0) {
+    std::cerr << "Primary " << primaryPath << " has no pages yet.\n";
+    exit(EXIT_FAILURE);
+  }
+}
+
+/**
+ * @brief In-memory DBs (`:memory:`, or an empty name for an anonymous one)
+ * @details The pager has no file at all : pages are carved out of arena
+ * chunks of ARENA_CHUNK_PAGES pages, nothing is read or written, and the
+ * whole arena is dropped on close.
+ */
+const uint32_t ARENA_CHUNK_PAGES = 16;
+
+inline bool isMemoryDb(const std::string &fileName) {
+  return fileName.empty() || fileName == ":memory:";
+}
+
+void *arenaPage(Pager *pager, uint32_t pageNum) {
+  uint32_t chunkNum = pageNum / ARENA_CHUNK_PAGES;
+  while (pager->arenaChunks.size() <= chunkNum) {
+    pager->arenaChunks.push_back(
+        (uint8_t *)malloc(ARENA_CHUNK_PAGES * PAGE_SIZE));
+  }
+  return pager->arenaChunks[chunkNum] +
+         (pageNum % ARENA_CHUNK_PAGES) * PAGE_SIZE;
+}
+
+/**
+ * @brief Maps one region of at least \p length bytes for pool frames, and
+ *        updates \p length to the size actually mapped.
+ * @note  With \p hugePages the region is rounded up to HUGE_PAGE_SIZE and
+ *        backed by explicit huge pages (MAP_HUGETLB) if the system has some
+ *        reserved, else aligned and marked for transparent huge pages.
+ */
+void *mapPoolRegion(size_t &length, bool hugePages, POOL_BACKING &backing) {
+  void *memory = MAP_FAILED;
+  backing = POOL_SMALL_PAGES;
+
+  if (hugePages) {
+    length = (length + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    memory = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (memory != MAP_FAILED) {
+      backing = POOL_HUGETLB;
+    } else {
+      // Over-reserve so that the region can start on a huge page boundary
+      void *reserved = mmap(nullptr, length + HUGE_PAGE_SIZE,
+                            PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (reserved != MAP_FAILED) {
+        uintptr_t start = ((uintptr_t)reserved + HUGE_PAGE_SIZE - 1) /
+                          HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        size_t head = start - (uintptr_t)reserved;
+        if (head > 0) {
+          munmap(reserved, head);
+        }
+        munmap((uint8_t *)start + length, HUGE_PAGE_SIZE - head);
+        memory = (void *)start;
+        if (madvise(memory, length, MADV_HUGEPAGE) == 0) {
+          backing = POOL_TRANSPARENT_HUGE_PAGES;
+        }
+      }
+    }
+  } else {
+    memory = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+  if (memory == MAP_FAILED) {
+    std::cerr << "Unable to map buffer pool: " << std::strerror(errno)
+              << '\n';
+    exit(EXIT_FAILURE);
+  }
+  return memory;
+}
+
+/* NUMA nodes listed in /sys (e.g. "0-1,3"), just node 0 if unknown */
+std::vector<int> onlineNumaNodes() {
+  std::vector<int> nodes;
+  int fd = open("/sys/devices/system/node/online", O_RDONLY);
+  if (fd != -1) {
+    char list[256] = {0};
+    ssize_t bytes = read(fd, list, sizeof(list) - 1);
+    close(fd);
+    std::istringstream listStream(bytes > 0 ? list : "");
+    std::string range;
+    while (std::getline(listStream, range, ',')) {
+      size_t dash = range.find('-');
+      int first = std::atoi(range.c_str());
+      int last = dash == std::string::npos
+                     ? first
+                     : std::atoi(range.c_str() + dash + 1);
+      for (int node = first; node <= last; ++node) {
+        nodes.push_back(node);
+      }
+    }
+  }
+  if (nodes.empty()) {
+    nodes.push_back(0);
+  }
+  return nodes;
+}
+
+/* Asks the kernel to place the pages of a region on NUMA node \p node */
+void bindToNumaNode(void *memory, size_t length, int node) {
+  const uint32_t maskBits = 8 * sizeof(unsigned long);
+  std::vector<unsigned long> nodeMask(node / maskBits + 1, 0);
+  nodeMask[node / maskBits] |= 1ul << (node % maskBits);
+  // Preferred rather than bound : a full node spills over instead of failing
+  if (syscall(SYS_mbind, memory, length, MPOL_PREFERRED, nodeMask.data(),
+              nodeMask.size() * maskBits + 1, 0) != 0) {
+    std::cerr << "Unable to bind buffer pool to NUMA node " << node << ": "
+              << std::strerror(errno) << '\n';
+  }
+}
+
+/* NUMA node of the CPU the calling thread runs on */
+int currentNumaNode() {
+  unsigned cpu = 0, node = 0;
+  if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0) {
+    return 0;
+  }
+  return node;
+}
+
+/* Adds a free frame at \p data to the partition at \p partitionIndex */
+void bufferPoolAddFrame(Pager *pager, uint32_t partitionIndex, uint8_t *data) {
+  Frame frame = {data,  NO_PAGE, 0,  0, partitionIndex, QUEUE_FREE,
+                 false, -1,      -1, -1, 0,              {}};
+  pager->partitions[partitionIndex].frameNums.push_back(pager->frames.size());
+  pager->partitions[partitionIndex].freeFrames.push_back(pager->frames.size());
+  pager->frames.push_back(frame);
+}
+
+FrameList &frameQueue(Pager *pager, const Frame &frame) {
+  PoolPartition &partition = pager->partitions[frame.partition];
+  return frame.queue == QUEUE_AM ? partition.am : partition.a1in;
+}
+
+void frameUnlink(Pager *pager, uint32_t frameNum) {
+  Frame &frame = pager->frames[frameNum];
+  FrameList &list = frameQueue(pager, frame);
+  if (frame.prev >= 0) {
+    pager->frames[frame.prev].next = frame.next;
+  } else {
+    list.head = frame.next;
+  }
+  if (frame.next >= 0) {
+    pager->frames[frame.next].prev = frame.prev;
+  } else {
+    list.tail = frame.prev;
+  }
+  list.size -= 1;
+  frame.prev = frame.next = -1;
+  frame.queue = QUEUE_FREE;
+}
+
+/* Puts an unlinked frame at the tail (or the head) of \p queue */
+void frameLink(Pager *pager, uint32_t frameNum, FRAME_QUEUE queue,
+               bool atHead) {
+  Frame &frame = pager->frames[frameNum];
+  frame.queue = queue;
+  FrameList &list = frameQueue(pager, frame);
+  if (atHead) {
+    frame.prev = -1;
+    frame.next = list.head;
+    if (list.head >= 0) {
+      pager->frames[list.head].prev = frameNum;
+    } else {
+      list.tail = frameNum;
+    }
+    list.head = frameNum;
+  } else {
+    frame.prev = list.tail;
+    frame.next = -1;
+    if (list.tail >= 0) {
+      pager->frames[list.tail].next = frameNum;
+    } else {
+      list.head = frameNum;
+    }
+    list.tail = frameNum;
+  }
+  list.size += 1;
+}
+
+/* Remembers \p pageNum in A1out, forgetting the oldest ghosts past the cap */
+void ghostAdd(Pager *pager, uint32_t pageNum) {
+  uint64_t seq = pager->nextGhostSeq++;
+  pager->ghosts.push_back({pageNum, seq});
+  pager->ghostSeq[pageNum] = seq;
+  size_t maxGhosts = std::max<size_t>(pager->frames.size() / 2, 1);
+  while (pager->ghosts.size() > maxGhosts) {
+    std::pair<uint32_t, uint64_t> oldest = pager->ghosts.front();
+    pager->ghosts.pop_front();
+    if (pager->ghostSeq[oldest.first] == oldest.second) {
+      pager->ghostSeq[oldest.first] = 0;
+    }
+  }
+}
+
+/* Queues the frame a page was just loaded into (see FRAME_QUEUE) */
+void bufferPoolAdmit(Pager *pager, uint32_t frameNum) {
+  Frame &frame = pager->frames[frameNum];
+  frame.useOnce = pager->useOnce;
+  if (pager->useOnce) {
+    frameLink(pager, frameNum, QUEUE_A1IN, true);
+  } else if (pager->ghostSeq[frame.pageNum] != 0) {
+    pager->ghostSeq[frame.pageNum] = 0; // Entry dropped when it gets old
+    frameLink(pager, frameNum, QUEUE_AM, false);
+  } else {
+    frameLink(pager, frameNum, QUEUE_A1IN, false);
+  }
+}
+
+/* Records a hit : only Am is reordered, A1in stays in loading order */
+void bufferPoolHit(Pager *pager, uint32_t frameNum) {
+  Frame &frame = pager->frames[frameNum];
+  if (pager->useOnce) {
+    return;
+  }
+  frame.useOnce = false;
+  if (frame.queue == QUEUE_AM) {
+    frameUnlink(pager, frameNum);
+    frameLink(pager, frameNum, QUEUE_AM, false);
+  }
+}
+
+/**
+ * @brief Maps the pool, one partition of frames per NUMA node, each bound to
+ *        its node. With a single node this is one region, left unbound.
+ */
+void bufferPoolInit(Pager *pager, uint32_t numFrames, bool hugePages) {
+  std::vector<int> nodes = onlineNumaNodes();
+  uint32_t framesPerNode = (numFrames + nodes.size() - 1) / nodes.size();
+
+  pager->frames.clear();
+  for (int node : nodes) {
+    PoolPartition partition;
+    partition.node = node;
+    partition.length = (size_t)framesPerNode * PAGE_SIZE;
+    partition.memory = (uint8_t *)mapPoolRegion(partition.length, hugePages,
+                                                partition.backing);
+    if (nodes.size() > 1) {
+      bindToNumaNode(partition.memory, partition.length, node);
+    }
+    partition.a1in = {-1, -1, 0};
+    partition.am = {-1, -1, 0};
+    pager->partitions.push_back(partition);
+    for (size_t offset = 0; offset < partition.length; offset += PAGE_SIZE) {
+      bufferPoolAddFrame(pager, pager->partitions.size() - 1,
+                         partition.memory + offset);
+    }
+  }
+  pager->numMappedFrames = pager->frames.size();
+  pager->peakFrames = pager->frames.size();
+  pager->usePool = true;
+  pager->pageFrame.assign(pager->pages.size(), -1);
+  pager->epoch = 0;
+  pager->evictions = 0;
+  pager->writeBacks = 0;
+  pager->useOnce = false;
+  pager->ghostSeq.assign(pager->pages.size(), 0);
+  pager->nextGhostSeq = 1;
+}
+
+/* Starts a new operation : pages fetched so far may be evicted again */
+inline void pagerBeginOperation(Pager *pager) {
+  if (pager != nullptr) {
+    pager->epoch += 1;
+  }
+}
+
+/**
+ * @brief Drops every swizzled reference to and from a frame about to be
+ *        reused : the entry in its parent, and those of its children.
+ */
+void unswizzleFrame(Pager *pager, uint32_t frameNum) {
+  Frame &frame = pager->frames[frameNum];
+  if (frame.parentFrame >= 0) {
+    pager->frames[frame.parentFrame].children[frame.parentSlot] = -1;
+    frame.parentFrame = -1;
+  }
+  for (int32_t child : frame.children) {
+    if (child >= 0) {
+      pager->frames[child].parentFrame = -1;
+    }
+  }
+  frame.children.clear();
+}
+
+void bufferPoolEvict(Pager *pager, uint32_t frameNum) {
+  Frame &frame = pager->frames[frameNum];
+  // Pages not touched since the last commit are committed (or logged)
+  if (!pager->shadow && !pager->wal &&
+      checksum64(frame.data, PAGE_SIZE) != frame.checksum) {
+    pagerFlush(pager, frame.pageNum);
+    pager->writeBacks += 1;
+    if (pager->isTouched[frame.pageNum]) {
+      pageChanged(pager, frame.pageNum); // Before its statement commits
+    }
+  }
+  if (frame.queue == QUEUE_A1IN && !frame.useOnce) {
+    ghostAdd(pager, frame.pageNum);
+  }
+  frameUnlink(pager, frameNum);
+  unswizzleFrame(pager, frameNum);
+  pager->pages[frame.pageNum] = nullptr;
+  pager->pageFrame[frame.pageNum] = -1;
+  frame.pageNum = NO_PAGE;
+  pager->evictions += 1;
+}
+
+/* Whether the frame of \p frameNum cannot be evicted right now */
+bool frameInUse(Pager *pager, const Frame &frame) {
+  if (frame.epoch == pager->epoch) {
+    return true;
+  }
+  // Changed since the last commit
+  if (pager->wal) {
+    return pager->isTouched[frame.pageNum] &&
+           checksum64(frame.data, PAGE_SIZE) !=
+               pager->pageHashes[frame.pageNum];
+  }
+  return pager->shadow && pager->isTouched[frame.pageNum] &&
+         (frame.pageNum >= pager->shadowMap.size() ||
+          pager->shadowMap[frame.pageNum] == 0 ||
+          checksum64(frame.data, PAGE_SIZE) !=
+              pager->pageHashes[frame.pageNum]);
+}
+
+/* First frame of \p list that may be evicted, from the head, -1 if none */
+int32_t frameListVictim(Pager *pager, const FrameList &list) {
+  for (int32_t frameNum = list.head; frameNum >= 0;
+       frameNum = pager->frames[frameNum].next) {
+    if (!frameInUse(pager, pager->frames[frameNum])) {
+      return frameNum;
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief Free or evicted frame of \p partition, -1 if all are in use. A1in
+ *        gives up its oldest page while it holds more than a quarter of the
+ *        frames, Am its least recently used one otherwise.
+ */
+int32_t partitionVictim(Pager *pager, PoolPartition &partition) {
+  if (!partition.freeFrames.empty()) {
+    uint32_t frameNum = partition.freeFrames.back();
+    partition.freeFrames.pop_back();
+    return frameNum;
+  }
+  uint32_t a1inTarget = std::max<uint32_t>(partition.frameNums.size() / 4, 1);
+  bool fromA1in = partition.a1in.size > a1inTarget || partition.am.size == 0;
+  int32_t frameNum =
+      frameListVictim(pager, fromA1in ? partition.a1in : partition.am);
+  if (frameNum < 0) {
+    frameNum = frameListVictim(pager, fromA1in ? partition.am : partition.a1in);
+  }
+  if (frameNum >= 0) {
+    bufferPoolEvict(pager, frameNum);
+  }
+  return frameNum;
+}
+
+/**
+ * @brief Returns a frame for a page about to be loaded, from the partition
+ *        local to the calling thread if it has one to give, else from the
+ *        other partitions, else a new frame is added to the local partition.
+ */
+uint32_t bufferPoolVictim(Pager *pager) {
+  uint32_t numPartitions = pager->partitions.size();
+  uint32_t local = 0;
+  int node = currentNumaNode();
+  for (uint32_t i = 0; i < numPartitions; ++i) {
+    if (pager->partitions[i].node == node) {
+      local = i;
+    }
+  }
+  for (uint32_t i = 0; i < numPartitions; ++i) {
+    int32_t frameNum = partitionVictim(
+        pager, pager->partitions[(local + i) % numPartitions]);
+    if (frameNum >= 0) {
+      return frameNum;
+    }
+  }
+
+  void *data = nullptr;
+  if (posix_memalign(&data, PAGE_SIZE, PAGE_SIZE) != 0) {
+    std::cerr << "Unable to grow buffer pool.\n";
+    exit(EXIT_FAILURE);
+  }
+  bufferPoolAddFrame(pager, local, (uint8_t *)data);
+  pager->partitions[local].freeFrames.pop_back();
+  pager->peakFrames = std::max<uint32_t>(pager->peakFrames,
+                                         pager->frames.size());
+  return pager->frames.size() - 1;
+}
+
+/**
+ * @brief Gives back the frames bufferPoolVictim() added while every frame
+ *        was in use, the last added first, once their pages may be evicted :
+ *        the pool goes back to its size between statements. Those pages
+ *        still uncommitted (shadow paging, WAL mode) keep theirs.
+ */
+void bufferPoolShrink(Pager *pager) {
+  pagerBeginOperation(pager); // The statement is over
+  while (pager->frames.size() > pager->numMappedFrames) {
+    uint32_t frameNum = pager->frames.size() - 1;
+    Frame &frame = pager->frames[frameNum];
+    PoolPartition &partition = pager->partitions[frame.partition];
+    if (frame.pageNum == NO_PAGE) {
+      partition.freeFrames.erase(std::find(partition.freeFrames.begin(),
+                                           partition.freeFrames.end(),
+                                           frameNum));
+    } else if (frameInUse(pager, frame)) {
+      return;
+    } else {
+      bufferPoolEvict(pager, frameNum);
+    }
+    partition.frameNums.erase(std::find(partition.frameNums.begin(),
+                                        partition.frameNums.end(), frameNum));
+    free(frame.data);
+    pager->frames.pop_back();
+  }
+}
+
+/* Forgets the cached copy of \p pageNum, read again on the next getPage() */
+void pagerDropPage(Pager *pager, uint32_t pageNum) {
+  if (pager->pages[pageNum] == nullptr) {
+    return;
+  }
+  if (pager->usePool) {
+    uint32_t frameNum = pager->pageFrame[pageNum];
+    bufferPoolEvict(pager, frameNum);
+    pager->partitions[pager->frames[frameNum].partition].freeFrames.push_back(
+        frameNum);
+  } else {
+    free(pager->pages[pageNum]);
+    pager->pages[pageNum] = nullptr;
+  }
+}
+
+/**
+ * @brief Catches this process's view of the log (walIndex, walEnd) up with
+ *        the commits of the others, dropping the pages they changed from
+ *        the cache. Caller holds Pager::lock.
+ * @note If the log was emptied meanwhile, the frames this process did not
+ * see are only in the DB file now : every cached page is dropped.
+ */
+void walRefresh(Pager *pager) {
+  WalShm *shm = pager->shm;
+  uint64_t salt, walEnd;
+  uint32_t numPages;
+  std::vector<uint32_t> pageNums; // Of the frames not seen yet
+  while (true) {
+    uint64_t version = shm->version.load();
+    if (version & 1) {
+      std::this_thread::yield(); // A commit is being published
+      continue;
+    }
+    salt = shm->salt.load(std::memory_order_relaxed);
+    walEnd = shm->walEnd.load(std::memory_order_relaxed);
+    numPages = shm->numPages.load(std::memory_order_relaxed);
+    uint64_t seen = salt == pager->walSalt ? pager->walEnd : WAL_HEADER_SIZE;
+    pageNums.clear();
+    for (uint64_t offset = seen; offset < walEnd; offset += WAL_FRAME_SIZE) {
+      uint32_t frame = (offset - WAL_HEADER_SIZE) / WAL_FRAME_SIZE;
+      pageNums.push_back(
+          shm->framePage[frame].load(std::memory_order_relaxed));
+    }
+    if (shm->version.load() == version) {
+      break;
+    }
+  }
+  if (salt == pager->walSalt && walEnd == pager->walEnd) {
+    return;
+  }
+
+  if (salt != pager->walSalt) {
+    for (uint32_t i = 0; i < pager->numPages; ++i) {
+      pagerDropPage(pager, i);
+      pageChanged(pager, i); // Which ones did is not known
+    }
+    std::fill(pager->walIndex.begin(), pager->walIndex.end(), 0);
+    std::fill(pager->walBackfilled.begin(), pager->walBackfilled.end(), 0);
+    pager->walSalt = salt;
+    pager->walEnd = WAL_HEADER_SIZE;
+    pager->walSynced = WAL_HEADER_SIZE;
+    struct stat fileStat; // Grown by the checkpoint of another process
+    if (fstat(pager->fd, &fileStat) == 0) {
+      pager->fileSize = std::max<uint64_t>(pager->fileSize, fileStat.st_size);
+    }
+  }
+  uint32_t reserved = numPages;
+  for (uint32_t pageNum : pageNums) {
+    reserved = std::max(reserved, pageNum + 1);
+  }
+  pagerReserve(pager, reserved);
+  for (size_t i = 0; i < pageNums.size(); ++i) {
+    pager->walIndex[pageNums[i]] = pager->walEnd + i * WAL_FRAME_SIZE;
+    pagerDropPage(pager, pageNums[i]);
+    pageChanged(pager, pageNums[i]);
+  }
+  pager->walEnd = walEnd;
+  pager->numPages = std::max(pager->numPages, numPages);
+  pager->fileWrites += 1; // Prefetched runs read before are stale
+  if (pager->lsnUsed) {
+    pager->lsn += 1; // The commits seen get their own lsn, see dbBackup()
+    pager->lsnUsed = false;
+  }
+}
+
+/**
+ * @brief Starts a statement of a WAL mode file shared with other
+ *        processes : takes a reader slot, then looks at their commits.
+ *        Caller holds Pager::lock. Does nothing for other files.
+ */
+void pagerBeginStatement(Pager *pager) {
+  if (pager == nullptr || pager->shm == nullptr || pager->readerSlot >= 0) {
+    return;
+  }
+  for (uint32_t i = 0; i < WAL_SHM_READERS && pager->readerSlot < 0; ++i) {
+    if (shmLock(pager, WAL_SHM_LOCK_READERS + i, F_WRLCK, false)) {
+      pager->readerSlot = i;
+    }
+  }
+  if (pager->readerSlot < 0) { // More processes than slots
+    pager->readerSlot = getpid() % WAL_SHM_READERS;
+    shmLock(pager, WAL_SHM_LOCK_READERS + pager->readerSlot, F_WRLCK, true);
+  }
+  // Until the replay is done no other process has the file open
+  if (!pager->walRecovering) {
+    walRefresh(pager);
+  }
+  pager->shm->readerMarks[pager->readerSlot] = pager->walEnd;
+}
+
+/* Makes the running statement the one writer of the shared log */
+void pagerBeginWrite(Pager *pager) {
+  if (pager == nullptr || pager->shm == nullptr || pager->writeLocked) {
+    return;
+  }
+  walWaitRecovered(pager);
+  shmLock(pager, WAL_SHM_LOCK_WRITE, F_WRLCK, true);
+  pager->writeLocked = true;
+  walRefresh(pager);
+}
+
+/* Ends the statement after its commit, see pagerBeginStatement() */
+void pagerEndStatement(Pager *pager) {
+  if (pager == nullptr || pager->shm == nullptr) {
+    return;
+  }
+  if (pager->writeLocked) {
+    shmLock(pager, WAL_SHM_LOCK_WRITE, F_UNLCK, false);
+    pager->writeLocked = false;
+  }
+  if (pager->readerSlot >= 0) {
+    shmLock(pager, WAL_SHM_LOCK_READERS + pager->readerSlot, F_UNLCK, false);
+    pager->readerSlot = -1;
+  }
+}
+
+/**
+ * @brief Smallest mark of the reader slots other processes hold : frames
+ *        from there on are not seen by all of them. Caller holds
+ *        Pager::lock, so this process has no statement running.
+ */
+uint64_t walShmMinMark(Pager *pager) {
+  uint64_t minMark = UINT64_MAX;
+  for (uint32_t i = 0; i < WAL_SHM_READERS; ++i) {
+    if (shmLockHeld(pager, WAL_SHM_LOCK_READERS + i)) {
+      minMark = std::min<uint64_t>(minMark, pager->shm->readerMarks[i]);
+    }
+  }
+  return minMark;
+}
+
+/**
+ * @brief Opens the log through `<db>-shm` : the first process to map it
+ *        replays the log (walOpen()), the next ones take its state from
+ *        the -shm once that is done.
+ */
+void walShmOpen(Pager *pager, const std::string &fileName) {
+  pager->shmPath = fileName + "-shm";
+  pager->readerSlot = -1;
+  while (true) {
+    pager->shmFd =
+        open(pager->shmPath.c_str(), O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+    if (pager->shmFd == -1 || ftruncate(pager->shmFd, sizeof(WalShm)) != 0) {
+      std::cerr << "Unable to open file " << pager->shmPath << '\n';
+      exit(EXIT_FAILURE);
+    }
+    void *memory = mmap(nullptr, sizeof(WalShm), PROT_READ | PROT_WRITE,
+                        MAP_SHARED, pager->shmFd, 0);
+    if (memory == MAP_FAILED) {
+      std::cerr << "Unable to map " << pager->shmPath << ": "
+                << std::strerror(errno) << '\n';
+      exit(EXIT_FAILURE);
+    }
+    pager->shm = (WalShm *)memory;
+
+    if (shmLock(pager, WAL_SHM_LOCK_DMS, F_WRLCK, false)) {
+      // Alone : whatever is mapped is left over from a crash
+      memset(pager->shm->magic, 0, 8);
+      pager->shm->version = 0;
+      walOpen(pager, fileName + "-wal");
+      if (pager->recoveryWorkers.empty()) {
+        walShmReady(pager);
+      } // Otherwise the last recovery worker does
+      return;
+    }
+    shmLock(pager, WAL_SHM_LOCK_DMS, F_RDLCK, true);
+    if (memcmp(pager->shm->magic, WAL_MAGIC, 8) == 0) {
+      break;
+    }
+    // The last process removed it meanwhile, start over with a new one
+    munmap(pager->shm, sizeof(WalShm));
+    close(pager->shmFd);
+  }
+
+  std::string walPath = fileName + "-wal";
+  pager->walFd = open(walPath.c_str(), O_RDWR);
+  if (pager->walFd == -1) {
+    std::cerr << "Unable to open file " << walPath << '\n';
+    exit(EXIT_FAILURE);
+  }
+  pager->wal = true;
+  pager->walPath = walPath;
+  pagerReserve(pager, pager->numPages);
+  pager->walAutoCheckpoint = WAL_DEFAULT_AUTOCHECKPOINT;
+  pager->walRecovering = false;
+  pager->walSalt = 0; // Never a salt, the whole log is new to this process
+  pager->walEnd = WAL_HEADER_SIZE;
+  pager->walSynced = WAL_HEADER_SIZE;
+  std::lock_guard<std::mutex> guard(pager->lock);
+  walRefresh(pager);
+}
+
+/**
+ * @brief Opens DB file and keeps track of its size. Also initialize the page
+ *        cache to all null
+ *
+ * @param fileName
+ * @param options
+ * @param error   See openError()
+ * @return Pager*, null if it could not be opened
+ * @note  A file starting with COMPRESSED_MAGIC is always opened compressed,
+ *        one with a SHADOW_MAGIC meta block shadow paged. options.compress
+ *        and options.shadow only decide the format of a new, empty file.
+ */
+Pager *pagerOpen(const std::string &fileName, const OpenOptions &options,
+                 std::string *error = nullptr) {
+  if (isMemoryDb(fileName)) {
+    Pager *pager = new Pager();
+    pager->fd = -1;
+    pager->fileSize = 0;
+    pager->numPages = 0;
+    pager->compressed = false;
+    pager->fileEnd = 0;
+    pager->shadow = false;
+    pager->inMemory = true;
+    pager->txnId = 0;
+    pager->numSlots = 0;
+    pager->synchronous = SYNCHRONOUS_OFF; // Nothing to sync
+    pager->wal = false;
+    pager->walFd = -1;
+    pager->shmFd = -1;
+    pager->shm = nullptr;
+    pager->readerSlot = -1;
+    pager->writeLocked = false;
+    pager->walRecovering = false;
+    pager->usePool = false;
+    pager->direct = false;
+    pager->writerRate = 0; // No background writer
+    pager->trackChanges = false;
+    pager->lsn = 1;
+    pager->backupRate = BACKUP_DEFAULT_RATE;
+    pager->replica = false;
+    return pager; // Tables sized by getPage()
+  }
+
+  int fileDesc = open(fileName.c_str(),
+                      O_RDWR |     // Read/Write mode
+                          O_CREAT, // Create file if it doesn't exist
+                      S_IWUSR |    // User write permission
+                          S_IRUSR  // User read permission
+  );
+
+  if (fileDesc == -1) {
+    openError(error, "Unable to open file " + fileName);
+    return nullptr;
+  }
+
+  off_t fileLength = lseek(fileDesc, 0, SEEK_END);
+
+  Pager *pager = new Pager();
+  pager->fd = fileDesc;
+  pager->fileSize = fileLength;
+  pager->numPages = (fileLength / PAGE_SIZE);
+  pager->compressed = false;
+  pager->fileEnd = COMPRESSED_HEADER_BLOCK_SIZE;
+  pager->shadow = false;
+  pager->inMemory = false;
+  pager->txnId = 0;
+  pager->numSlots = SHADOW_META_SLOTS;
+  pager->synchronous = SYNCHRONOUS_NORMAL;
+  pager->wal = false;
+  pager->walFd = -1;
+  pager->shmFd = -1;
+  pager->shm = nullptr;
+  pager->readerSlot = -1;
+  pager->writeLocked = false;
+  pager->walRecovering = false;
+  pager->lsn = 1;
+  pager->backupRate = BACKUP_DEFAULT_RATE;
+  pager->replica = false;
+  pagerReserve(pager, pager->numPages);
+  // Until the log or a thread is started, closing the file undoes it all
+  auto fail = [pager]() {
+    close(pager->fd); // Releases its lock
+    delete pager;
+    return (Pager *)nullptr;
+  };
+
+  // Meta block 0 of a shadow paged file may be the torn one, check both
+  char magic[COMPRESSED_MAGIC_SIZE] = {0};
+  char shadowMagic[SHADOW_MAGIC_SIZE] = {0};
+  if (fileLength >= (off_t)COMPRESSED_HEADER_BLOCK_SIZE &&
+      !pagerReadAt(pager, magic, COMPRESSED_MAGIC_SIZE, 0, error)) {
+    return fail();
+  }
+  if (fileLength >= (off_t)(SHADOW_META_SLOTS * PAGE_SIZE) &&
+      !pagerReadAt(pager, shadowMagic, SHADOW_MAGIC_SIZE, PAGE_SIZE, error)) {
+    return fail();
+  }
+  if (memcmp(magic, COMPRESSED_MAGIC, COMPRESSED_MAGIC_SIZE) == 0) {
+    pager->compressed = true;
+    if (!compressedPagerLoad(pager, error)) {
+      return fail();
+    }
+  } else if (memcmp(magic, SHADOW_MAGIC, SHADOW_MAGIC_SIZE) == 0 ||
+             memcmp(shadowMagic, SHADOW_MAGIC, SHADOW_MAGIC_SIZE) == 0) {
+    pager->shadow = true;
+    if (!shadowPagerLoad(pager, error)) {
+      return fail();
+    }
+  } else if (fileLength == 0 && options.shadow) {
+    pager->shadow = true;
+  } else if (fileLength == 0 && options.compress) {
+    pager->compressed = true;
+    pagerReserve(pager, pager->numPages);
+  }
+
+  if (!pager->compressed && !pager->shadow && fileLength % PAGE_SIZE != 0 &&
+      fileLength > 0) {
+    openError(error,
+              "DB file doesn't have whole number of Pages. Corrupted file.");
+    return fail();
+  }
+
+  bool replica = !options.replicaOf.empty();
+  if (replica && (pager->compressed || pager->shadow)) {
+    openError(error, "Replicas need a plain DB file.");
+    return fail();
+  }
+  // A log left behind by a crash is replayed, whatever the options say
+  std::string walPath = fileName + "-wal";
+  struct stat walStat;
+  bool useWal =
+      !replica && (options.wal || stat(walPath.c_str(), &walStat) == 0);
+  if (useWal && (pager->compressed || pager->shadow)) {
+    if (options.wal) {
+      std::cerr << "WAL mode needs a plain DB file, not using it.\n";
+    }
+    useWal = false;
+  }
+  // WAL mode files may be shared by processes (see WalShm), others not
+  if (flock(fileDesc, (useWal ? LOCK_SH : LOCK_EX) | LOCK_NB) != 0) {
+    openError(error, "Database " + fileName +
+                         " is locked by another process.");
+    return fail();
+  }
+  if (useWal) {
+    walShmOpen(pager, fileName);
+  }
+
+  // Both look at every touched page on commit anyway
+  pager->trackChanges = pager->shadow || pager->wal;
+
+  // Only plain files do whole, aligned page I/O as O_DIRECT requires
+  pager->usePool = false;
+  pager->direct = false;
+  if (options.direct && !pager->compressed && !pager->shadow) {
+    if (fcntl(fileDesc, F_SETFL, fcntl(fileDesc, F_GETFL) | O_DIRECT) == 0) {
+      pager->direct = true;
+    } else {
+      std::cerr << "O_DIRECT not supported, using the page cache.\n";
+    }
+  }
+  // Replicas keep every page they shipped, see replicaDiscardChanges()
+  if (!replica &&
+      (options.direct || options.poolPages > 0 || options.hugePages)) {
+    uint32_t numFrames = options.poolPages > 0 ? options.poolPages
+                                               : BUFFER_POOL_DEFAULT_PAGES;
+    bufferPoolInit(pager, std::max(numFrames, BUFFER_POOL_MIN_PAGES),
+                   options.hugePages);
+  }
+  // Restarts warm the pool back up, see saveWarmManifest()
+  if (pager->usePool && !pager->compressed && !pager->shadow) {
+    pager->warmPath = fileName + "-warm";
+  }
+
+  if (replica) {
+    replicaOpen(pager, options.replicaOf);
+  }
+  return pager;
+}
+
+/**
+ * @brief Handles cache miss of the asked page \p pageNum
+ *
+ * @param pager
+ * @param pageNum
+ * @return void pointer to the page
+ */
+void *getPage(Pager *pager, uint32_t pageNum) {
+  if (pageNum >= TABLE_MAX_PAGES) {
+    std::cout << "Tried to fetch page out of bounds. " << pageNum << " > "
+              << TABLE_MAX_PAGES << '\n';
+    exit(EXIT_FAILURE);
+  }
+  if (pageNum >= pager->pages.size()) {
+    pagerReserve(pager, pageNum + 1);
+  }
+
+  // Pages only read by a scan cannot have changed
+  if (pager->trackChanges && !pager->useOnce && !pager->isTouched[pageNum]) {
+    pager->isTouched[pageNum] = true; // Looked at on the next commit
+    pager->touchedPages.push_back(pageNum);
+  }
+
+  // Cache Miss. Allocate memory & load from file
+  bool hit = pager->pages[pageNum] != nullptr;
+  if (!hit) {
+    if (pager->inMemory) {
+      pager->pages[pageNum] = arenaPage(pager, pageNum);
+      if (pageNum >= pager->numPages) {
+        pager->numPages = pageNum + 1;
+      }
+      return pager->pages[pageNum];
+    }
+
+    int32_t frameNum = -1;
+    void *page;
+    if (pager->usePool) {
+      frameNum = bufferPoolVictim(pager);
+      page = pager->frames[frameNum].data;
+    } else {
+      page = malloc(PAGE_SIZE);
+    }
+    uint32_t noOfPages = pager->fileSize / PAGE_SIZE;
+
+    if (pager->walRecovering) {
+      std::unique_lock<std::mutex> guard(pager->recoveryMutex);
+      pager->recoveryProgress.wait(
+          guard, [&] { return walPageRecovered(pager, pageNum); });
+    }
+    if (pager->wal && pager->walIndex[pageNum] != 0) {
+      uint64_t offset = pager->walIndex[pageNum] + WAL_FRAME_HEADER_SIZE;
+      if (pread(pager->walFd, page, PAGE_SIZE, offset) != PAGE_SIZE) {
+        std::cerr << "Error reading WAL: " << std::strerror(errno) << '\n';
+        exit(EXIT_FAILURE);
+      }
+    } else if (pager->shadow) {
+      if (pageNum < pager->shadowMap.size() && pager->shadowMap[pageNum]) {
+        pagerReadAt(pager, page, PAGE_SIZE,
+                    (uint64_t)pager->shadowMap[pageNum] * PAGE_SIZE);
+        pager->pageHashes[pageNum] = checksum64(page, PAGE_SIZE);
+      }
+    } else if (pager->compressed) {
+      const PageExtent &extent = pager->pageMap[pageNum];
+      if (extent.length > 0) {
+        uint8_t stored[PAGE_SIZE];
+        pagerReadAt(pager, stored, extent.length, extent.offset);
+        decompressPage(stored, extent.length, (uint8_t *)page);
+      }
+    } else if (pageNum <= noOfPages) {
+      // We might need to read a partial page at the end of the file
+      lseek(pager->fd, pageNum * PAGE_SIZE, SEEK_SET);
+      ssize_t bytes = read(pager->fd, page, PAGE_SIZE);
+      if (bytes < 0) {
+        std::cerr << "Error reading file: " << std::strerror(errno) << '\n';
+        exit(EXIT_FAILURE);
+      }
+    }
+    pager->pages[pageNum] = page;
+    if (pager->trackChanges && !pager->shadow) {
+      pager->pageHashes[pageNum] = checksum64(page, PAGE_SIZE);
+    }
+    if (pager->usePool) {
+      Frame &frame = pager->frames[frameNum];
+      frame.pageNum = pageNum;
+      frame.checksum = checksum64(page, PAGE_SIZE);
+      pager->pageFrame[pageNum] = frameNum;
+      bufferPoolAdmit(pager, frameNum);
+    }
+
+    if (pageNum >= pager->numPages) {
+      pager->numPages = pageNum + 1;
+    }
+  }
+
+  if (pager->usePool) {
+    Frame &frame = pager->frames[pager->pageFrame[pageNum]];
+    if (frame.epoch != pager->epoch && hit) {
+      bufferPoolHit(pager, pager->pageFrame[pageNum]);
+    }
+    frame.epoch = pager->epoch;
+  }
+  return pager->pages[pageNum];
+}
+
+/**
+ * @brief Pointer swizzling
+ * @details Fetches child \p childNum of the internal node \p parent (page
+ * \p parentPageNum, fetched in the current operation) without going through
+ * the page table when the child is resident. The parent's frame remembers
+ * the frame each child was last found in, and the child's frame remembers
+ * that reference so eviction can clear it (see unswizzleFrame()).
+ *
+ * parent frame : children [ 7 | -1 | 12 | ... ]
+ *                            │          └─→ frame 12 : parentFrame = parent
+ *                            └─→ frame 7  : parentFrame = parent
+ *
+ * @note The child pointers stay in the page as page numbers, the swizzled
+ * frames live next to it, so nothing changes on disk. A reference is only
+ * trusted while its frame still holds the page the node points to, which
+ * covers cells moved around by splits. Without the pool pages never move
+ * and getPage() is already a single lookup, so this only applies to it.
+ */
+void *getChildPage(Pager *pager, uint32_t parentPageNum, void *parent,
+                   uint32_t childNum) {
+  uint32_t childPageNum = *internalNodeChild(parent, childNum);
+  if (!pager->usePool) {
+    return getPage(pager, childPageNum);
+  }
+
+  int32_t parentFrameNum = pager->pageFrame[parentPageNum];
+  const std::vector<int32_t> &children =
+      pager->frames[parentFrameNum].children;
+  if (childNum < children.size() && children[childNum] >= 0) {
+    Frame &child = pager->frames[children[childNum]];
+    if (child.pageNum == childPageNum &&
+        (!pager->trackChanges || pager->useOnce ||
+         pager->isTouched[childPageNum])) {
+      if (child.epoch != pager->epoch) {
+        bufferPoolHit(pager, children[childNum]);
+        child.epoch = pager->epoch;
+      }
+      return child.data;
+    }
+  }
+
+  void *page = getPage(pager, childPageNum);
+  if (pager->pageFrame[parentPageNum] != parentFrameNum) {
+    return page; // Parent evicted by the fetch, nothing to swizzle into
+  }
+  int32_t childFrameNum = pager->pageFrame[childPageNum];
+  Frame &childFrame = pager->frames[childFrameNum];
+  Frame &parentFrame = pager->frames[parentFrameNum];
+  if (childFrame.parentFrame >= 0) {
+    pager->frames[childFrame.parentFrame].children[childFrame.parentSlot] = -1;
+  }
+  if (parentFrame.children.size() <= childNum) {
+    parentFrame.children.resize(*internalNodeNumKeys(parent) + 1, -1);
+  }
+  int32_t previous = parentFrame.children[childNum];
+  if (previous >= 0 && pager->frames[previous].parentFrame == parentFrameNum &&
+      pager->frames[previous].parentSlot == childNum) {
+    pager->frames[previous].parentFrame = -1;
+  }
+  parentFrame.children[childNum] = childFrameNum;
+  childFrame.parentFrame = parentFrameNum;
+  childFrame.parentSlot = childNum;
+  return page;
+}
+
+/**
+ * @brief Warm cache manifest (plain and WAL mode DB files with a buffer
+ *        pool)
+ * @details Every WARM_MANIFEST_INTERVAL_MS, and on close, the background
+ * writer records the pages worth keeping in `<db>-warm` : the resident
+ * frames, Am first, pages only fetched by scans left out. When the DB is opened again a prefetch thread
+ * reads them back in file order, runs of consecutive pages in one read of
+ * up to PREFETCH_RUN_PAGES pages, while statements already run.
+ * @note Prefetched pages only go to free frames and never push anything
+ * out. A run read while the DB file was written (write-back or backfill)
+ * is dropped : the copy read might be older than the file.
+ * @example
+ *      | Magic (8) | Number of Pages (4) | Page Numbers (4 each) ... |
+ */
+const char WARM_MAGIC[8] = "SQLCPPH";
+const uint32_t WARM_HEADER_SIZE = 12;
+const uint32_t WARM_MANIFEST_INTERVAL_MS = 5000;
+const uint32_t PREFETCH_RUN_PAGES = 64; // 256 KB reads
+
+/* Writes the pages worth prefetching next time, replacing the manifest */
+void saveWarmManifest(Pager *pager) {
+  std::vector<uint32_t> hot;
+  {
+    std::lock_guard<std::mutex> guard(pager->lock);
+    for (const PoolPartition &partition : pager->partitions) {
+      for (const FrameList *list : {&partition.am, &partition.a1in}) {
+        for (int32_t frameNum = list->head; frameNum >= 0;
+             frameNum = pager->frames[frameNum].next) {
+          if (!pager->frames[frameNum].useOnce) {
+            hot.push_back(pager->frames[frameNum].pageNum);
+          }
+        }
+      }
+    }
+  }
+
+  std::vector<uint8_t> manifest(WARM_HEADER_SIZE + hot.size() * 4);
+  uint32_t numPages = hot.size();
+  memcpy(manifest.data(), WARM_MAGIC, 8);
+  memcpy(manifest.data() + 8, &numPages, 4);
+  memcpy(manifest.data() + WARM_HEADER_SIZE, hot.data(), hot.size() * 4);
+  std::string tmpPath = pager->warmPath + ".tmp";
+  int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                S_IWUSR | S_IRUSR);
+  if (fd == -1) {
+    return; // Only a hint, the next attempt may do better
+  }
+  bool written = pwrite(fd, manifest.data(), manifest.size(), 0) ==
+                 (ssize_t)manifest.size();
+  close(fd);
+  if (!written || rename(tmpPath.c_str(), pager->warmPath.c_str()) == -1) {
+    unlink(tmpPath.c_str());
+  }
+}
+
+/**
+ * @brief Caches a prefetched copy of \p pageNum in a free frame, as a hot
+ *        page (in Am). Caller holds Pager::lock.
+ * @return false if the pool has no free frame left
+ */
+bool prefetchInstall(Pager *pager, uint32_t pageNum, const void *data) {
+  if (pageNum >= pager->numPages || pager->pages[pageNum] != nullptr) {
+    return true; // Gone, or fetched meanwhile and that copy is the current one
+  }
+  int32_t frameNum = -1;
+  for (PoolPartition &partition : pager->partitions) {
+    if (!partition.freeFrames.empty()) {
+      frameNum = partition.freeFrames.back();
+      partition.freeFrames.pop_back();
+      break;
+    }
+  }
+  if (frameNum < 0) {
+    return false;
+  }
+  void *page = pager->frames[frameNum].data;
+
+  memcpy(page, data, PAGE_SIZE);
+  pager->pages[pageNum] = page;
+  if (pager->trackChanges && !pager->shadow) {
+    pager->pageHashes[pageNum] = checksum64(page, PAGE_SIZE);
+  }
+  Frame &frame = pager->frames[frameNum];
+  frame.pageNum = pageNum;
+  frame.checksum = checksum64(page, PAGE_SIZE);
+  frame.useOnce = false;
+  pager->pageFrame[pageNum] = frameNum;
+  frameLink(pager, frameNum, QUEUE_AM, false);
+  pager->prefetched += 1;
+  return true;
+}
+
+/* Reads the pages of the manifest back in, see saveWarmManifest() */
+void prefetchLoop(Pager *pager) {
+  walWaitRecovered(pager);
+  int fd = open(pager->warmPath.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return;
+  }
+  uint8_t header[WARM_HEADER_SIZE];
+  uint32_t numPages = 0;
+  std::vector<uint32_t> pageNums;
+  if (pread(fd, header, WARM_HEADER_SIZE, 0) == WARM_HEADER_SIZE &&
+      memcmp(header, WARM_MAGIC, 8) == 0) {
+    memcpy(&numPages, header + 8, 4);
+    pageNums.resize(std::min<uint32_t>(numPages, TABLE_MAX_PAGES));
+    ssize_t length = pageNums.size() * 4;
+    if (pread(fd, pageNums.data(), length, WARM_HEADER_SIZE) != length) {
+      pageNums.clear();
+    }
+  }
+  close(fd);
+  std::sort(pageNums.begin(), pageNums.end());
+  pageNums.erase(std::unique(pageNums.begin(), pageNums.end()),
+                 pageNums.end());
+
+  void *run = nullptr; // Aligned, the DB file may be opened O_DIRECT
+  if (posix_memalign(&run, PAGE_SIZE, PREFETCH_RUN_PAGES * PAGE_SIZE) != 0) {
+    return;
+  }
+  uint8_t walPage[PAGE_SIZE];
+  size_t next = 0;
+  bool poolFull = false;
+  while (next < pageNums.size() && !poolFull) {
+    uint32_t first = pageNums[next];
+    uint32_t count = 1;
+    while (next + count < pageNums.size() && count < PREFETCH_RUN_PAGES &&
+           pageNums[next + count] == first + count) {
+      ++count;
+    }
+    next += count;
+
+    uint64_t fileWrites;
+    uint32_t filePages;
+    {
+      std::lock_guard<std::mutex> guard(pager->lock);
+      if (pager->stopping) {
+        break;
+      }
+      fileWrites = pager->fileWrites;
+      filePages = pager->fileSize / PAGE_SIZE;
+    }
+    count = std::min(count, first < filePages ? filePages - first : 0);
+    ssize_t bytes = pread(pager->fd, run, count * PAGE_SIZE,
+                          (uint64_t)first * PAGE_SIZE);
+    if (count == 0 || bytes != (ssize_t)(count * PAGE_SIZE)) {
+      continue;
+    }
+
+    std::lock_guard<std::mutex> guard(pager->lock);
+    if (pager->fileWrites != fileWrites) {
+      continue;
+    }
+    for (uint32_t i = 0; i < count && !poolFull; ++i) {
+      const void *page = (uint8_t *)run + i * PAGE_SIZE;
+      uint32_t pageNum = first + i;
+      if (pager->wal && pager->walIndex[pageNum] != 0) {
+        // Newer in the log
+        if (pread(pager->walFd, walPage, PAGE_SIZE,
+                  pager->walIndex[pageNum] + WAL_FRAME_HEADER_SIZE) !=
+            PAGE_SIZE) {
+          continue;
+        }
+        page = walPage;
+      }
+      poolFull = !prefetchInstall(pager, pageNum, page);
+    }
+  }
+  free(run);
+}
+
+/**
+ * @brief Background writer and checkpointer
+ * @details Statements never write the DB file themselves when these run.
+ * Every BACKGROUND_WRITER_INTERVAL_MS the writer writes back up to
+ * writerRate / 10 pages : dirty frames next in line for eviction, so the
+ * pool keeps clean frames to hand out, or in WAL mode pages newer in the
+ * log than in the DB file. The checkpointer wakes once the log holds
+ * walAutoCheckpoint frames (or every CHECKPOINT_INTERVAL_MS), copies what
+ * is left, syncs the DB file and empties the log.
+ * @note Statements hold Pager::lock, the threads only take it to look at
+ * pages or the log index, never while syncing. In WAL mode the copies are
+ * done without it : statements only read the DB file for pages not in the
+ * log, and only the checkpointer takes pages out of it.
+ */
+const uint32_t BACKGROUND_WRITER_INTERVAL_MS = 100;
+const uint32_t BACKGROUND_WRITER_DEFAULT_RATE = 1000; // Pages per second
+const uint32_t CHECKPOINT_INTERVAL_MS = 1000;
+
+/**
+ * @brief Copies up to \p maxPages pages whose newest frame is synced into
+ *        the DB file, syncing the log first. Caller holds checkpointLock,
+ *        and CHECKPOINT if the log is shared.
+ * @note Pages whose newest frame another process's statement does not see
+ * are left alone, it may be reading them from the DB file.
+ * @return Number of pages copied
+ */
+uint32_t walBackfill(Pager *pager, uint32_t maxPages) {
+  walWaitRecovered(pager);
+  uint64_t end, salt;
+  {
+    std::lock_guard<std::mutex> guard(pager->lock);
+    end = pager->walEnd;
+    salt = pager->walSalt;
+  }
+  walSyncTo(pager, salt, end);
+
+  std::vector<std::pair<uint32_t, uint64_t>> copies;
+  {
+    std::lock_guard<std::mutex> guard(pager->lock);
+    uint64_t minMark = UINT64_MAX;
+    if (pager->shm != nullptr) {
+      walRefresh(pager);
+      minMark = walShmMinMark(pager);
+    }
+    for (uint32_t pageNum = 0;
+         pageNum < pager->numPages && copies.size() < maxPages; ++pageNum) {
+      uint64_t offset = pager->walIndex[pageNum];
+      if (offset != 0 && offset < pager->walSynced && offset < minMark &&
+          offset != pager->walBackfilled[pageNum]) {
+        copies.push_back({pageNum, offset});
+      }
+    }
+  }
+  if (copies.empty()) {
+    return 0;
+  }
+
+  void *page = nullptr; // Aligned, the DB file may be opened O_DIRECT
+  if (posix_memalign(&page, PAGE_SIZE, PAGE_SIZE) != 0) {
+    std::cerr << "Unable to allocate a page.\n";
+    exit(EXIT_FAILURE);
+  }
+  for (const std::pair<uint32_t, uint64_t> &copy : copies) {
+    if (pread(pager->walFd, page, PAGE_SIZE,
+              copy.second + WAL_FRAME_HEADER_SIZE) != PAGE_SIZE ||
+        pwrite(pager->fd, page, PAGE_SIZE,
+               (uint64_t)copy.first * PAGE_SIZE) != PAGE_SIZE) {
+      std::cerr << "Error copying WAL frame: " << std::strerror(errno) << '\n';
+      exit(EXIT_FAILURE);
+    }
+  }
+  free(page);
+
+  std::lock_guard<std::mutex> guard(pager->lock);
+  for (const std::pair<uint32_t, uint64_t> &copy : copies) {
+    pager->walBackfilled[copy.first] = copy.second;
+    pager->fileSize =
+        std::max<uint64_t>(pager->fileSize, (copy.first + 1) * PAGE_SIZE);
+  }
+  pager->backgroundWrites += copies.size();
+  pager->fileWrites += 1;
+  return copies.size();
+}
+
+/**
+ * @brief Writes back up to \p maxPages dirty frames, from the head of the
+ *        lists (the next victims) onwards. The lock is taken per page.
+ * @return Number of pages written
+ */
+uint32_t bufferPoolWriteBack(Pager *pager, uint32_t maxPages) {
+  std::vector<uint32_t> candidates;
+  {
+    std::lock_guard<std::mutex> guard(pager->lock);
+    for (const PoolPartition &partition : pager->partitions) {
+      for (const FrameList *list : {&partition.a1in, &partition.am}) {
+        for (int32_t frameNum = list->head;
+             frameNum >= 0 && candidates.size() < 2 * (size_t)maxPages;
+             frameNum = pager->frames[frameNum].next) {
+          candidates.push_back(frameNum);
+        }
+      }
+    }
+  }
+
+  uint32_t written = 0;
+  for (uint32_t frameNum : candidates) {
+    if (written == maxPages) {
+      break;
+    }
+    std::lock_guard<std::mutex> guard(pager->lock);
+    if (frameNum >= pager->frames.size()) {
+      continue; // Given back meanwhile, see bufferPoolShrink()
+    }
+    Frame &frame = pager->frames[frameNum];
+    if (frame.pageNum == NO_PAGE) {
+      continue;
+    }
+    uint64_t hash = checksum64(frame.data, PAGE_SIZE);
+    if (hash != frame.checksum) {
+      pagerFlush(pager, frame.pageNum);
+      frame.checksum = hash;
+      pager->backgroundWrites += 1;
+      written += 1;
+    }
+  }
+  return written;
+}
+
+/**
+ * @brief Empties the log if the DB file holds every frame of it, unless a
+ *        commit came in meanwhile. Caller holds Pager::lock.
+ * @note A shared log is emptied while no other process has a statement
+ * running : every reader slot, then WRITE, is waited for. With the writers
+ * of other processes always a commit ahead of walBackfill(), what it did
+ * not copy is copied here, else the log would only grow.
+ */
+bool walTryReset(Pager *pager) {
+  if (pager->shm == nullptr) {
+    for (uint32_t i = 0; i < pager->numPages; ++i) {
+      if (pager->walIndex[i] != pager->walBackfilled[i]) {
+        return false;
+      }
+    }
+    walReset(pager);
+    pager->checkpoints += 1;
+    return true;
+  }
+
+  // Slots in order, so two processes emptying the log cannot deadlock
+  for (uint32_t i = 0; i < WAL_SHM_READERS; ++i) {
+    shmLock(pager, WAL_SHM_LOCK_READERS + i, F_WRLCK, true);
+  }
+  shmLock(pager, WAL_SHM_LOCK_WRITE, F_WRLCK, true);
+  walRefresh(pager);
+  std::vector<uint32_t> copies;
+  for (uint32_t i = 0; i < pager->numPages; ++i) {
+    if (pager->walIndex[i] != pager->walBackfilled[i]) {
+      copies.push_back(i);
+    }
+  }
+  if (!copies.empty()) {
+    pagerSync(pager, pager->walFd); // Backfilled frames must be on disk
+    void *page = nullptr;
+    if (posix_memalign(&page, PAGE_SIZE, PAGE_SIZE) != 0) {
+      std::cerr << "Unable to allocate a page.\n";
+      exit(EXIT_FAILURE);
+    }
+    for (uint32_t pageNum : copies) {
+      if (pread(pager->walFd, page, PAGE_SIZE,
+                pager->walIndex[pageNum] + WAL_FRAME_HEADER_SIZE) !=
+              PAGE_SIZE ||
+          pwrite(pager->fd, page, PAGE_SIZE, (uint64_t)pageNum * PAGE_SIZE) !=
+              PAGE_SIZE) {
+        std::cerr << "Error copying WAL frame: " << std::strerror(errno)
+                  << '\n';
+        exit(EXIT_FAILURE);
+      }
+      pager->fileSize =
+          std::max<uint64_t>(pager->fileSize, (pageNum + 1) * PAGE_SIZE);
+    }
+    free(page);
+    pagerSync(pager, pager->fd);
+    pager->backgroundWrites += copies.size();
+  }
+  walReset(pager);
+  pager->checkpoints += 1;
+  shmLock(pager, WAL_SHM_LOCK_WRITE, F_UNLCK, false);
+  for (uint32_t i = 0; i < WAL_SHM_READERS; ++i) {
+    shmLock(pager, WAL_SHM_LOCK_READERS + i, F_UNLCK, false);
+  }
+  return true;
+}
+
+/**
+ * @brief Copies every logged page into the DB file and syncs it, then
+ *        empties the log unless a commit came in meanwhile. Skipped while
+ *        another process checkpoints the shared log.
+ */
+void walCheckpoint(Pager *pager) {
+  std::lock_guard<std::mutex> checkpointGuard(pager->checkpointLock);
+  if (pager->shm != nullptr &&
+      !shmLock(pager, WAL_SHM_LOCK_CHECKPOINT, F_WRLCK, false)) {
+    return;
+  }
+  walBackfill(pager, UINT32_MAX);
+  pagerSync(pager, pager->fd);
+  {
+    std::lock_guard<std::mutex> guard(pager->lock);
+    walTryReset(pager); // Logged after the copy, the next checkpoint gets it
+  }
+  if (pager->shm != nullptr) {
+    shmLock(pager, WAL_SHM_LOCK_CHECKPOINT, F_UNLCK, false);
+  }
+}
+
+void backgroundWriterLoop(Pager *pager) {
+  auto manifestSaved = std::chrono::steady_clock::now();
+  while (true) {
+    uint32_t batch;
+    {
+      std::unique_lock<std::mutex> guard(pager->lock);
+      pager->wake.wait_for(
+          guard, std::chrono::milliseconds(BACKGROUND_WRITER_INTERVAL_MS),
+          [pager] { return pager->stopping; });
+      if (pager->stopping) {
+        return;
+      }
+      batch = pager->writerRate * BACKGROUND_WRITER_INTERVAL_MS / 1000;
+    }
+    if (!pager->warmPath.empty() &&
+        std::chrono::steady_clock::now() - manifestSaved >=
+            std::chrono::milliseconds(WARM_MANIFEST_INTERVAL_MS)) {
+      saveWarmManifest(pager);
+      manifestSaved = std::chrono::steady_clock::now();
+    }
+    if (batch == 0) {
+      continue;
+    }
+    std::lock_guard<std::mutex> checkpointGuard(pager->checkpointLock);
+    if (pager->shm != nullptr) {
+      if (shmLock(pager, WAL_SHM_LOCK_CHECKPOINT, F_WRLCK, false)) {
+        walBackfill(pager, batch);
+        shmLock(pager, WAL_SHM_LOCK_CHECKPOINT, F_UNLCK, false);
+      }
+    } else if (pager->wal) {
+      walBackfill(pager, batch);
+    } else {
+      bufferPoolWriteBack(pager, batch);
+    }
+  }
+}
+
+void checkpointerLoop(Pager *pager) {
+  walWaitRecovered(pager);
+  while (true) {
+    {
+      std::unique_lock<std::mutex> guard(pager->lock);
+      pager->wake.wait_for(
+          guard, std::chrono::milliseconds(CHECKPOINT_INTERVAL_MS), [pager] {
+            return pager->stopping ||
+                   (pager->walAutoCheckpoint > 0 &&
+                    walNumFrames(pager) >= pager->walAutoCheckpoint);
+          });
+      if (pager->stopping) {
+        return;
+      }
+      if (pager->walEnd == WAL_HEADER_SIZE) {
+        continue;
+      }
+    }
+    walCheckpoint(pager);
+  }
+}
+
+/* Starts the threads that have something to write for this pager */
+void pagerStartBackground(Pager *pager) {
+  pager->stopping = false;
+  pager->writerRate = BACKGROUND_WRITER_DEFAULT_RATE;
+  pager->backgroundWrites = 0;
+  if (pager->wal || (pager->usePool && !pager->shadow) ||
+      !pager->warmPath.empty()) {
+    pager->writer = std::thread(backgroundWriterLoop, pager);
+  }
+  if (!pager->warmPath.empty()) {
+    pager->prefetcher = std::thread(prefetchLoop, pager);
+  }
+  if (pager->wal) {
+    pager->checkpointer = std::thread(checkpointerLoop, pager);
+  }
+  if (pager->replica) {
+    pager->shipper = std::thread(replicaLoop, pager);
+  }
+}
+
+void pagerStopBackground(Pager *pager) {
+  if (pager->backupThread.joinable()) {
+    pager->backupThread.join();
+  }
+  for (std::thread &worker : pager->recoveryWorkers) {
+    worker.join();
+  }
+  pager->recoveryWorkers.clear();
+  {
+    std::lock_guard<std::mutex> guard(pager->lock);
+    pager->stopping = true;
+  }
+  pager->wake.notify_all();
+  if (pager->writer.joinable()) {
+    pager->writer.join();
+  }
+  if (pager->checkpointer.joinable()) {
+    pager->checkpointer.join();
+  }
+  if (pager->prefetcher.joinable()) {
+    pager->prefetcher.join();
+  }
+  if (pager->shipper.joinable()) {
+    pager->shipper.join();
+  }
+}
+
+/**
+ * @brief Starts tracking the changes of a plain or compressed file : from
+ *        now on commits compare the touched pages to their last hash.
+ *        Caller holds Pager::lock.
+ */
+void pagerTrackChanges(Pager *pager) {
+  if (pager->trackChanges) {
+    return;
+  }
+  pager->pageHashes.assign(pager->pages.size(), 0);
+  for (uint32_t i = 0; i < pager->numPages; ++i) {
+    if (pager->pages[i] != nullptr) {
+      pager->pageHashes[i] = checksum64(pager->pages[i], PAGE_SIZE);
+    }
+  }
+  pager->trackChanges = true;
+}
+
+/**
+ * @brief Copies the current content of \p pageNum, cached or not, to
+ *        \p dst (PAGE_SIZE aligned). Caller holds Pager::lock.
+ */
+void backupReadPage(Pager *pager, uint32_t pageNum, uint8_t *dst) {
+  if (pager->pages[pageNum] != nullptr) {
+    memcpy(dst, pager->pages[pageNum], PAGE_SIZE);
+    return;
+  }
+  memset(dst, 0, PAGE_SIZE);
+  if (pager->inMemory) {
+    return;
+  }
+  if (pager->wal && pager->walIndex[pageNum] != 0) {
+    uint64_t offset = pager->walIndex[pageNum] + WAL_FRAME_HEADER_SIZE;
+    if (pread(pager->walFd, dst, PAGE_SIZE, offset) != PAGE_SIZE) {
+      std::cerr << "Error reading WAL: " << std::strerror(errno) << '\n';
+      exit(EXIT_FAILURE);
+    }
+  } else if (pager->shadow) {
+    if (pageNum < pager->shadowMap.size() && pager->shadowMap[pageNum]) {
+      pagerReadAt(pager, dst, PAGE_SIZE,
+                  (uint64_t)pager->shadowMap[pageNum] * PAGE_SIZE);
+    }
+  } else if (pager->compressed) {
+    const PageExtent &extent = pager->pageMap[pageNum];
+    if (extent.length > 0) {
+      uint8_t stored[PAGE_SIZE];
+      pagerReadAt(pager, stored, extent.length, extent.offset);
+      decompressPage(stored, extent.length, dst);
+    }
+  } else if (pread(pager->fd, dst, PAGE_SIZE, (off_t)pageNum * PAGE_SIZE) <
+             0) { // Past the end of the file the page stays zeroed
+    std::cerr << "Error reading file: " << std::strerror(errno) << '\n';
+    exit(EXIT_FAILURE);
+  }
+}
+
+/**
+ * @brief One pass of dbBackup() : copies the pages changed since \p since
+ *        (every page if 0) into \p fd, holding Pager::lock throughout if
+ *        \p final, and sets \p numPages to the size of the DB it saw last.
+ * @return false on a write error
+ */
+bool backupPass(Pager *pager, int fd, uint64_t since, bool final,
+                uint8_t *chunk, uint32_t &numPages, uint64_t &copied) {
+  std::unique_lock<std::mutex> finalGuard;
+  if (final) {
+    finalGuard = std::unique_lock<std::mutex>(pager->lock);
+  }
+  for (uint32_t first = 0;; first += BACKUP_CHUNK_PAGES) {
+    uint32_t pageNums[BACKUP_CHUNK_PAGES];
+    uint32_t count = 0, rate;
+    {
+      std::unique_lock<std::mutex> guard;
+      if (!final) {
+        guard = std::unique_lock<std::mutex>(pager->lock);
+      }
+      pagerBeginStatement(pager); // The final pass keeps its first one
+      numPages = pager->numPages;
+      rate = pager->backupRate;
+      if (first >= numPages) {
+        pagerEndStatement(pager);
+        return true;
+      }
+      uint32_t last = std::min(first + BACKUP_CHUNK_PAGES, numPages);
+      for (uint32_t i = first; i < last; ++i) {
+        if (since == 0 || pager->pageLsn[i] >= since) {
+          backupReadPage(pager, i, chunk + count * PAGE_SIZE);
+          pageNums[count++] = i;
+        }
+      }
+      if (!final) {
+        pagerEndStatement(pager);
+      }
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+      ssize_t bytes = pwrite(fd, chunk + i * PAGE_SIZE, PAGE_SIZE,
+                             (off_t)pageNums[i] * PAGE_SIZE);
+      if (bytes != PAGE_SIZE) {
+        std::cerr << "Error writing backup: "
+                  << (bytes < 0 ? std::strerror(errno) : "short write")
+                  << '\n';
+        if (final) {
+          pagerEndStatement(pager);
+        }
+        return false;
+      }
+    }
+    copied += count;
+    if (!final && rate > 0 && count > 0) {
+      std::this_thread::sleep_for(
+          std::chrono::microseconds(count * 1000000ull / rate));
+    }
+  }
+}
+
+/**
+ * @brief Backs \p table up into the DB file \p path, while statements keep
+ *        running, see BACKUP_CHUNK_PAGES. Safe to call from any thread, it
+ *        only takes Pager::lock in between statements.
+ * @param incremental Only copy the pages changed since the last backup of
+ *        this connection into \p path, if there is one
+ * @return false if the backup could not be written
+ */
+bool dbBackup(Table *table, const std::string &path, bool incremental) {
+  Pager *pager = table->pager;
+  if (pager == nullptr) {
+    std::cerr << "Backups need a B-tree DB, not an LSM one.\n";
+    return false;
+  }
+  int fd = open(path.c_str(), O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+  if (fd == -1) {
+    std::cerr << "Unable to open backup file " << path << '\n';
+    return false;
+  }
+  walWaitRecovered(pager);
+
+  uint64_t since = 0;
+  {
+    std::lock_guard<std::mutex> guard(pager->lock);
+    pagerTrackChanges(pager);
+    for (const auto &backup : pager->backupLsns) {
+      if (incremental && backup.first == path) {
+        since = backup.second;
+      }
+    }
+  }
+  uint8_t *chunk = nullptr;
+  if (posix_memalign((void **)&chunk, PAGE_SIZE,
+                     BACKUP_CHUNK_PAGES * PAGE_SIZE) != 0) {
+    std::cerr << "Unable to allocate backup buffer.\n";
+    exit(EXIT_FAILURE);
+  }
+
+  bool written = true;
+  uint32_t numPages = 0, passes = 0;
+  uint64_t copied = 0;
+  while (written) {
+    uint64_t passLsn;
+    {
+      std::lock_guard<std::mutex> guard(pager->lock);
+      passLsn = pager->lsn;
+    }
+    passes += 1;
+    bool final = passes == BACKUP_MAX_PASSES;
+    written = backupPass(pager, fd, since, final, chunk, numPages, copied);
+    since = passLsn;
+    std::lock_guard<std::mutex> guard(pager->lock);
+    if (final || pager->lsn == passLsn) {
+      break; // Nothing committed during the pass
+    }
+  }
+  free(chunk);
+
+  if (written && (ftruncate(fd, (off_t)numPages * PAGE_SIZE) != 0 ||
+                  fdatasync(fd) != 0)) {
+    std::cerr << "Error writing backup: " << std::strerror(errno) << '\n';
+    written = false;
+  }
+  close(fd);
+
+  std::lock_guard<std::mutex> guard(pager->lock);
+  auto previous =
+      std::find_if(pager->backupLsns.begin(), pager->backupLsns.end(),
+                   [&](const auto &backup) { return backup.first == path; });
+  if (previous != pager->backupLsns.end()) {
+    pager->backupLsns.erase(previous);
+  }
+  if (written) {
+    pager->backupLsns.emplace_back(path, since);
+  }
+  pager->backupStatus =
+      path + (written ? ": " : ": failed, ") + std::to_string(copied) +
+      " pages copied in " + std::to_string(passes) + " passes, " +
+      std::to_string(numPages) + " pages";
+  return written;
+}
+
+/**
+ * @brief LSM-tree storage engine
+ * @details Alternative to the B-tree for write heavy tables, chosen when the
+ * DB file is created (--lsm). Inserts land in an in-memory skiplist, the
+ * memtable. A full memtable is written out sequentially as an immutable
+ * sorted run (an SSTable file next to the DB file) and a background thread
+ * merges runs, tier by tier, once LSM_TIER_FANOUT of them pile up in a tier.
+ * Lookups check the memtable, then the runs from newest to oldest, skipping
+ * every run whose Bloom filter rules the key out. Scans merge all of them.
+ * @note The DB file itself holds the manifest, the list of live runs. Like
+ * B-tree pages, the memtable only reaches disk when full or on close.
+ */
+const uint32_t LSM_SKIPLIST_MAX_HEIGHT = 12;
+const uint32_t LSM_DEFAULT_MEMTABLE_ROWS = 1024;
+const uint32_t LSM_TIER_FANOUT = 4;
+const uint32_t LSM_BLOOM_BITS_PER_KEY = 10;
+const uint32_t LSM_BLOOM_HASHES = 7;
+
+/* One memtable entry, with a tower of forward pointers */
+typedef struct SkipListNode {
+  uint8_t key[KEY_SIZE];
+  uint8_t value[ROW_SIZE];
+  uint32_t height;
+  struct SkipListNode *next[LSM_SKIPLIST_MAX_HEIGHT];
+} SkipListNode;
+
+typedef struct {
+  SkipListNode *head; // Sentinel, holds no entry
+  uint32_t height;
+  uint32_t numEntries;
+  uint64_t randomState;
+} MemTable;
+
+void memTableInit(MemTable *memTable) {
+  memTable->head = (SkipListNode *)calloc(1, sizeof(SkipListNode));
+  memTable->head->height = LSM_SKIPLIST_MAX_HEIGHT;
+  memTable->height = 1;
+  memTable->numEntries = 0;
+  memTable->randomState = 0x9E3779B97F4A7C15ull;
+}
+
+void memTableClear(MemTable *memTable) {
+  SkipListNode *node = memTable->head->next[0];
+  while (node != nullptr) {
+    SkipListNode *next = node->next[0];
+    free(node);
+    node = next;
+  }
+  memset(memTable->head->next, 0, sizeof(memTable->head->next));
+  memTable->height = 1;
+  memTable->numEntries = 0;
+}
+
+/* Each level is kept with probability 1/4 (xorshift64 random bits) */
+uint32_t memTableRandomHeight(MemTable *memTable) {
+  uint64_t x = memTable->randomState;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  memTable->randomState = x;
+  uint32_t height = 1;
+  while (height < LSM_SKIPLIST_MAX_HEIGHT && (x & 3) == 0) {
+    ++height;
+    x >>= 2;
+  }
+  return height;
+}
+
+/**
+ * @brief Finds the last node below \p key on every level.
+ * @return the node holding \p key, or nullptr
+ */
+SkipListNode *memTableSeek(MemTable *memTable, const uint8_t *key,
+                           SkipListNode **previous) {
+  SkipListNode *node = memTable->head;
+  for (int32_t level = LSM_SKIPLIST_MAX_HEIGHT - 1; level >= 0; --level) {
+    while (node->next[level] != nullptr &&
+           compareKeys(node->next[level]->key, key) < 0) {
+      node = node->next[level];
+    }
+    if (previous != nullptr) {
+      previous[level] = node;
+    }
+  }
+  SkipListNode *candidate = node->next[0];
+  if (candidate != nullptr && compareKeys(candidate->key, key) == 0) {
+    return candidate;
+  }
+  return nullptr;
+}
+
+void memTableInsert(MemTable *memTable, const uint8_t *key,
+                    const uint8_t *value) {
+  SkipListNode *previous[LSM_SKIPLIST_MAX_HEIGHT];
+  SkipListNode *existing = memTableSeek(memTable, key, previous);
+  if (existing != nullptr) {
+    memcpy(existing->value, value, ROW_SIZE);
+    return;
+  }
+
+  SkipListNode *node = (SkipListNode *)calloc(1, sizeof(SkipListNode));
+  memcpy(node->key, key, KEY_SIZE);
+  memcpy(node->value, value, ROW_SIZE);
+  node->height = memTableRandomHeight(memTable);
+  for (uint32_t level = 0; level < node->height; ++level) {
+    node->next[level] = previous[level]->next[level];
+    previous[level]->next[level] = node;
+  }
+  memTable->height = std::max(memTable->height, node->height);
+  memTable->numEntries += 1;
+}
+
+/**
+ * @brief SSTable file layout
+ * @details Entries (key + serialised row) are sorted and grouped in blocks of
+ * up to LSM_ENTRIES_PER_BLOCK, each block compressed with the page codec.
+ * The block index keeps the first key and place of every block, the Bloom
+ * filter has LSM_BLOOM_BITS_PER_KEY bits per entry.
+ * @example
+ *      +-----------------------------+  ← Offset 0
+ *      | Block 0 ... Block n-1       |  ← | Count (4) | Entries ... |
+ *      +-----------------------------+
+ *      | Block Index                 |  ← | First Key (8) | Offset (8) |
+ *      |                             |    | Length (4) | per block
+ *      +-----------------------------+
+ *      | Bloom Filter (64-bit words) |
+ *      +-----------------------------+
+ *      | Footer (40 bytes)           |  ← | Magic (8) | Entries (8) |
+ *      |                             |    | Blocks (4) | Bloom Words (4) |
+ *      |                             |    | Index Offset (8) |
+ *      |                             |    | Bloom Offset (8) |
+ *      +-----------------------------+
+ */
+const char SSTABLE_MAGIC[8] = "SQLCPPS";
+const uint32_t LSM_ENTRY_SIZE = KEY_SIZE + ROW_SIZE;
+const uint32_t LSM_BLOCK_COUNT_SIZE = sizeof(uint32_t);
+const uint32_t LSM_ENTRIES_PER_BLOCK =
+    (PAGE_SIZE - LSM_BLOCK_COUNT_SIZE) / LSM_ENTRY_SIZE;
+const uint32_t SSTABLE_INDEX_ENTRY_SIZE = KEY_SIZE + 8 + 4;
+const uint32_t SSTABLE_FOOTER_SIZE = 8 + 8 + 4 + 4 + 8 + 8;
+
+typedef struct {
+  uint8_t firstKey[KEY_SIZE];
+  uint64_t offset;
+  uint32_t length;
+} SSTableBlock;
+
+/* An open, immutable sorted run */
+struct SSTable {
+  uint64_t fileId;
+  uint32_t tier;      // 0 for runs flushed from the memtable
+  uint64_t sequence;  // Higher is newer, decides which run wins a key
+  std::string path;
+  int fd;
+  uint64_t numEntries;
+  std::vector<SSTableBlock> blocks;
+  std::vector<uint64_t> bloom;
+  bool obsolete; // Merged away, file goes once the last reader lets go
+
+  ~SSTable() {
+    close(fd);
+    if (obsolete) {
+      unlink(path.c_str());
+    }
+  }
+};
+
+typedef std::shared_ptr<SSTable> SSTablePtr;
+
+/* 64-bit mix of a key, split in two halves for double hashing */
+uint64_t hashKey(const uint8_t *key) {
+  uint64_t hash = 0xCBF29CE484222325ull;
+  for (uint32_t i = 0; i < KEY_SIZE; ++i) {
+    hash = (hash ^ key[i]) * 0x100000001B3ull;
+  }
+  hash ^= hash >> 31;
+  hash *= 0x7FB5D329728EA185ull;
+  hash ^= hash >> 27;
+  return hash;
+}
+
+void bloomAdd(std::vector<uint64_t> &bloom, const uint8_t *key) {
+  uint64_t numBits = bloom.size() * 64;
+  uint64_t hash = hashKey(key);
+  uint64_t delta = (hash >> 32) | 1;
+  for (uint32_t i = 0; i < LSM_BLOOM_HASHES; ++i) {
+    uint64_t bit = (hash + i * delta) % numBits;
+    bloom[bit / 64] |= (uint64_t)1 << (bit % 64);
+  }
+}
+
+bool bloomMayContain(const std::vector<uint64_t> &bloom, const uint8_t *key) {
+  uint64_t numBits = bloom.size() * 64;
+  uint64_t hash = hashKey(key);
+  uint64_t delta = (hash >> 32) | 1;
+  for (uint32_t i = 0; i < LSM_BLOOM_HASHES; ++i) {
+    uint64_t bit = (hash + i * delta) % numBits;
+    if ((bloom[bit / 64] & ((uint64_t)1 << (bit % 64))) == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void writeFully(int fd, const void *src, size_t length, uint64_t offset) {
+  ssize_t bytes = pwrite(fd, src, length, offset);
+  if (bytes != (ssize_t)length) {
+    std::cerr << "Error writing to file: "
+              << (bytes < 0 ? std::strerror(errno) : "short write") << '\n';
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Whether \p length bytes at \p offset were read, see openError() */
+bool readFully(int fd, void *dst, size_t length, uint64_t offset,
+               std::string *error = nullptr) {
+  ssize_t bytes = pread(fd, dst, length, offset);
+  if (bytes != (ssize_t)length) {
+    openError(error, std::string("Error reading file: ") +
+                         (bytes < 0 ? std::strerror(errno) : "short read"));
+    return false;
+  }
+  return true;
+}
+
+/* Reads block \p blockNum of \p run, decompressed, into \p dst */
+void sstableReadBlock(SSTable *run, uint32_t blockNum, uint8_t *dst) {
+  const SSTableBlock &block = run->blocks[blockNum];
+  uint8_t stored[PAGE_SIZE];
+  readFully(run->fd, stored, block.length, block.offset);
+  decompressPage(stored, block.length, dst);
+}
+
+inline uint32_t lsmBlockCount(const uint8_t *block) {
+  uint32_t count;
+  memcpy(&count, block, LSM_BLOCK_COUNT_SIZE);
+  return count;
+}
+
+inline uint8_t *lsmBlockEntry(uint8_t *block, uint32_t entryNum) {
+  return block + LSM_BLOCK_COUNT_SIZE + entryNum * LSM_ENTRY_SIZE;
+}
+
+SSTablePtr sstableOpen(const std::string &path, uint64_t fileId,
+                       uint32_t tier, uint64_t sequence) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    std::cerr << "Unable to open run " << path << '\n';
+    exit(EXIT_FAILURE);
+  }
+  SSTablePtr run = std::make_shared<SSTable>();
+  run->fileId = fileId;
+  run->tier = tier;
+  run->sequence = sequence;
+  run->path = path;
+  run->fd = fd;
+  run->obsolete = false;
+
+  off_t fileLength = lseek(fd, 0, SEEK_END);
+  uint8_t footer[SSTABLE_FOOTER_SIZE];
+  if (fileLength < (off_t)SSTABLE_FOOTER_SIZE) {
+    std::cerr << "Corrupted run " << path << '\n';
+    exit(EXIT_FAILURE);
+  }
+  readFully(fd, footer, SSTABLE_FOOTER_SIZE, fileLength - SSTABLE_FOOTER_SIZE);
+  uint32_t numBlocks, bloomWords;
+  uint64_t indexOffset, bloomOffset;
+  memcpy(&run->numEntries, footer + 8, 8);
+  memcpy(&numBlocks, footer + 16, 4);
+  memcpy(&bloomWords, footer + 20, 4);
+  memcpy(&indexOffset, footer + 24, 8);
+  memcpy(&bloomOffset, footer + 32, 8);
+  if (memcmp(footer, SSTABLE_MAGIC, sizeof(SSTABLE_MAGIC)) != 0) {
+    std::cerr << "Corrupted run " << path << '\n';
+    exit(EXIT_FAILURE);
+  }
+
+  std::vector<uint8_t> index(numBlocks * SSTABLE_INDEX_ENTRY_SIZE);
+  readFully(fd, index.data(), index.size(), indexOffset);
+  run->blocks.resize(numBlocks);
+  for (uint32_t i = 0; i < numBlocks; ++i) {
+    const uint8_t *entry = &index[i * SSTABLE_INDEX_ENTRY_SIZE];
+    memcpy(run->blocks[i].firstKey, entry, KEY_SIZE);
+    memcpy(&run->blocks[i].offset, entry + KEY_SIZE, 8);
+    memcpy(&run->blocks[i].length, entry + KEY_SIZE + 8, 4);
+  }
+  run->bloom.resize(bloomWords);
+  readFully(fd, run->bloom.data(), bloomWords * 8, bloomOffset);
+  return run;
+}
+
+/**
+ * @brief Writes a run from the sorted entries produced by \p next, which
+ *        fills key and value and returns false once exhausted.
+ * @param maxEntries upper bound on the number of entries, sizes the filter
+ */
+SSTablePtr
+sstableWrite(const std::string &path, uint64_t fileId, uint32_t tier,
+             uint64_t sequence, uint64_t maxEntries,
+             const std::function<bool(uint8_t *, uint8_t *)> &next) {
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+  if (fd == -1) {
+    std::cerr << "Unable to create run " << path << '\n';
+    exit(EXIT_FAILURE);
+  }
+
+  std::vector<uint64_t> bloom(
+      std::max<uint64_t>(1, (maxEntries * LSM_BLOOM_BITS_PER_KEY + 63) / 64));
+  std::vector<uint8_t> index;
+  uint64_t offset = 0, numEntries = 0;
+  uint8_t block[PAGE_SIZE];
+  uint8_t stored[PAGE_SIZE];
+  bool more = true;
+
+  while (more) {
+    memset(block, 0, PAGE_SIZE);
+    uint32_t count = 0;
+    while (count < LSM_ENTRIES_PER_BLOCK) {
+      uint8_t *entry = lsmBlockEntry(block, count);
+      if (!(more = next(entry, entry + KEY_SIZE))) {
+        break;
+      }
+      bloomAdd(bloom, entry);
+      ++count;
+    }
+    if (count == 0) {
+      break;
+    }
+    memcpy(block, &count, LSM_BLOCK_COUNT_SIZE);
+    numEntries += count;
+
+    uint32_t length = compressPage(block, stored);
+    writeFully(fd, length == PAGE_SIZE ? block : stored, length, offset);
+    uint8_t indexEntry[SSTABLE_INDEX_ENTRY_SIZE];
+    memcpy(indexEntry, lsmBlockEntry(block, 0), KEY_SIZE);
+    memcpy(indexEntry + KEY_SIZE, &offset, 8);
+    memcpy(indexEntry + KEY_SIZE + 8, &length, 4);
+    index.insert(index.end(), indexEntry, indexEntry + sizeof(indexEntry));
+    offset += length;
+  }
+
+  uint64_t indexOffset = offset;
+  writeFully(fd, index.data(), index.size(), indexOffset);
+  uint64_t bloomOffset = indexOffset + index.size();
+  writeFully(fd, bloom.data(), bloom.size() * 8, bloomOffset);
+
+  uint8_t footer[SSTABLE_FOOTER_SIZE];
+  uint32_t numBlocks = index.size() / SSTABLE_INDEX_ENTRY_SIZE;
+  uint32_t bloomWords = bloom.size();
+  memcpy(footer, SSTABLE_MAGIC, sizeof(SSTABLE_MAGIC));
+  memcpy(footer + 8, &numEntries, 8);
+  memcpy(footer + 16, &numBlocks, 4);
+  memcpy(footer + 20, &bloomWords, 4);
+  memcpy(footer + 24, &indexOffset, 8);
+  memcpy(footer + 32, &bloomOffset, 8);
+  writeFully(fd, footer, SSTABLE_FOOTER_SIZE, bloomOffset + bloom.size() * 8);
+  if (fdatasync(fd) != 0) { // Durable before a manifest names it
+    std::cerr << "Error syncing run " << path << ": " << std::strerror(errno)
+              << '\n';
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+
+  return sstableOpen(path, fileId, tier, sequence);
+}
+
+/**
+ * @brief Point lookup in one run : Bloom filter, then block index, then a
+ *        binary search in the one block that may hold the key.
+ */
+bool sstableGet(SSTable *run, const uint8_t *key, uint8_t *value) {
+  if (run->blocks.empty() || !bloomMayContain(run->bloom, key)) {
+    return false;
+  }
+
+  // Last block whose first key is not above the key
+  uint32_t minInd = 0, maxInd = run->blocks.size();
+  while (minInd != maxInd) {
+    uint32_t ind = (minInd + maxInd) / 2;
+    if (compareKeys(run->blocks[ind].firstKey, key) <= 0) {
+      minInd = ind + 1;
+    } else {
+      maxInd = ind;
+    }
+  }
+  if (minInd == 0) {
+    return false;
+  }
+
+  uint8_t block[PAGE_SIZE];
+  sstableReadBlock(run, minInd - 1, block);
+  uint32_t low = 0, high = lsmBlockCount(block);
+  while (low != high) {
+    uint32_t ind = (low + high) / 2;
+    int cmp = compareKeys(key, lsmBlockEntry(block, ind));
+    if (cmp == 0) {
+      if (value != nullptr) {
+        memcpy(value, lsmBlockEntry(block, ind) + KEY_SIZE, ROW_SIZE);
+      }
+      return true;
+    }
+    if (cmp < 0) {
+      high = ind;
+    } else {
+      low = ind + 1;
+    }
+  }
+  return false;
+}
+
+/* Sequential reader over one run, a decompressed block at a time */
+typedef struct {
+  SSTablePtr run;
+  uint32_t blockNum;
+  uint32_t entryNum;
+  uint8_t block[PAGE_SIZE];
+} RunIterator;
+
+/* Current entry of \p it, or nullptr once the run is exhausted */
+uint8_t *runIteratorEntry(RunIterator *it) {
+  while (it->entryNum >= lsmBlockCount(it->block)) {
+    if (it->blockNum + 1 >= it->run->blocks.size()) {
+      return nullptr;
+    }
+    it->blockNum += 1;
+    it->entryNum = 0;
+    sstableReadBlock(it->run.get(), it->blockNum, it->block);
+  }
+  return lsmBlockEntry(it->block, it->entryNum);
+}
+
+void runIteratorInit(RunIterator *it, const SSTablePtr &run) {
+  it->run = run;
+  it->blockNum = 0;
+  it->entryNum = 0;
+  memset(it->block, 0, LSM_BLOCK_COUNT_SIZE);
+  if (!run->blocks.empty()) {
+    sstableReadBlock(run.get(), 0, it->block);
+  }
+}
+
+/**
+ * @brief K-way merge over the memtable and a set of runs, in key order.
+ * @note  Sources are ranked newest first (memtable, then runs by decreasing
+ *        sequence). When several hold a key, the newest copy wins and the
+ *        others are skipped.
+ */
+typedef struct {
+  SkipListNode *memTableNode; // nullptr when not merging the memtable
+  std::vector<RunIterator *> runs;
+} MergeIterator;
+
+void mergeIteratorInit(MergeIterator *it, SkipListNode *memTableNode,
+                       const std::vector<SSTablePtr> &runs) {
+  it->memTableNode = memTableNode;
+  for (const SSTablePtr &run : runs) {
+    RunIterator *runIt = new RunIterator;
+    runIteratorInit(runIt, run);
+    it->runs.push_back(runIt);
+  }
+}
+
+void mergeIteratorFree(MergeIterator *it) {
+  for (RunIterator *runIt : it->runs) {
+    delete runIt;
+  }
+  it->runs.clear();
+}
+
+bool mergeIteratorNext(MergeIterator *it, uint8_t *key, uint8_t *value) {
+  const uint8_t *smallest = nullptr;
+  if (it->memTableNode != nullptr) {
+    smallest = it->memTableNode->key;
+  }
+  for (RunIterator *runIt : it->runs) {
+    uint8_t *entry = runIteratorEntry(runIt);
+    if (entry != nullptr &&
+        (smallest == nullptr || compareKeys(entry, smallest) < 0)) {
+      smallest = entry;
+    }
+  }
+  if (smallest == nullptr) {
+    return false;
+  }
+
+  uint8_t winner[KEY_SIZE];
+  memcpy(winner, smallest, KEY_SIZE);
+  bool found = false;
+  if (it->memTableNode != nullptr &&
+      compareKeys(it->memTableNode->key, winner) == 0) {
+    memcpy(value, it->memTableNode->value, ROW_SIZE);
+    it->memTableNode = it->memTableNode->next[0];
+    found = true;
+  }
+  for (RunIterator *runIt : it->runs) {
+    uint8_t *entry = runIteratorEntry(runIt);
+    if (entry != nullptr && compareKeys(entry, winner) == 0) {
+      if (!found) {
+        memcpy(value, entry + KEY_SIZE, ROW_SIZE);
+        found = true;
+      }
+      runIt->entryNum += 1;
+    }
+  }
+  memcpy(key, winner, KEY_SIZE);
+  return true;
+}
+
+struct LsmTree {
+  std::string path; // The DB file, holding the manifest
+  MemTable memTable;
+  uint32_t memTableMaxRows;
+
+  std::mutex mutex; // Guards everything below
+  std::vector<SSTablePtr> runs; // Newest first
+  uint64_t nextFileId;
+  uint64_t nextSequence;
+  std::condition_variable wakeCompactor;
+  std::thread compactor;
+  bool stopping;
+};
+
+/**
+ * @brief Manifest layout (the DB file of an LSM table)
+ * @example
+ *      | Magic (8) | Next File Id (8) | Next Sequence (8) | Runs (4) |
+ *      | per run : File Id (8) | Tier (4) | Sequence (8) |
+ */
+const char LSM_MAGIC[8] = "SQLCPPL";
+const uint32_t LSM_MANIFEST_HEADER_SIZE = 8 + 8 + 8 + 4;
+const uint32_t LSM_MANIFEST_RUN_SIZE = 8 + 4 + 8;
+
+std::string lsmRunPath(LsmTree *lsm, uint64_t fileId) {
+  return lsm->path + "-run-" + std::to_string(fileId);
+}
+
+/* fsync() of the directory holding \p path, making its renames durable */
+void syncDirectoryOf(const std::string &path) {
+  size_t slash = path.rfind('/');
+  std::string dir = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+  int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd == -1 || fsync(fd) != 0) {
+    std::cerr << "Error syncing directory " << dir << ": "
+              << std::strerror(errno) << '\n';
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+}
+
+/**
+ * @brief Rewrites the manifest through a temporary file. Caller holds the
+ *        mutex.
+ * @note Runs are synced when written, the manifest before it replaces the
+ * old one and the directory after : once this returns, the runs the old
+ * manifest named can be removed.
+ */
+void lsmSaveManifest(LsmTree *lsm) {
+  std::vector<uint8_t> manifest(LSM_MANIFEST_HEADER_SIZE +
+                                lsm->runs.size() * LSM_MANIFEST_RUN_SIZE);
+  uint32_t numRuns = lsm->runs.size();
+  memcpy(&manifest[0], LSM_MAGIC, sizeof(LSM_MAGIC));
+  memcpy(&manifest[8], &lsm->nextFileId, 8);
+  memcpy(&manifest[16], &lsm->nextSequence, 8);
+  memcpy(&manifest[24], &numRuns, 4);
+  for (uint32_t i = 0; i < numRuns; ++i) {
+    uint8_t *entry = &manifest[LSM_MANIFEST_HEADER_SIZE +
+                               i * LSM_MANIFEST_RUN_SIZE];
+    memcpy(entry, &lsm->runs[i]->fileId, 8);
+    memcpy(entry + 8, &lsm->runs[i]->tier, 4);
+    memcpy(entry + 12, &lsm->runs[i]->sequence, 8);
+  }
+
+  std::string tmpPath = lsm->path + "-manifest";
+  int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                S_IWUSR | S_IRUSR);
+  if (fd == -1) {
+    std::cerr << "Unable to write manifest " << tmpPath << '\n';
+    exit(EXIT_FAILURE);
+  }
+  writeFully(fd, manifest.data(), manifest.size(), 0);
+  if (fdatasync(fd) != 0 || rename(tmpPath.c_str(), lsm->path.c_str()) == -1) {
+    std::cerr << "Error saving manifest: " << std::strerror(errno) << '\n';
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+  syncDirectoryOf(lsm->path);
+}
+
+/* Picks a tier holding at least LSM_TIER_FANOUT runs, -1 if none */
+int32_t lsmPickCompaction(LsmTree *lsm) {
+  std::vector<uint32_t> runsPerTier;
+  for (const SSTablePtr &run : lsm->runs) {
+    if (run->tier >= runsPerTier.size()) {
+      runsPerTier.resize(run->tier + 1, 0);
+    }
+    if (++runsPerTier[run->tier] >= LSM_TIER_FANOUT) {
+      return run->tier;
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief Background compaction (size tiered). Merges every run of a full
+ *        tier into one run of the next tier, without holding the mutex
+ *        while merging, then swaps the runs in the manifest.
+ */
+void lsmCompactorLoop(LsmTree *lsm) {
+  std::unique_lock<std::mutex> lock(lsm->mutex);
+  while (true) {
+    int32_t tier;
+    lsm->wakeCompactor.wait(lock, [&] {
+      return lsm->stopping || lsmPickCompaction(lsm) >= 0;
+    });
+    if (lsm->stopping || (tier = lsmPickCompaction(lsm)) < 0) {
+      return;
+    }
+
+    std::vector<SSTablePtr> inputs;
+    uint64_t sequence = 0, maxEntries = 0;
+    for (const SSTablePtr &run : lsm->runs) {
+      if (run->tier == (uint32_t)tier) {
+        inputs.push_back(run);
+        sequence = std::max(sequence, run->sequence);
+        maxEntries += run->numEntries;
+      }
+    }
+    uint64_t fileId = lsm->nextFileId++;
+    lock.unlock();
+
+    MergeIterator merge;
+    mergeIteratorInit(&merge, nullptr, inputs);
+    SSTablePtr output = sstableWrite(
+        lsmRunPath(lsm, fileId), fileId, tier + 1, sequence, maxEntries,
+        [&](uint8_t *key, uint8_t *value) {
+          return mergeIteratorNext(&merge, key, value);
+        });
+    mergeIteratorFree(&merge);
+
+    lock.lock();
+    std::vector<SSTablePtr> remaining;
+    for (const SSTablePtr &run : lsm->runs) {
+      if (std::find(inputs.begin(), inputs.end(), run) == inputs.end()) {
+        remaining.push_back(run);
+      }
+    }
+    remaining.push_back(output);
+    std::sort(remaining.begin(), remaining.end(),
+              [](const SSTablePtr &a, const SSTablePtr &b) {
+                return a->sequence > b->sequence;
+              });
+    lsm->runs = remaining;
+    lsmSaveManifest(lsm);
+    for (const SSTablePtr &run : inputs) {
+      run->obsolete = true; // File is removed with the last reference
+    }
+  }
+}
+
+/**
+ * @brief Opens the LSM table described by the manifest at \p path, or
+ *        creates an empty one if \p path is empty.
+ */
+LsmTree *lsmOpen(const std::string &path, bool create) {
+  LsmTree *lsm = new LsmTree();
+  lsm->path = path;
+  lsm->memTableMaxRows = LSM_DEFAULT_MEMTABLE_ROWS;
+  lsm->nextFileId = 1;
+  lsm->nextSequence = 1;
+  lsm->stopping = false;
+  memTableInit(&lsm->memTable);
+
+  if (create) {
+    lsmSaveManifest(lsm);
+  } else {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+      std::cerr << "Unable to open file " << path << '\n';
+      exit(EXIT_FAILURE);
+    }
+    uint8_t header[LSM_MANIFEST_HEADER_SIZE];
+    readFully(fd, header, LSM_MANIFEST_HEADER_SIZE, 0);
+    uint32_t numRuns;
+    memcpy(&lsm->nextFileId, header + 8, 8);
+    memcpy(&lsm->nextSequence, header + 16, 8);
+    memcpy(&numRuns, header + 24, 4);
+    std::vector<uint8_t> entries(numRuns * LSM_MANIFEST_RUN_SIZE);
+    readFully(fd, entries.data(), entries.size(), LSM_MANIFEST_HEADER_SIZE);
+    close(fd);
+    for (uint32_t i = 0; i < numRuns; ++i) {
+      uint64_t fileId, sequence;
+      uint32_t tier;
+      memcpy(&fileId, &entries[i * LSM_MANIFEST_RUN_SIZE], 8);
+      memcpy(&tier, &entries[i * LSM_MANIFEST_RUN_SIZE + 8], 4);
+      memcpy(&sequence, &entries[i * LSM_MANIFEST_RUN_SIZE + 12], 8);
+      lsm->runs.push_back(
+          sstableOpen(lsmRunPath(lsm, fileId), fileId, tier, sequence));
+    }
+  }
+
+  lsm->compactor = std::thread(lsmCompactorLoop, lsm);
+  return lsm;
+}
+
+/* Writes the memtable out as a new tier 0 run */
+void lsmFlushMemTable(LsmTree *lsm) {
+  if (lsm->memTable.numEntries == 0) {
+    return;
+  }
+  uint64_t fileId, sequence;
+  {
+    std::lock_guard<std::mutex> lock(lsm->mutex);
+    fileId = lsm->nextFileId++;
+    sequence = lsm->nextSequence++;
+  }
+
+  SkipListNode *node = lsm->memTable.head->next[0];
+  SSTablePtr run = sstableWrite(
+      lsmRunPath(lsm, fileId), fileId, 0, sequence,
+      lsm->memTable.numEntries, [&](uint8_t *key, uint8_t *value) {
+        if (node == nullptr) {
+          return false;
+        }
+        memcpy(key, node->key, KEY_SIZE);
+        memcpy(value, node->value, ROW_SIZE);
+        node = node->next[0];
+        return true;
+      });
+  memTableClear(&lsm->memTable);
+
+  std::lock_guard<std::mutex> lock(lsm->mutex);
+  lsm->runs.insert(lsm->runs.begin(), run);
+  lsmSaveManifest(lsm);
+  lsm->wakeCompactor.notify_one();
+}
+
+/* Live runs, newest first, safe to read while compaction goes on */
+std::vector<SSTablePtr> lsmSnapshotRuns(LsmTree *lsm) {
+  std::lock_guard<std::mutex> lock(lsm->mutex);
+  return lsm->runs;
+}
+
+bool lsmGet(LsmTree *lsm, const uint8_t *key, uint8_t *value) {
+  SkipListNode *node = memTableSeek(&lsm->memTable, key, nullptr);
+  if (node != nullptr) {
+    if (value != nullptr) {
+      memcpy(value, node->value, ROW_SIZE);
+    }
+    return true;
+  }
+  for (const SSTablePtr &run : lsmSnapshotRuns(lsm)) {
+    if (sstableGet(run.get(), key, value)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void lsmPut(LsmTree *lsm, const uint8_t *key, const uint8_t *value) {
+  memTableInsert(&lsm->memTable, key, value);
+  if (lsm->memTable.numEntries >= lsm->memTableMaxRows) {
+    lsmFlushMemTable(lsm);
+  }
+}
+
+/* Calls \p visit for every entry, in key order */
+void lsmScan(LsmTree *lsm,
+             const std::function<void(const uint8_t *, const uint8_t *)>
+                 &visit) {
+  MergeIterator merge;
+  mergeIteratorInit(&merge, lsm->memTable.head->next[0],
+                    lsmSnapshotRuns(lsm));
+  uint8_t key[KEY_SIZE], value[ROW_SIZE];
+  while (mergeIteratorNext(&merge, key, value)) {
+    visit(key, value);
+  }
+  mergeIteratorFree(&merge);
+}
+
+/* Flushes the memtable, stops the compactor and frees everything */
+void lsmClose(LsmTree *lsm) {
+  lsmFlushMemTable(lsm);
+  {
+    std::lock_guard<std::mutex> lock(lsm->mutex);
+    lsm->stopping = true;
+  }
+  lsm->wakeCompactor.notify_one();
+  lsm->compactor.join();
+  memTableClear(&lsm->memTable);
+  free(lsm->memTable.head);
+  delete lsm;
+}
+
+void printLsmTree(LsmTree *lsm) {
+  std::cout << "- memtable (size " << lsm->memTable.numEntries << ")\n";
+  for (const SSTablePtr &run : lsmSnapshotRuns(lsm)) {
+    std::cout << "- run " << run->fileId << " (tier " << run->tier << ", size "
+              << run->numEntries << ", blocks " << run->blocks.size()
+              << ")\n";
+  }
+}
+
+/* True if \p fileName starts with the 8 bytes of \p expected */
+bool fileHasMagic(const std::string &fileName, const char *expected) {
+  char magic[8] = {0};
+  int fd = open(fileName.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return false;
+  }
+  ssize_t bytes = read(fd, magic, sizeof(magic));
+  close(fd);
+  return bytes == (ssize_t)sizeof(magic) &&
+         memcmp(magic, expected, sizeof(magic)) == 0;
+}
+
+/* True if \p fileName is the manifest of an LSM table */
+bool isLsmFile(const std::string &fileName) {
+  return fileHasMagic(fileName, LSM_MAGIC);
+}
+
+/**
+ * @brief Sharded tables : the rows are spread by the hash of their id over
+ *        `<db>-shard0` ... `<db>-shard<N-1>`, each a DB file of its own
+ *        (pager, tree or LSM, log, background threads). An INSERT goes to
+ *        one shard, a SELECT runs on all of them at once and merges their
+ *        rows back into id order.
+ * @note The number of shards is that of the files on disk, --shards only
+ * matters when the database is created.
+ */
+const uint32_t SHARDS_MAX = 64;
+
+/**
+ * @brief Threads the statements of a sharded table fan out on, handed one
+ *        shard at a time by shardPoolRun(). The calling thread takes its
+ *        share too.
+ */
+struct ShardPool {
+  std::vector<std::thread> workers;
+  std::mutex lock;
+  std::condition_variable wakeWorkers;
+  std::condition_variable shardsDone;
+  const std::function<void(uint32_t)> *task = nullptr;
+  uint32_t numShards = 0;
+  uint32_t nextShard = 0;  // Next one to hand out
+  uint32_t shardsLeft = 0; // Not done yet
+  bool stopping = false;
+};
+
+void shardPoolWorker(ShardPool *pool) {
+  std::unique_lock<std::mutex> guard(pool->lock);
+  while (true) {
+    pool->wakeWorkers.wait(guard, [pool] {
+      return pool->stopping || pool->nextShard < pool->numShards;
+    });
+    if (pool->stopping) {
+      return;
+    }
+    uint32_t shard = pool->nextShard++;
+    guard.unlock();
+    (*pool->task)(shard);
+    guard.lock();
+    if (--pool->shardsLeft == 0) {
+      pool->shardsDone.notify_one();
+    }
+  }
+}
+
+/* Runs \p task for every shard, returns once all of them are done */
+void shardPoolRun(ShardPool *pool, uint32_t numShards,
+                  const std::function<void(uint32_t)> &task) {
+  std::unique_lock<std::mutex> guard(pool->lock);
+  pool->task = &task;
+  pool->numShards = numShards;
+  pool->nextShard = 0;
+  pool->shardsLeft = numShards;
+  pool->wakeWorkers.notify_all();
+  while (pool->nextShard < pool->numShards) {
+    uint32_t shard = pool->nextShard++;
+    guard.unlock();
+    task(shard);
+    guard.lock();
+    pool->shardsLeft -= 1;
+  }
+  pool->shardsDone.wait(guard, [pool] { return pool->shardsLeft == 0; });
+  pool->task = nullptr;
+}
+
+ShardPool *shardPoolOpen(uint32_t numShards) {
+  ShardPool *pool = new ShardPool();
+  uint32_t numWorkers =
+      std::min(std::max(1u, std::thread::hardware_concurrency()), numShards);
+  for (uint32_t i = 1; i < numWorkers; ++i) {
+    pool->workers.emplace_back(shardPoolWorker, pool);
+  }
+  return pool;
+}
+
+void shardPoolClose(ShardPool *pool) {
+  {
+    std::lock_guard<std::mutex> guard(pool->lock);
+    pool->stopping = true;
+  }
+  pool->wakeWorkers.notify_all();
+  for (std::thread &worker : pool->workers) {
+    worker.join();
+  }
+  delete pool;
+}
+
+std::string shardFileName(const std::string &fileName, uint32_t shard) {
+  return fileName + "-shard" + std::to_string(shard);
+}
+
+/**
+ * @brief Number of DB files \p fileName is sharded over : those on disk,
+ *        else --shards for a new database. 1 or less if not sharded, 0 with
+ *        \p error set if the options do not match the files.
+ */
+uint32_t shardCount(const std::string &fileName, const OpenOptions &options,
+                    std::string *error = nullptr) {
+  struct stat fileStat;
+  uint32_t onDisk = 0;
+  while (stat(shardFileName(fileName, onDisk).c_str(), &fileStat) == 0) {
+    onDisk += 1;
+  }
+  // A new replica is sharded like its primary
+  uint32_t wanted = options.replicaOf.empty()
+                        ? options.shards
+                        : shardCount(options.replicaOf, OpenOptions());
+  if (onDisk == 0 && wanted > 1) {
+    if (isMemoryDb(fileName)) {
+      openError(error, "In-memory databases cannot be sharded.");
+      return 0;
+    }
+    if (stat(fileName.c_str(), &fileStat) == 0 && fileStat.st_size != 0) {
+      openError(error, "Database " + fileName + " is not sharded.");
+      return 0;
+    }
+    if (wanted > SHARDS_MAX) {
+      openError(error,
+                "At most " + std::to_string(SHARDS_MAX) + " shards.");
+      return 0;
+    }
+    return wanted;
+  }
+  if (onDisk != 0 && wanted != 0 && wanted != onDisk) {
+    openError(error, "Database " + fileName + " has " +
+                         std::to_string(onDisk) + " shards.");
+    return 0;
+  }
+  return onDisk;
+}
+
+/* Shard the row with primary key \p row->id lives in */
+uint32_t shardOf(const Table *table, const Row *row) {
+  uint8_t key[KEY_SIZE];
+  encodeRowKey(row, key);
+  return hashKey(key) % table->numShards;
+}
+
+/**
+ * @brief Range partitioned tables : the rows whose id is in
+ *        [k * width, (k + 1) * width) are in `<db>-part<k>`, a DB file of
+ *        its own created with the first of them, and the DB file itself is
+ *        the manifest listing the partitions. A SELECT only opens and scans
+ *        the partitions its WHERE overlaps, a partition is dropped whole by
+ *        removing its files.
+ * @note The manifest stays locked while open, the partitions a process
+ * creates and drops are not seen by the others. At most PARTITION_MAX_OPEN
+ * partitions are open at once, each with its file and writer thread : the
+ * least recently used one no statement or backup is using is closed to open
+ * another.
+ * @example
+ *      | Magic (8) | Width (8) | Partitions (4) | per partition : k (8) |
+ */
+const char PARTITION_MAGIC[8] = "SQLCPPR";
+const uint32_t PARTITION_MANIFEST_HEADER_SIZE = 8 + 8 + 4;
+const uint32_t PARTITION_MAX_OPEN = 16;
+
+struct PartitionMap {
+  std::string path;
+  int fd; // Of the manifest
+  uint64_t width;
+  std::map<uint64_t, Table *> partitions; // k → table, null until used
+  OpenOptions options;                     // The partitions are opened with
+  std::mutex lock; // Both sides of a join may open partitions at once
+  std::deque<uint64_t> openOrder;   // Open partitions, least recent first
+  std::map<uint64_t, uint32_t> pins; // Open partition → statements using it
+  std::map<uint64_t, std::string> backupStatuses; // Of closed partitions
+  uint64_t scans;  // Partitions the SELECTs had to choose from
+  uint64_t pruned; // Of which they did not scan
+};
+
+std::string partitionFileName(const std::string &fileName, uint64_t k) {
+  return fileName + "-part" + std::to_string(k);
+}
+
+/* Writes the manifest of \p map over the content of \p fd */
+void partitionSaveManifest(PartitionMap *map, int fd) {
+  uint32_t numPartitions = map->partitions.size();
+  std::vector<uint8_t> manifest(PARTITION_MANIFEST_HEADER_SIZE +
+                                numPartitions * 8);
+  memcpy(&manifest[0], PARTITION_MAGIC, sizeof(PARTITION_MAGIC));
+  memcpy(&manifest[8], &map->width, 8);
+  memcpy(&manifest[16], &numPartitions, 4);
+  uint8_t *entry = &manifest[PARTITION_MANIFEST_HEADER_SIZE];
+  for (const std::pair<const uint64_t, Table *> &partition :
+       map->partitions) {
+    memcpy(entry, &partition.first, 8);
+    entry += 8;
+  }
+  writeFully(fd, manifest.data(), manifest.size(), 0);
+  if (ftruncate(fd, manifest.size()) != 0 || fdatasync(fd) != 0) {
+    std::cerr << "Error saving manifest: " << std::strerror(errno) << '\n';
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Removes \p fileName and the files named after it (log, runs...) */
+void removeDbFiles(const std::string &fileName) {
+  size_t slash = fileName.rfind('/');
+  std::string dir =
+      slash == std::string::npos ? "." : fileName.substr(0, slash + 1);
+  std::string base =
+      slash == std::string::npos ? fileName : fileName.substr(slash + 1);
+  DIR *dirStream = opendir(dir.c_str());
+  if (dirStream == nullptr) {
+    return;
+  }
+  while (struct dirent *entry = readdir(dirStream)) {
+    std::string name = entry->d_name;
+    if (name == base || name.rfind(base + "-", 0) == 0) {
+      unlink((dir + "/" + name).c_str());
+    }
+  }
+  closedir(dirStream);
+}
+
+/* The manifest of a partitioned table, null if unusable (see openError()) */
+PartitionMap *partitionMapOpen(const std::string &fileName,
+                               const OpenOptions &options, bool create,
+                               std::string *error = nullptr) {
+  PartitionMap *map = new PartitionMap();
+  map->path = fileName;
+  map->options = options;
+  map->options.shards = 1; // A partition is never sharded itself
+  map->options.partitionWidth = 0;
+  map->scans = 0;
+  map->pruned = 0;
+  map->fd = open(fileName.c_str(), O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+  if (map->fd == -1) {
+    openError(error, "Unable to open file " + fileName);
+    delete map;
+    return nullptr;
+  }
+  if (flock(map->fd, LOCK_EX | LOCK_NB) != 0) {
+    openError(error, "Database " + fileName +
+                         " is locked by another process.");
+    close(map->fd);
+    delete map;
+    return nullptr;
+  }
+
+  if (create) {
+    map->width = options.partitionWidth;
+    partitionSaveManifest(map, map->fd);
+    return map;
+  }
+  uint8_t header[PARTITION_MANIFEST_HEADER_SIZE];
+  uint32_t numPartitions = 0;
+  std::vector<uint64_t> entries;
+  bool read = readFully(map->fd, header, PARTITION_MANIFEST_HEADER_SIZE, 0,
+                        error);
+  if (read) {
+    memcpy(&map->width, header + 8, 8);
+    memcpy(&numPartitions, header + 16, 4);
+    entries.resize(numPartitions);
+    read = readFully(map->fd, entries.data(), numPartitions * 8,
+                     PARTITION_MANIFEST_HEADER_SIZE, error);
+  }
+  if (!read) {
+    close(map->fd);
+    delete map;
+    return nullptr;
+  }
+  for (uint64_t k : entries) {
+    map->partitions[k] = nullptr; // Opened by the first statement needing it
+  }
+  return map;
+}
+
+/* How JOIN picks its operator, see `.pragma join` and planJoin() */
+typedef enum { JOIN_AUTO, JOIN_MERGE, JOIN_HASH, JOIN_LOOKUP } JOIN_ALGORITHM;
+
+// Rows a hash join builds in memory before it spills to temporary files
+const uint64_t JOIN_DEFAULT_MEMORY_ROWS = 1 << 16;
+
+const uint32_t STATS_HISTOGRAM_BUCKETS = 32;
+
+/* What ANALYZE found in a table, for the planner (see planJoin()) */
+typedef struct {
+  uint64_t numRows = 0;
+  uint64_t distinctUsernames = 0; // NDV, the ids being unique
+  uint64_t distinctEmails = 0;
+  // Equi-depth histogram of the ids : the smallest id, then the largest of
+  // each bucket, every bucket holding as many rows
+  std::vector<uint64_t> idBounds;
+} TableStats;
+
+/**
+ * @brief Tables a session can name : `main`, the database it opened, and
+ *        those `.attach`ed to it. Kept by the main table.
+ */
+struct Catalog {
+  std::map<std::string, Table *> attached; // Name → table
+  std::map<Table *, TableStats> stats;     // As of their last ANALYZE
+  JOIN_ALGORITHM joinAlgorithm = JOIN_AUTO;
+  uint64_t joinMemoryRows = JOIN_DEFAULT_MEMORY_ROWS;
+  uint64_t mergeJoins = 0;
+  uint64_t hashJoins = 0;
+  uint64_t lookupJoins = 0;
+  uint64_t spilledJoins = 0; // Hash joins that ran out of memory
+};
+
+/* The catalog of the main table \p table, created on first use */
+Catalog *tableCatalog(Table *table) {
+  if (table->catalog == nullptr) {
+    table->catalog = new Catalog();
+  }
+  return table->catalog;
+}
+
+void dbClose(Table *table, bool discard); // Forward declaration
+
+/**
+ * @brief Opens the database \p fileName, created with \p options if new
+ *
+ * @param error See openError()
+ * @return Table*, null if it could not be opened
+ */
+Table *dbOpen(const std::string &fileName,
+              const OpenOptions &options = OpenOptions(),
+              std::string *error = nullptr) {
+  Table *table = (Table *)malloc(sizeof(Table));
+  table->rootPageNum = 0;
+  table->leafFormat = NODE_LEAF;
+  table->internalFormat = NODE_INTERNAL;
+  table->lsm = nullptr;
+  table->pager = nullptr;
+  table->numShards = 0;
+  table->shards = nullptr;
+  table->shardPool = nullptr;
+  table->partitionMap = nullptr;
+  table->catalog = nullptr;
+  if (options.shards > 1 && options.partitionWidth != 0) {
+    openError(error, "Sharded tables cannot be partitioned.");
+    free(table);
+    return nullptr;
+  }
+  if (!options.replicaOf.empty() &&
+      fileHasMagic(options.replicaOf, PARTITION_MAGIC)) {
+    openError(error, "Replicas of partitioned databases are not supported.");
+    free(table);
+    return nullptr;
+  }
+
+  uint32_t numShards = shardCount(fileName, options, error);
+  if (numShards == 0 && error != nullptr && !error->empty()) {
+    free(table);
+    return nullptr;
+  }
+  if (numShards > 1) {
+    OpenOptions shardOptions = options;
+    shardOptions.shards = 1; // A shard is never sharded itself
+    table->numShards = numShards;
+    table->shards = (Table **)malloc(numShards * sizeof(Table *));
+    for (uint32_t i = 0; i < numShards; ++i) {
+      if (!options.replicaOf.empty()) { // Each follows its primary shard
+        shardOptions.replicaOf = shardFileName(options.replicaOf, i);
+      }
+      table->shards[i] =
+          dbOpen(shardFileName(fileName, i), shardOptions, error);
+      if (table->shards[i] == nullptr) { // Those opened already are closed
+        for (uint32_t j = 0; j < i; ++j) {
+          dbClose(table->shards[j], false);
+        }
+        free(table->shards);
+        free(table);
+        return nullptr;
+      }
+    }
+    table->shardPool = shardPoolOpen(numShards);
+    return table;
+  }
+
+  struct stat fileStat;
+  bool isNewFile =
+      stat(fileName.c_str(), &fileStat) != 0 || fileStat.st_size == 0;
+  if (isMemoryDb(fileName) && options.partitionWidth != 0) {
+    openError(error, "In-memory databases cannot be partitioned.");
+    free(table);
+    return nullptr;
+  }
+  if (!isMemoryDb(fileName) &&
+      (fileHasMagic(fileName, PARTITION_MAGIC) ||
+       (isNewFile && options.partitionWidth != 0))) {
+    table->partitionMap =
+        partitionMapOpen(fileName, options, isNewFile, error);
+    if (table->partitionMap == nullptr) {
+      free(table);
+      return nullptr;
+    }
+    return table;
+  }
+  if (!isMemoryDb(fileName) &&
+      (isLsmFile(fileName) || (isNewFile && options.lsm))) {
+    table->lsm = lsmOpen(fileName, isNewFile);
+    return table;
+  }
+
+  Pager *pager = pagerOpen(fileName, options, error);
+  if (pager == nullptr) {
+    free(table);
+    return nullptr;
+  }
+  table->pager = pager;
+
+  std::unique_lock<std::mutex> guard(pager->lock);
+  pagerBeginStatement(pager);
+  if (pager->numPages == 0) {
+    pagerBeginWrite(pager); // Another process may create it first
+  }
+  if (pager->numPages == 0) { // New DB file. Initialize page 0 as leaf node.
+    void *rootNode = getPage(pager, 0);
+    initializeLeafNode(rootNode);
+    setNodeRoot(rootNode, true);
+    pagerCommit(pager);
+  }
+  uint8_t format = *((uint8_t *)getPage(pager, 0) + IS_ROOT_OFFSET);
+  if (format != NODE_ROOT_FORMAT) {
+    openError(error, "Database " + fileName +
+                         " was written by an older version (file format " +
+                         std::to_string(format) + ", expected " +
+                         std::to_string(NODE_ROOT_FORMAT) + ").");
+    pagerEndStatement(pager);
+    guard.unlock();
+    dbClose(table, true); // Leaves the file as it found it
+    return nullptr;
+  }
+  // Buffering stays on for as long as the root is a buffered node
+  if (getNodeType(getPage(pager, 0)) == NODE_INTERNAL_BUFFERED) {
+    table->internalFormat = NODE_INTERNAL_BUFFERED;
+  }
+  pagerEndStatement(pager);
+  guard.unlock();
+  if (!pager->inMemory) {
+    pagerStartBackground(pager);
+  }
+
+  return table;
+}
+
+/* Closes the least recently used partition no statement is using, if any */
+void partitionCloseUnused(PartitionMap *map) {
+  for (auto k = map->openOrder.begin(); k != map->openOrder.end(); ++k) {
+    Table *&partitionRows = map->partitions.find(*k)->second;
+    Pager *pager = partitionRows->pager;
+    if (map->pins[*k] == 0 && (pager == nullptr || !pager->backupRunning)) {
+      if (pager != nullptr && !pager->backupStatus.empty()) {
+        map->backupStatuses[*k] = pager->backupStatus; // For .pragma backup
+      }
+      dbClose(partitionRows, false);
+      partitionRows = nullptr;
+      map->pins.erase(*k);
+      map->openOrder.erase(k);
+      return;
+    }
+  }
+}
+
+/**
+ * @brief Table of partition \p k, opened on first use, to hand back with
+ *        partitionRelease() : it stays open until then. Created if
+ *        \p create, else null if there is no such partition.
+ */
+Table *partitionTable(PartitionMap *map, uint64_t k, bool create) {
+  std::lock_guard<std::mutex> guard(map->lock);
+  auto partition = map->partitions.find(k);
+  if (partition == map->partitions.end()) {
+    if (!create) {
+      return nullptr;
+    }
+    std::string fileName = partitionFileName(map->path, k);
+    removeDbFiles(fileName); // Left over by a drop cut short
+    partition = map->partitions.emplace(k, nullptr).first;
+    partitionSaveManifest(map, map->fd);
+  }
+  if (partition->second == nullptr) {
+    if (map->openOrder.size() >= PARTITION_MAX_OPEN) {
+      partitionCloseUnused(map);
+    }
+    partition->second = dbOpen(partitionFileName(map->path, k), map->options);
+    auto backupStatus = map->backupStatuses.find(k);
+    if (backupStatus != map->backupStatuses.end()) {
+      partition->second->pager->backupStatus = backupStatus->second;
+      map->backupStatuses.erase(backupStatus);
+    }
+  } else {
+    map->openOrder.erase(
+        std::find(map->openOrder.begin(), map->openOrder.end(), k));
+  }
+  map->openOrder.push_back(k);
+  map->pins[k] += 1;
+  return partition->second;
+}
+
+/* Done with the partition \p k partitionTable() returned */
+void partitionRelease(PartitionMap *map, uint64_t k) {
+  std::lock_guard<std::mutex> guard(map->lock);
+  map->pins[k] -= 1;
+}
+
+/**
+ * @brief Binary search of a packed leaf, done on the deltas themselves :
+ *        the key is turned into a delta once and each probe extracts a
+ *        single delta, nothing else is unpacked.
+ */
+Cursor *leafPackedFind(Cursor *cursor, void *node, const uint8_t *key) {
+  uint64_t target = decodeKeyColumn(key);
+  uint64_t base = *leafPackedBase(node);
+  if (target < base) {
+    cursor->cellNum = 0;
+    return cursor;
+  }
+  target -= base;
+
+  const uint8_t *deltas = leafPackedDeltas(node);
+  uint32_t bitWidth = *leafPackedBitWidth(node);
+  uint32_t minInd = 0;
+  uint32_t oneBeforeMaxInd = *leafNodeNumCells(node);
+  while (oneBeforeMaxInd != minInd) {
+    uint32_t ind = (minInd + oneBeforeMaxInd) / 2;
+    uint64_t deltaAtInd = packedDeltaAt(deltas, bitWidth, ind);
+    if (target == deltaAtInd) {
+      cursor->cellNum = ind;
+      return cursor;
+    }
+    if (target < deltaAtInd) {
+      oneBeforeMaxInd = ind;
+    } else {
+      minInd = ind + 1;
+    }
+  }
+
+  cursor->cellNum = minInd;
+  return cursor;
+}
+
+/**
+ * @brief Find the leaf node for the given table's key
+ *
+ * @param table
+ * @param pageNum
+ * @param key
+ * @return Cursor pointer
  * @note The position of the key or the position of the another key that needs
  * to move if new key needs to be inserted, or the position one past the last
  * key.
  */
-Cursor *leafNodeFind(Table *table, uint32_t pageNum, uint32_t key) {
-  void *node = getPage(table->pager, pageNum);
+Cursor *leafNodeFind(Table *table, uint32_t pageNum, const uint8_t *key) {
+  void *node = getPage(table->pager, pageNum);
+  uint32_t numCells = *leafNodeNumCells(node);
+
+  Cursor *cursor = (Cursor *)malloc(sizeof(Cursor));
+  cursor->table = table;
+  cursor->pageNum = pageNum;
+  cursor->endOfTable = false;
+
+  if (hasPackedKeys(node)) {
+    return leafPackedFind(cursor, node, key);
+  }
+
+  // Binary Search
+  uint32_t minInd = 0;
+  uint32_t oneBeforeMaxInd = numCells;
+  while (oneBeforeMaxInd != minInd) {
+    uint32_t ind = (minInd + oneBeforeMaxInd) / 2;
+    int cmp = compareKeys(key, leafNodeKey(node, ind));
+    if (cmp == 0) {
+      cursor->cellNum = ind;
+      return cursor;
+    }
+    if (cmp < 0) {
+      oneBeforeMaxInd = ind;
+    } else {
+      minInd = ind + 1;
+    }
+  }
+
+  cursor->cellNum = minInd;
+  return cursor;
+}
+
+/* Descends from an internal node to the leaf which may contain \p key */
+Cursor *internalNodeFind(Table *table, uint32_t pageNum, const uint8_t *key) {
+  void *node = getPage(table->pager, pageNum);
+  while (!isLeafNode(node)) {
+    uint32_t childNum = internalNodeFindChild(node, key);
+    uint32_t childPageNum = *internalNodeChild(node, childNum);
+    node = getChildPage(table->pager, pageNum, node, childNum);
+    pageNum = childPageNum;
+  }
+  return leafNodeFind(table, pageNum, key);
+}
+
+Cursor *tableFind(Table *table, const uint8_t *key) {
+  uint32_t rootPageNum = table->rootPageNum;
+  void *rootNode = getPage(table->pager, rootPageNum);
+
+  if (isLeafNode(rootNode)) {
+    return leafNodeFind(table, rootPageNum, key);
+  } else {
+    return internalNodeFind(table, rootPageNum, key);
+  }
+}
+
+/* Create new Cursor at the first row whose id is at least \p minId */
+Cursor *tableSeek(Table *table, uint64_t minId) {
+  Row bound;
+  bound.id = minId;
+  uint8_t key[KEY_SIZE];
+  encodeRowKey(&bound, key);
+  Cursor *cursor = tableFind(table, key);
+
+  void *node = getPage(table->pager, cursor->pageNum);
+  cursor->endOfTable = (*leafNodeNumCells(node) == 0);
+  return cursor;
+}
+
+/* Create new Cursor for the Start of Table (the leftmost leaf) */
+Cursor *tableStart(Table *table) {
+  uint8_t smallestKey[KEY_SIZE] = {0};
+  Cursor *cursor = tableFind(table, smallestKey);
+
+  void *node = getPage(table->pager, cursor->pageNum);
+  uint32_t numCells = *leafNodeNumCells(node);
+  cursor->endOfTable = (numCells == 0); // Only the empty root has no cells
+
+  return cursor;
+}
+
+void cursorAdvance(Cursor *cursor) {
+  void *node = getPage(cursor->table->pager, cursor->pageNum);
+  cursor->cellNum += 1;
+
+  if (cursor->cellNum >= *leafNodeNumCells(node)) {
+    // Advance to the next leaf node
+    uint32_t nextPageNum = *leafNodeNextLeaf(node);
+    if (nextPageNum == 0) { // This was the rightmost leaf
+      cursor->endOfTable = true;
+    } else {
+      cursor->pageNum = nextPageNum;
+      cursor->cellNum = 0;
+    }
+  }
+}
+
+/**
+ * @brief Height of the tree (1 for a lone root leaf). Used to make sure a
+ *        full chain of splits still fits in the page budget.
+ */
+uint32_t treeHeight(Table *table) {
+  uint32_t height = 1;
+  void *node = getPage(table->pager, table->rootPageNum);
+  while (!isLeafNode(node)) {
+    node = getPage(table->pager, *internalNodeRightChild(node));
+    ++height;
+  }
+  return height;
+}
+
+/**
+ * @brief New pages always go at the end of the DB file, until free page
+ *        recycling exists
+ */
+uint32_t getUnusedPageNum(Pager *pager) { return pager->numPages; }
+
+uint32_t *messageBufferNumMessages(void *page) {
+  return (uint32_t *)((char *)page + MESSAGE_BUFFER_NUM_MESSAGES_OFFSET);
+}
+
+uint8_t *messageBufferMessage(void *page, uint32_t messageNum) {
+  return (uint8_t *)page + MESSAGE_BUFFER_HEADER_SIZE +
+         messageNum * MESSAGE_SIZE;
+}
+
+uint32_t newMessageBufferPage(Pager *pager) {
+  uint32_t pageNum = getUnusedPageNum(pager);
+  void *page = getPage(pager, pageNum);
+  setNodeType(page, NODE_MESSAGE_BUFFER);
+  setNodeRoot(page, false);
+  *messageBufferNumMessages(page) = 0;
+  return pageNum;
+}
+
+/* Number of pending messages in buffer page \p pageNum (0 : no buffer) */
+uint32_t messageBufferSize(Pager *pager, uint32_t pageNum) {
+  if (pageNum == 0) {
+    return 0;
+  }
+  return *messageBufferNumMessages(getPage(pager, pageNum));
+}
+
+void messageBufferRead(Pager *pager, uint32_t pageNum,
+                       std::vector<uint8_t> &messages) {
+  uint32_t numMessages = messageBufferSize(pager, pageNum);
+  messages.clear();
+  if (numMessages > 0) {
+    uint8_t *first = messageBufferMessage(getPage(pager, pageNum), 0);
+    messages.assign(first, first + numMessages * MESSAGE_SIZE);
+  }
+}
+
+void messageBufferWrite(Pager *pager, uint32_t pageNum,
+                        const std::vector<uint8_t> &messages) {
+  if (pageNum == 0) {
+    return;
+  }
+  void *page = getPage(pager, pageNum);
+  *messageBufferNumMessages(page) = messages.size() / MESSAGE_SIZE;
+  memcpy(messageBufferMessage(page, 0), messages.data(), messages.size());
+}
+
+/* Index of the first message of \p page whose key is not below \p key */
+uint32_t messageBufferFind(void *page, const uint8_t *key) {
+  uint32_t minInd = 0;
+  uint32_t maxInd = *messageBufferNumMessages(page);
+  while (minInd != maxInd) {
+    uint32_t ind = (minInd + maxInd) / 2;
+    if (compareKeys(messageBufferMessage(page, ind), key) < 0) {
+      minInd = ind + 1;
+    } else {
+      maxInd = ind;
+    }
+  }
+  return minInd;
+}
+
+/**
+ * @brief True if a message for \p key is pending in a buffer on the way
+ *        from the root to its leaf. The leaf itself is not looked at.
+ */
+bool messageBuffersContain(Table *table, const uint8_t *key) {
+  uint32_t pageNum = table->rootPageNum;
+  void *node = getPage(table->pager, pageNum);
+  while (!isLeafNode(node)) {
+    if (getNodeType(node) == NODE_INTERNAL_BUFFERED &&
+        *internalNodeBufferPage(node) != 0) {
+      void *buffer = getPage(table->pager, *internalNodeBufferPage(node));
+      uint32_t index = messageBufferFind(buffer, key);
+      if (index < *messageBufferNumMessages(buffer) &&
+          compareKeys(messageBufferMessage(buffer, index), key) == 0) {
+        return true;
+      }
+    }
+    uint32_t childNum = internalNodeFindChild(node, key);
+    uint32_t childPageNum = *internalNodeChild(node, childNum);
+    node = getChildPage(table->pager, pageNum, node, childNum);
+    pageNum = childPageNum;
+  }
+  return false;
+}
+
+/* Structure and De-structure Rows */
+void structureRow(Row *src, void *dst) {
+  memcpy((char *)dst + ID_OFFSET, &(src->id), ID_SIZE);
+  memcpy((char *)dst + USERNAME_OFFSET, &(src->username), USERNAME_SIZE);
+  memcpy((char *)dst + EMAIL_OFFSET, &(src->email), EMAIL_SIZE);
+}
+
+void destructureRow(void *src, Row *dst) {
+  memcpy(&(dst->id), (char *)src + ID_OFFSET, ID_SIZE);
+  memcpy(&(dst->username), (char *)src + USERNAME_OFFSET, USERNAME_SIZE);
+  memcpy(&(dst->email), (char *)src + EMAIL_OFFSET, EMAIL_SIZE);
+}
+
+/* Page Management */
+void cursorRow(Cursor *cursor, Row *row) {
+  uint32_t pageNum = cursor->pageNum;
+  void *page = getPage(cursor->table->pager, pageNum);
+  uint8_t value[ROW_SIZE];
+  leafNodeGetValue(page, cursor->cellNum, value);
+  destructureRow(value, row);
+}
+
+/**
+ * @brief Compresses a page and writes it to its extent, moving it to a new
+ *        extent if it outgrew the old one.
+ */
+void compressedPagerFlush(Pager *pager, uint32_t pageNum) {
+  uint8_t stored[PAGE_SIZE];
+  uint32_t length = compressPage((uint8_t *)pager->pages[pageNum], stored);
+  const uint8_t *data = length == PAGE_SIZE
+                            ? (const uint8_t *)pager->pages[pageNum]
+                            : stored;
+
+  PageExtent &extent = pager->pageMap[pageNum];
+  if (length > extent.capacity) {
+    releaseExtent(pager, extent);
+    extent = allocateExtent(pager, length);
+  }
+  extent.length = length;
+  pagerWriteAt(pager, data, length, extent.offset);
+}
+
+void pagerFlush(Pager *pager, uint32_t pageNum) {
+  if (pager->pages[pageNum] == nullptr) {
+    std::cerr << "Tried to flush unallocated page\n";
+    exit(EXIT_FAILURE);
+  }
+
+  if (pager->compressed) {
+    compressedPagerFlush(pager, pageNum);
+    return;
+  }
+
+  off_t offset = lseek(pager->fd, pageNum * PAGE_SIZE, SEEK_SET);
+  if (offset == -1) {
+    std::cerr << "Error seeking to page: " << std::strerror(errno) << '\n';
+    exit(EXIT_FAILURE);
+  }
+  ssize_t bytes = write(pager->fd, pager->pages[pageNum], PAGE_SIZE);
+  if (bytes < 0) {
+    std::cerr << "Error writing to file: " << std::strerror(errno) << '\n';
+    exit(EXIT_FAILURE);
+  }
+  pager->fileWrites += 1;
+  // An evicted page past the old end is read back from the file
+  if ((pageNum + 1) * PAGE_SIZE > pager->fileSize) {
+    pager->fileSize = (pageNum + 1) * PAGE_SIZE;
+  }
+}
+
+/**
+ * @brief Turns the root into an internal node over two children. The old
+ *        root content moves to a fresh page, so the root stays at its page.
+ *
+ * @param table
+ * @param rightChildPageNum sibling created by the split of the root
+ * @param separator key splitting old root content from \p rightChildPageNum
+ */
+void createNewRoot(Table *table, uint32_t rightChildPageNum,
+                   const uint8_t *separator) {
+  Pager *pager = table->pager;
+  void *root = getPage(pager, table->rootPageNum);
+  void *rightChild = getPage(pager, rightChildPageNum);
+  uint32_t leftChildPageNum = getUnusedPageNum(pager);
+  void *leftChild = getPage(pager, leftChildPageNum);
+
+  // Left child has data copied from old root
+  memcpy(leftChild, root, PAGE_SIZE);
+  setNodeRoot(leftChild, false);
+  if (!isLeafNode(leftChild)) {
+    for (uint32_t i = 0; i <= *internalNodeNumKeys(leftChild); ++i) {
+      void *child = getPage(pager, *internalNodeChild(leftChild, i));
+      *nodeParent(child) = leftChildPageNum;
+    }
+  }
+
+  // Root node is a new internal node with one key and two children
+  initializeInternalNode(root, table->internalFormat);
+  setNodeRoot(root, true);
+  InternalNodeImage image;
+  image.children = {leftChildPageNum, rightChildPageNum};
+  image.keys.assign(separator, separator + KEY_SIZE);
+  internalNodeEncode(root, image, table->internalFormat);
+
+  *nodeParent(leftChild) = table->rootPageNum;
+  *nodeParent(rightChild) = table->rootPageNum;
+}
+
+void internalNodeInsert(Table *table, uint32_t parentPageNum,
+                        uint32_t oldChildPageNum, uint32_t newChildPageNum,
+                        const uint8_t *separator);
+
+/**
+ * @brief Splits an internal node whose decoded \p image no longer fits.
+ *        The middle separator moves up into the parent.
+ */
+void internalNodeSplit(Table *table, uint32_t pageNum,
+                       const InternalNodeImage &image) {
+  Pager *pager = table->pager;
+  uint32_t numKeys = internalImageNumKeys(image);
+  uint32_t mid = numKeys / 2;
+
+  InternalNodeImage left, right;
+  left.children.assign(image.children.begin(),
+                       image.children.begin() + mid + 1);
+  left.keys.assign(image.keys.begin(), image.keys.begin() + mid * KEY_SIZE);
+  right.children.assign(image.children.begin() + mid + 1,
+                        image.children.end());
+  right.keys.assign(image.keys.begin() + (mid + 1) * KEY_SIZE,
+                    image.keys.end());
+  uint8_t upKey[KEY_SIZE];
+  memcpy(upKey, &image.keys[mid * KEY_SIZE], KEY_SIZE);
+
+  // Pending messages follow their key to the left or the right half
+  std::vector<uint8_t> messages, rightMessages;
+  messageBufferRead(pager, image.bufferPageNum, messages);
+  uint32_t leftCount = 0;
+  while (leftCount * MESSAGE_SIZE < messages.size() &&
+         compareKeys(&messages[leftCount * MESSAGE_SIZE], upKey) < 0) {
+    ++leftCount;
+  }
+  rightMessages.assign(messages.begin() + leftCount * MESSAGE_SIZE,
+                       messages.end());
+  messages.resize(leftCount * MESSAGE_SIZE);
+  NodeType format = messages.empty() && rightMessages.empty()
+                        ? table->internalFormat
+                        : NODE_INTERNAL_BUFFERED;
+  left.bufferPageNum = image.bufferPageNum;
+  right.bufferPageNum =
+      rightMessages.empty() ? 0 : newMessageBufferPage(pager);
+
+  void *node = getPage(pager, pageNum);
+  uint32_t newPageNum = getUnusedPageNum(pager);
+  void *newNode = getPage(pager, newPageNum);
+  initializeInternalNode(newNode, format);
+  *nodeParent(newNode) = *nodeParent(node);
+
+  internalNodeEncode(node, left, format);
+  internalNodeEncode(newNode, right, format);
+  messageBufferWrite(pager, left.bufferPageNum, messages);
+  messageBufferWrite(pager, right.bufferPageNum, rightMessages);
+  for (uint32_t childPageNum : right.children) {
+    *nodeParent(getPage(pager, childPageNum)) = newPageNum;
+  }
+
+  if (isNodeRoot(node)) {
+    createNewRoot(table, newPageNum, upKey);
+  } else {
+    internalNodeInsert(table, *nodeParent(node), pageNum, newPageNum, upKey);
+  }
+}
+
+/**
+ * @brief Adds \p newChildPageNum right after \p oldChildPageNum in the
+ *        parent, separated by \p separator. Splits the parent if needed.
+ */
+void internalNodeInsert(Table *table, uint32_t parentPageNum,
+                        uint32_t oldChildPageNum, uint32_t newChildPageNum,
+                        const uint8_t *separator) {
+  void *parent = getPage(table->pager, parentPageNum);
+  InternalNodeImage image;
+  internalNodeDecode(parent, image);
+
+  uint32_t index = 0;
+  while (image.children[index] != oldChildPageNum) {
+    ++index;
+  }
+  image.children.insert(image.children.begin() + index + 1, newChildPageNum);
+  image.keys.insert(image.keys.begin() + index * KEY_SIZE, separator,
+                    separator + KEY_SIZE);
+  *nodeParent(getPage(table->pager, newChildPageNum)) = parentPageNum;
+
+  NodeType format = messageBufferSize(table->pager, image.bufferPageNum) > 0
+                        ? NODE_INTERNAL_BUFFERED
+                        : table->internalFormat;
+  if (!internalNodeEncode(parent, image, format)) {
+    internalNodeSplit(table, parentPageNum, image);
+  }
+}
+
+/**
+ * @brief Creates a new node and moves half the cells over, then inserts the
+ *        new value in one of the two nodes and updates the parent (or creates
+ *        a new one).
+ * @param image every cell of the overflowing leaf, new cell included
+ */
+void leafNodeSplitAndInsert(Cursor *cursor, const LeafNodeImage &image) {
+  Table *table = cursor->table;
+  void *oldNode = getPage(table->pager, cursor->pageNum);
+  uint32_t newPageNum = getUnusedPageNum(table->pager);
+  void *newNode = getPage(table->pager, newPageNum);
+  initializeLeafNode(newNode);
+  *nodeParent(newNode) = *nodeParent(oldNode);
+  *leafNodeNextLeaf(newNode) = *leafNodeNextLeaf(oldNode);
+  *leafNodeNextLeaf(oldNode) = newPageNum;
+
+  // All keys, new one included, are divided evenly between old (left) and
+  // new (right) nodes
+  uint32_t totalCells = leafImageNumCells(image);
+  uint32_t leftCount = totalCells - totalCells / 2;
+  LeafNodeImage left, right;
+  left.keys.assign(image.keys.begin(), image.keys.begin() + leftCount * KEY_SIZE);
+  left.values.assign(image.values.begin(),
+                     image.values.begin() + leftCount * ROW_SIZE);
+  right.keys.assign(image.keys.begin() + leftCount * KEY_SIZE, image.keys.end());
+  right.values.assign(image.values.begin() + leftCount * ROW_SIZE,
+                      image.values.end());
+  leafNodeEncode(oldNode, left, table->leafFormat);
+  leafNodeEncode(newNode, right, table->leafFormat);
+
+  uint8_t separator[KEY_SIZE];
+  truncateSeparator(&image.keys[(leftCount - 1) * KEY_SIZE],
+                    &image.keys[leftCount * KEY_SIZE], separator);
+
+  if (isNodeRoot(oldNode)) {
+    createNewRoot(table, newPageNum, separator);
+  } else {
+    internalNodeInsert(table, *nodeParent(oldNode), cursor->pageNum,
+                       newPageNum, separator);
+  }
+}
+
+void leafNodeInsert(Cursor *cursor, const uint8_t *key, Row *value) {
+  Table *table = cursor->table;
+  void *node = getPage(table->pager, cursor->pageNum);
+  uint32_t numCells = *leafNodeNumCells(node);
+
+  if (getNodeType(node) != NODE_LEAF || table->leafFormat != NODE_LEAF ||
+      numCells >= LEAF_NODE_MAX_CELLS) {
+    // Re-encode the whole leaf, converting it to the table's leaf format
+    LeafNodeImage image;
+    leafNodeDecode(node, image);
+    uint8_t serialised[ROW_SIZE];
+    structureRow(value, serialised);
+    image.keys.insert(image.keys.begin() + cursor->cellNum * KEY_SIZE, key,
+                      key + KEY_SIZE);
+    image.values.insert(image.values.begin() + cursor->cellNum * ROW_SIZE,
+                        serialised, serialised + ROW_SIZE);
+    if (!leafNodeEncode(node, image, table->leafFormat)) { // Node is Full.
+      leafNodeSplitAndInsert(cursor, image);
+    }
+    return;
+  }
+
+  if (cursor->cellNum < numCells) { // Make room for new cell.
+    for (uint32_t i = numCells; i > cursor->cellNum; --i) {
+      memcpy(leafNodeCell(node, i), leafNodeCell(node, i - 1),
+             LEAF_NODE_CELL_SIZE);
+    }
+  }
+
+  *leafNodeNumCells(node) += 1;
+  memcpy(leafNodeKey(node, cursor->cellNum), key, LEAF_NODE_KEY_SIZE);
+  structureRow(value, leafNodeValue(node, cursor->cellNum));
+}
+
+void messageBufferFlush(Table *table, uint32_t pageNum, uint32_t depth);
+
+/**
+ * @brief Inserts through the message buffers : the row is parked in the
+ *        buffer of the first buffered node at depth \p minDepth or below on
+ *        its path, and goes straight to its leaf if there is none.
+ * @note  A full buffer is flushed first. That may reshape the tree, so the
+ *        descent then starts over from the root.
+ */
+void bufferedInsert(Table *table, const uint8_t *key, const uint8_t *value,
+                    uint32_t minDepth) {
+  Pager *pager = table->pager;
+  uint32_t pageNum = table->rootPageNum;
+  uint32_t depth = 0;
+  while (true) {
+    void *node = getPage(pager, pageNum);
+    if (isLeafNode(node)) {
+      Row row;
+      destructureRow((void *)value, &row);
+      Cursor *cursor = leafNodeFind(table, pageNum, key);
+      leafNodeInsert(cursor, key, &row);
+      free(cursor);
+      return;
+    }
+
+    if (getNodeType(node) == NODE_INTERNAL_BUFFERED && depth >= minDepth) {
+      if (*internalNodeBufferPage(node) == 0) {
+        *internalNodeBufferPage(node) = newMessageBufferPage(pager);
+      }
+      void *buffer = getPage(pager, *internalNodeBufferPage(node));
+      uint32_t numMessages = *messageBufferNumMessages(buffer);
+      if (numMessages < MESSAGE_BUFFER_MAX_MESSAGES) {
+        uint32_t index = messageBufferFind(buffer, key);
+        memmove(messageBufferMessage(buffer, index + 1),
+                messageBufferMessage(buffer, index),
+                (numMessages - index) * MESSAGE_SIZE);
+        memcpy(messageBufferMessage(buffer, index), key, KEY_SIZE);
+        memcpy(messageBufferMessage(buffer, index) + KEY_SIZE, value,
+               ROW_SIZE);
+        *messageBufferNumMessages(buffer) += 1;
+        return;
+      }
+      messageBufferFlush(table, pageNum, depth);
+      pageNum = table->rootPageNum;
+      depth = 0;
+      continue;
+    }
+
+    pageNum = *internalNodeChild(node, internalNodeFindChild(node, key));
+    ++depth;
+  }
+}
+
+/**
+ * @brief Pushes the largest batch of messages bound for a single child of
+ *        node \p pageNum (at \p depth) one level down.
+ */
+void messageBufferFlush(Table *table, uint32_t pageNum, uint32_t depth) {
+  Pager *pager = table->pager;
+  void *node = getPage(pager, pageNum);
+  void *buffer = getPage(pager, *internalNodeBufferPage(node));
+  uint32_t numMessages = *messageBufferNumMessages(buffer);
+
+  // Messages are sorted, so each child's messages form one run
+  uint32_t batchStart = 0, batchEnd = 0;
+  for (uint32_t start = 0; start < numMessages;) {
+    uint32_t childNum =
+        internalNodeFindChild(node, messageBufferMessage(buffer, start));
+    uint32_t end = start + 1;
+    while (end < numMessages &&
+           internalNodeFindChild(node, messageBufferMessage(buffer, end)) ==
+               childNum) {
+      ++end;
+    }
+    if (end - start > batchEnd - batchStart) {
+      batchStart = start;
+      batchEnd = end;
+    }
+    start = end;
+  }
+
+  std::vector<uint8_t> batch(messageBufferMessage(buffer, batchStart),
+                             messageBufferMessage(buffer, batchEnd));
+  memmove(messageBufferMessage(buffer, batchStart),
+          messageBufferMessage(buffer, batchEnd),
+          (numMessages - batchEnd) * MESSAGE_SIZE);
+  *messageBufferNumMessages(buffer) -= batchEnd - batchStart;
+
+  for (uint32_t i = 0; i < batch.size(); i += MESSAGE_SIZE) {
+    bufferedInsert(table, &batch[i], &batch[i + KEY_SIZE], depth + 1);
+  }
+}
+
+/**
+ * @brief Empties every message buffer of the tree. Done before a scan, which
+ *        then only has to look at the leaves.
+ */
+void flushAllMessageBuffers(Table *table) {
+  Pager *pager = table->pager;
+  while (true) {
+    // Depth first search for a node with pending messages
+    std::vector<std::pair<uint32_t, uint32_t>> stack = {
+        {table->rootPageNum, 0}};
+    bool found = false;
+    while (!stack.empty() && !found) {
+      pagerBeginOperation(pager);
+      uint32_t pageNum = stack.back().first;
+      uint32_t depth = stack.back().second;
+      stack.pop_back();
+      void *node = getPage(pager, pageNum);
+      if (isLeafNode(node)) {
+        continue; // Only for a lone root leaf
+      }
+      if (getNodeType(node) == NODE_INTERNAL_BUFFERED &&
+          messageBufferSize(pager, *internalNodeBufferPage(node)) > 0) {
+        messageBufferFlush(table, pageNum, depth);
+        found = true;
+        break;
+      }
+      // The tree is balanced : if one child is a leaf, all of them are
+      if (isLeafNode(getPage(pager, *internalNodeChild(node, 0)))) {
+        continue;
+      }
+      for (uint32_t i = 0; i <= *internalNodeNumKeys(node); ++i) {
+        stack.push_back({*internalNodeChild(node, i), depth + 1});
+      }
+    }
+    if (!found) {
+      return;
+    }
+  }
+}
+
+/**
+ * @brief Switches message buffering on or off. Existing internal nodes
+ *        convert when rewritten, the root right away so that the setting is
+ *        found again when the DB file is reopened.
+ */
+void setInsertBuffering(Table *table, bool enabled) {
+  if (!enabled) {
+    flushAllMessageBuffers(table);
+  }
+  table->internalFormat = enabled ? NODE_INTERNAL_BUFFERED : NODE_INTERNAL;
+
+  void *root = getPage(table->pager, table->rootPageNum);
+  if (!isLeafNode(root)) {
+    InternalNodeImage image;
+    internalNodeDecode(root, image);
+    internalNodeEncode(root, image, table->internalFormat);
+  }
+}
+
+/**
+ * @brief Flushes the page cache to disk, closes the DB file, frees the Pager &
+ *        Table structures
+ *
+ * @param table pointer to the table structure
+ * @param discard Nothing is written back, the files are about to be removed
+ * @note  Wait to flush the cache to disk until the user closes the DB
+ *        connection.
+ */
+void dbClose(Table *table, bool discard = false) {
+  if (table->catalog != nullptr) {
+    for (const std::pair<const std::string, Table *> &attached :
+         table->catalog->attached) {
+      dbClose(attached.second);
+    }
+    delete table->catalog;
+    table->catalog = nullptr;
+  }
+  if (table->partitionMap != nullptr) {
+    for (const std::pair<const uint64_t, Table *> &partition :
+         table->partitionMap->partitions) {
+      if (partition.second != nullptr) {
+        dbClose(partition.second);
+      }
+    }
+    close(table->partitionMap->fd); // Releases its lock
+    delete table->partitionMap;
+    free(table);
+    return;
+  }
+  if (table->numShards != 0) {
+    // Each shard checkpoints and syncs its own files, all at once
+    shardPoolRun(table->shardPool, table->numShards,
+                 [table](uint32_t shard) { dbClose(table->shards[shard]); });
+    shardPoolClose(table->shardPool);
+    free(table->shards);
+    free(table);
+    return;
+  }
+  if (table->lsm != nullptr) {
+    if (discard) {
+      memTableClear(&table->lsm->memTable);
+    }
+    lsmClose(table->lsm);
+    free(table);
+    return;
+  }
+
+  Pager *pager = table->pager;
+  if (pager->inMemory) {
+    if (pager->backupThread.joinable()) {
+      pager->backupThread.join();
+    }
+    for (uint8_t *chunk : pager->arenaChunks) {
+      free(chunk);
+    }
+    delete pager;
+    free(table);
+    return;
+  }
+  pagerStopBackground(pager);
+  if (!discard) {
+    pagerCommit(pager);
+  }
+  if (pager->wal) {
+    // The last process to close a shared log checkpoints it away
+    bool last = pager->shm == nullptr ||
+                shmLock(pager, WAL_SHM_LOCK_DMS, F_WRLCK, false);
+    if (last && !discard) {
+      walCheckpoint(pager);
+    }
+    close(pager->walFd);
+    if (last && pager->walEnd == WAL_HEADER_SIZE) {
+      unlink(pager->walPath.c_str());
+    }
+    if (pager->shm != nullptr) {
+      if (last) {
+        memset(pager->shm->magic, 0, 8);
+        unlink(pager->shmPath.c_str());
+      }
+      munmap(pager->shm, sizeof(WalShm));
+      close(pager->shmFd); // Releases its locks
+    }
+  }
+  if (!pager->warmPath.empty() && !discard) {
+    saveWarmManifest(pager);
+  }
+
+  for (uint32_t i = 0; i < pager->numPages; ++i) {
+    if (pager->pages[i] == nullptr)
+      continue;
+    if (!pager->shadow && !pager->wal && !discard) {
+      pagerFlush(pager, i);
+    }
+    if (!pager->usePool) {
+      free(pager->pages[i]);
+    }
+    pager->pages[i] = nullptr;
+  }
+  if (pager->usePool) {
+    for (uint32_t i = pager->numMappedFrames; i < pager->frames.size(); ++i) {
+      free(pager->frames[i].data);
+    }
+    for (const PoolPartition &partition : pager->partitions) {
+      munmap(partition.memory, partition.length);
+    }
+  }
+  if (pager->compressed && !discard) {
+    compressedPagerSaveMap(pager);
+  }
+  if (!discard) {
+    pagerSync(pager, pager->fd); // The checkpoint of plain files
+  }
+  if (pager->replica) {
+    close(pager->primaryFd);
+    if (pager->primaryWalFd != -1) {
+      close(pager->primaryWalFd);
+    }
+  }
+
+  int result = close(pager->fd);
+  if (result == -1) {
+    std::cerr << "Error closing DB file: " << std::strerror(errno) << '\n';
+    exit(EXIT_FAILURE);
+  }
+  delete pager;
+  free(table);
+}
+
+/**
+ * @brief Displays the default SQLite prompt
+ */
+inline void displayDefault() { std::cout << "SQLite > "; }
+
+/**
+ * @brief Cleanup function called before exit
+ */
+void closeInput() { std::cout << "Goodbye!\n"; }
+
+/**
+ * @brief   Efficiently reads a line of input using std::getline
+ * @param   inputBuffer Reference to string where input will be stored
+ * @return  Number of bytes read, -1 on error
+ */
+ssize_t readLine(std::string &inputBuffer) {
+  // Clear any existing content for safety
+  inputBuffer.clear();
+
+  // Read entire line at once
+  if (!std::getline(std::cin, inputBuffer)) {
+    // Handle EOF or error
+    return -1;
+  }
+
+  return inputBuffer.size();
+}
+
+void indent(uint32_t level) {
+  for (uint32_t i = 0; i < level; ++i) {
+    std::cout << "  ";
+  }
+}
+
+/* Prints the subtree rooted at \p pageNum, separators shown as integers */
+void printTree(Pager *pager, uint32_t pageNum, uint32_t indentationLevel) {
+  pagerBeginOperation(pager); // Callers fetch their node again afterwards
+  void *node = getPage(pager, pageNum);
+
+  uint8_t key[KEY_SIZE];
+  switch (getNodeType(node)) {
+  case NODE_LEAF:
+  case NODE_LEAF_PACKED:
+  case NODE_LEAF_PAX: {
+    uint32_t numCells = *leafNodeNumCells(node);
+    indent(indentationLevel);
+    if (hasPackedKeys(node)) {
+      std::cout << "- "
+                << (getNodeType(node) == NODE_LEAF_PAX ? "pax" : "packed")
+                << " leaf (size " << numCells << ", base "
+                << *leafPackedBase(node) << ", bits "
+                << (int)*leafPackedBitWidth(node) << ")\n";
+    } else {
+      std::cout << "- leaf (size " << numCells << ")\n";
+    }
+    for (uint32_t i = 0; i < numCells; ++i) {
+      leafNodeGetKey(node, i, key);
+      indent(indentationLevel + 1);
+      std::cout << "- " << decodeKeyColumn(key) << "\n";
+    }
+    break;
+  }
+  case NODE_INTERNAL:
+  case NODE_INTERNAL_BUFFERED: {
+    uint32_t numKeys = *internalNodeNumKeys(node);
+    indent(indentationLevel);
+    std::cout << "- internal (size " << numKeys << ", prefix "
+              << (int)*internalNodePrefixLen(node) << ", slot "
+              << (int)*internalNodeSlotWidth(node);
+    if (getNodeType(node) == NODE_INTERNAL_BUFFERED) {
+      std::cout << ", messages "
+                << messageBufferSize(pager, *internalNodeBufferPage(node));
+    }
+    std::cout << ")\n";
+    for (uint32_t i = 0; i < numKeys; ++i) {
+      printTree(pager, *internalNodeChild(node, i), indentationLevel + 1);
+      node = getPage(pager, pageNum);
+      internalNodeKey(node, i, key);
+      indent(indentationLevel + 1);
+      std::cout << "- key " << decodeKeyColumn(key) << "\n";
+    }
+    printTree(pager, *internalNodeRightChild(node), indentationLevel + 1);
+    break;
+  }
+  case NODE_MESSAGE_BUFFER:
+    break; // Never reached through a child pointer
+  }
+}
+
+/**
+ * @brief Handles `.pragma <name> [value]`. Without a value the current
+ *        setting is printed.
+ */
+META_COMMAND_RESULT doPragma(const std::string &inputLine, Table *table) {
+  std::istringstream pragmaStream(inputLine);
+  std::string pragma, name, value;
+  pragmaStream >> pragma >> name >> value;
+  std::unique_lock<std::mutex> guard;
+  if (table->pager != nullptr) {
+    guard = std::unique_lock<std::mutex>(table->pager->lock);
+  }
+
+  if (name == "partitions") {
+    PartitionMap *map = table->partitionMap;
+    if (map == nullptr) {
+      std::cout << "off\n";
+      return META_COMMAND_SUCCESS;
+    }
+    std::cout << map->partitions.size() << " partitions of " << map->width
+              << " ids (" << map->pruned << " of " << map->scans
+              << " partition scans pruned)\n";
+    for (const std::pair<const uint64_t, Table *> &partition :
+         map->partitions) {
+      uint64_t first = partition.first * map->width;
+      // The last partition may end past the largest id
+      uint64_t last = first + std::min(map->width - 1, UINT64_MAX - first);
+      std::cout << "  " << partition.first << " : ids " << first << " to "
+                << last << (partition.second != nullptr ? ", open" : "") << "\n";
+    }
+    return META_COMMAND_SUCCESS;
+  }
+  if (name == "join") {
+    Catalog *catalog = tableCatalog(table);
+    const char *algorithms[] = {"auto", "merge", "hash", "lookup"};
+    if (value.empty()) {
+      std::cout << algorithms[catalog->joinAlgorithm] << " ("
+                << catalog->mergeJoins << " merge joins, "
+                << catalog->hashJoins << " hash joins, "
+                << catalog->lookupJoins << " lookup joins, "
+                << catalog->spilledJoins << " spilled)\n";
+      return META_COMMAND_SUCCESS;
+    }
+    for (int algorithm = JOIN_AUTO; algorithm <= JOIN_LOOKUP; ++algorithm) {
+      if (value == algorithms[algorithm]) {
+        catalog->joinAlgorithm = (JOIN_ALGORITHM)algorithm;
+        return META_COMMAND_SUCCESS;
+      }
+    }
+    std::cout << "Usage : .pragma join [auto|merge|hash|lookup]\n";
+    return META_COMMAND_SUCCESS;
+  }
+  if (name == "join_memory") {
+    Catalog *catalog = tableCatalog(table);
+    if (value.empty()) {
+      std::cout << catalog->joinMemoryRows << " rows\n";
+    } else {
+      catalog->joinMemoryRows =
+          std::max<uint64_t>(1, std::strtoull(value.c_str(), nullptr, 10));
+    }
+    return META_COMMAND_SUCCESS;
+  }
+  if (name == "shards") {
+    if (table->numShards == 0) {
+      std::cout << "off\n";
+    } else {
+      std::cout << table->numShards << " ("
+                << table->shardPool->workers.size() + 1 << " threads)\n";
+    }
+    return META_COMMAND_SUCCESS;
+  }
+  if (name == "lsm_memtable_rows" && table->lsm != nullptr) {
+    if (value.empty()) {
+      std::cout << table->lsm->memTableMaxRows << "\n";
+    } else {
+      table->lsm->memTableMaxRows = std::max(1, std::atoi(value.c_str()));
+    }
+    return META_COMMAND_SUCCESS;
+  }
+  if (name == "buffer_pool") {
+    Pager *pager = table->pager;
+    if (pager == nullptr || !pager->usePool) {
+      std::cout << "off\n";
+      return META_COMMAND_SUCCESS;
+    }
+    uint32_t resident = 0;
+    for (const Frame &frame : pager->frames) {
+      resident += frame.pageNum != NO_PAGE;
+    }
+    std::cout << "on (" << pager->frames.size() << " frames";
+    if (pager->peakFrames > pager->numMappedFrames) {
+      // Grown while a statement had every frame in use
+      std::cout << ", " << pager->frames.size() - pager->numMappedFrames
+                << " over --pool-pages, at most "
+                << pager->peakFrames - pager->numMappedFrames;
+    }
+    std::cout << ", " << resident << " resident, " << pager->evictions
+              << " evictions, " << pager->writeBacks << " write-backs, "
+              << (pager->direct ? "O_DIRECT" : "page cache") << ", "
+              << pager->ghosts.size() << " ghosts)\n";
+    for (const PoolPartition &partition : pager->partitions) {
+      std::cout << "- node " << partition.node << " ("
+                << partition.frameNums.size() << " frames, A1in "
+                << partition.a1in.size << ", Am " << partition.am.size << ", "
+                << (partition.backing == POOL_HUGETLB ? "hugetlb"
+                    : partition.backing == POOL_TRANSPARENT_HUGE_PAGES
+                        ? "transparent huge pages"
+                        : "4 KB pages")
+                << ")\n";
+    }
+    return META_COMMAND_SUCCESS;
+  }
+  if (name == "shadow") {
+    Pager *pager = table->pager;
+    if (pager == nullptr || !pager->shadow) {
+      std::cout << "off\n";
+      return META_COMMAND_SUCCESS;
+    }
+    std::cout << "on (transaction " << pager->txnId << ", " << pager->numSlots
+              << " slots, " << pager->freeSlots.size() << " free)\n";
+    return META_COMMAND_SUCCESS;
+  }
+  if (name == "wal") {
+    Pager *pager = table->pager;
+    if (pager == nullptr || !pager->wal) {
+      std::cout << "off\n";
+      return META_COMMAND_SUCCESS;
+    }
+    walWaitRecovered(pager);
+    uint32_t pending = 0;
+    for (uint32_t i = 0; i < pager->numPages; ++i) {
+      pending += pager->walIndex[i] != pager->walBackfilled[i];
+    }
+    std::cout << "on (" << walNumFrames(pager) << " frames, " << pending
+              << " pages to backfill, " << pager->checkpoints
+              << " checkpoints)\n";
+    return META_COMMAND_SUCCESS;
+  }
+  if (name == "wal_autocheckpoint" && table->pager != nullptr &&
+      table->pager->wal) {
+    if (value.empty()) {
+      std::cout << table->pager->walAutoCheckpoint << "\n";
+    } else {
+      table->pager->walAutoCheckpoint = std::atoi(value.c_str());
+    }
+    return META_COMMAND_SUCCESS;
+  }
+  if (name == "checkpoint" && table->pager != nullptr && table->pager->wal) {
+    guard.unlock(); // Taken again while the checkpoint needs it
+    walCheckpoint(table->pager);
+    return META_COMMAND_SUCCESS;
+  }
+  if (name == "writer_rate" && table->pager != nullptr) {
+    if (table->pager->inMemory) {
+      std::cout << (value.empty() ? "off\n"
+                                  : "In-memory databases have no writer.\n");
+    } else if (value.empty()) {
+      std::cout << table->pager->writerRate << " pages/s ("
+                << table->pager->backgroundWrites << " written)\n";
+    } else {
+      table->pager->writerRate = std::atoi(value.c_str());
+    }
+    return META_COMMAND_SUCCESS;
+  }
+  if (name == "synchronous" && table->pager != nullptr) {
+    SYNCHRONOUS &synchronous = table->pager->synchronous;
+    if (table->pager->inMemory && !value.empty()) {
+      std::cout << "In-memory databases have nothing to sync.\n";
+    } else if (value.empty()) {
+      std::cout << (synchronous == SYNCHRONOUS_OFF      ? "off"
+                    : synchronous == SYNCHRONOUS_NORMAL ? "normal"
+                                                        : "full")
+                << "\n";
+    } else if (value == "off") {
+      synchronous = SYNCHRONOUS_OFF;
+    } else if (value == "normal") {
+      synchronous = SYNCHRONOUS_NORMAL;
+    } else if (value == "full") {
+      synchronous = SYNCHRONOUS_FULL;
+    } else {
+      std::cout << "Unknown synchronous '" << value << "'\n";
+    }
+    return META_COMMAND_SUCCESS;
+  }
+  if (name == "replica") {
+    Pager *pager = table->pager;
+    if (pager == nullptr || !pager->replica) {
+      std::cout << "off\n";
+      return META_COMMAND_SUCCESS;
+    }
+    std::cout << "following " << pager->primaryPath << " ("
+              << pager->shippedCommits << " commits shipped, "
+              << pager->resyncs << " resyncs, " << pager->shippedPages
+              << " pages)\n";
+    return META_COMMAND_SUCCESS;
+  }
+  if (name == "warm_cache") {
+    Pager *pager = table->pager;
+    if (pager == nullptr || pager->warmPath.empty()) {
+      std::cout << "off\n";
+      return META_COMMAND_SUCCESS;
+    }
+    std::cout << "on (" << pager->prefetched << " pages prefetched)\n";
+    return META_COMMAND_SUCCESS;
+  }
+  if (name == "backup" && table->pager != nullptr) {
+    Pager *pager = table->pager;
+    if (pager->backupRunning) {
+      std::cout << "running\n";
+    } else {
+      std::cout << (pager->backupStatus.empty() ? "none"
+                                                : pager->backupStatus)
+                << "\n";
+    }
+    return META_COMMAND_SUCCESS;
+  }
+  if (name == "backup_rate" && table->pager != nullptr) {
+    if (value.empty()) {
+      std::cout << table->pager->backupRate << " pages/s\n";
+    } else {
+      table->pager->backupRate = std::atoi(value.c_str());
+    }
+    return META_COMMAND_SUCCESS;
+  }
+  if (name == "compression") {
+    Pager *pager = table->pager;
+    if (pager == nullptr || !pager->compressed) {
+      std::cout << "off\n";
+      return META_COMMAND_SUCCESS;
+    }
+    uint64_t storedBytes = 0;
+    for (uint32_t i = 0; i < pager->numPages; ++i) {
+      storedBytes += pager->pageMap[i].length;
+    }
+    std::cout << "on (" << pager->numPages << " pages, " << storedBytes
+              << " bytes as of last flush)\n";
+    return META_COMMAND_SUCCESS;
+  }
+  if (name == "insert_buffer" && table->pager != nullptr) {
+    if (value.empty()) {
+      std::cout << (table->internalFormat == NODE_INTERNAL_BUFFERED ? "on"
+                                                                     : "off")
+                << "\n";
+    } else if (value == "on" || value == "off") {
+      pagerBeginStatement(table->pager);
+      pagerBeginWrite(table->pager);
+      setInsertBuffering(table, value == "on");
+      pagerCommit(table->pager);
+      pagerEndStatement(table->pager);
+    } else {
+      std::cout << "Unknown insert_buffer '" << value << "'\n";
+    }
+    return META_COMMAND_SUCCESS;
+  }
+  if (name == "leaf_format") {
+    if (value.empty()) {
+      std::cout << (table->leafFormat == NODE_LEAF_PACKED ? "packed"
+                    : table->leafFormat == NODE_LEAF_PAX  ? "pax"
+                                                          : "plain")
+                << "\n";
+    } else if (value == "plain") {
+      table->leafFormat = NODE_LEAF;
+    } else if (value == "packed") {
+      table->leafFormat = NODE_LEAF_PACKED; // Leaves convert when rewritten
+    } else if (value == "pax") {
+      table->leafFormat = NODE_LEAF_PAX;
+    } else {
+      std::cout << "Unknown leaf_format '" << value << "'\n";
+    }
+    return META_COMMAND_SUCCESS;
+  }
+  return META_UNRECOGNIZED_COMMAND;
+}
+
+/**
+ * @brief Handles `.drop_partition <k>` : the partition leaves the manifest,
+ *        then its files are removed, whatever the number of rows it held.
+ */
+META_COMMAND_RESULT dropPartition(const std::string &inputLine, Table *table) {
+  std::istringstream dropStream(inputLine);
+  std::string command, number;
+  dropStream >> command >> number;
+  PartitionMap *map = table->partitionMap;
+  if (map == nullptr) {
+    std::cout << "Not a partitioned table.\n";
+    return META_COMMAND_SUCCESS;
+  }
+  uint64_t k;
+  if (!parseUnsigned(number, UINT64_MAX, k)) {
+    std::cout << "Usage : .drop_partition <partition>\n";
+    return META_COMMAND_SUCCESS;
+  }
+  auto partition = map->partitions.find(k);
+  if (partition == map->partitions.end()) {
+    std::cout << "No partition " << k << ".\n";
+    return META_COMMAND_SUCCESS;
+  }
+  Table *partitionRows = partition->second;
+  map->partitions.erase(partition);
+  if (partitionRows != nullptr) {
+    map->openOrder.erase(
+        std::find(map->openOrder.begin(), map->openOrder.end(), k));
+    map->pins.erase(k);
+  }
+  map->backupStatuses.erase(k);
+  partitionSaveManifest(map, map->fd);
+  if (partitionRows != nullptr) {
+    dbClose(partitionRows, true);
+  }
+  removeDbFiles(partitionFileName(map->path, k));
+  return META_COMMAND_SUCCESS;
+}
+
+/**
+ * @brief Handles `.backup <file> [incremental]` : the backup runs in the
+ *        background, `.pragma backup` tells how it went.
+ */
+META_COMMAND_RESULT startBackup(const std::string &inputLine, Table *table) {
+  std::istringstream backupStream(inputLine);
+  std::string command, path, mode;
+  backupStream >> command >> path >> mode;
+  if (path.empty() || (!mode.empty() && mode != "incremental")) {
+    std::cout << "Usage : .backup <file> [incremental]\n";
+    return META_COMMAND_SUCCESS;
+  }
+  Pager *pager = table->pager;
+  if (pager == nullptr) {
+    std::cout << "Backups need a B-tree DB, not an LSM one.\n";
+    return META_COMMAND_SUCCESS;
+  }
+  if (pager->backupRunning) {
+    std::cout << "A backup is already running.\n";
+    return META_COMMAND_SUCCESS;
+  }
+  if (pager->backupThread.joinable()) {
+    pager->backupThread.join();
+  }
+  pager->backupRunning = true;
+  pager->backupThread = std::thread([table, path, mode] {
+    dbBackup(table, path, mode == "incremental");
+    table->pager->backupRunning = false;
+  });
+  return META_COMMAND_SUCCESS;
+}
+
+/**
+ * @brief Handles `.attach <file> <name> [options]` : opens another database
+ *        (created with the command line options given if new) under a name
+ *        SELECT can use in FROM and JOIN.
+ */
+META_COMMAND_RESULT attachTable(const std::string &inputLine, Table *table) {
+  std::istringstream attachStream(inputLine);
+  std::string command, path, name, option;
+  attachStream >> command >> path >> name;
+  if (name.empty() || name == "main" ||
+      name.find_first_of(".<>=") != std::string::npos) {
+    std::cout << "Usage : .attach <file> <name> [options]\n";
+    return META_COMMAND_SUCCESS;
+  }
+  Catalog *catalog = tableCatalog(table);
+  if (catalog->attached.count(name) != 0) {
+    std::cout << "Table " << name << " is already attached.\n";
+    return META_COMMAND_SUCCESS;
+  }
+  OpenOptions options;
+  while (attachStream >> option) {
+    if (!parseOpenOption(option, options)) {
+      std::cout << "Unknown or invalid option " << option << "\n";
+      return META_COMMAND_SUCCESS;
+    }
+  }
+  std::string error;
+  Table *attached = dbOpen(path, options, &error);
+  if (attached == nullptr) {
+    std::cout << error << "\n";
+    return META_COMMAND_SUCCESS;
+  }
+  catalog->attached[name] = attached;
+  return META_COMMAND_SUCCESS;
+}
+
+/* Handles `.detach <name>`, closing a table `.attach` opened */
+META_COMMAND_RESULT detachTable(const std::string &inputLine, Table *table) {
+  std::istringstream detachStream(inputLine);
+  std::string command, name;
+  detachStream >> command >> name;
+  auto attached = tableCatalog(table)->attached.find(name);
+  if (attached == table->catalog->attached.end()) {
+    std::cout << "No table " << name << " attached.\n";
+    return META_COMMAND_SUCCESS;
+  }
+  dbClose(attached->second);
+  table->catalog->stats.erase(attached->second);
+  table->catalog->attached.erase(attached);
+  return META_COMMAND_SUCCESS;
+}
+
+/* Whether a pragma is about the session rather than one of its files */
+bool sessionPragma(const std::string &inputLine) {
+  std::istringstream pragmaStream(inputLine);
+  std::string pragma, name;
+  pragmaStream >> pragma >> name;
+  return name == "shards" || name == "partitions" || name == "join" ||
+         name == "join_memory";
+}
+
+META_COMMAND_RESULT selectAndDoMetaCommand(const std::string &inputLine,
+                                           Table *table) {
+  if (inputLine == ".exit") {
+    dbClose(table);
+    closeInput();
+    exit(EXIT_SUCCESS);
+  } else if ((table->numShards != 0 || table->partitionMap != nullptr) &&
+             (inputLine == ".btree" || inputLine.rfind(".backup ", 0) == 0 ||
+              (inputLine.rfind(".pragma ", 0) == 0 &&
+               !sessionPragma(inputLine)))) {
+    // Every shard or partition answers for itself, backed up to a file of
+    // its own
+    std::istringstream lineStream(inputLine);
+    std::string command, path, mode;
+    lineStream >> command >> path >> mode;
+    bool backup = command == ".backup" && !path.empty();
+    // Name, shard or partition : the partitions are opened one at a time
+    std::vector<std::pair<std::string, uint64_t>> parts;
+    std::vector<std::string> backupPaths;
+    for (uint32_t i = 0; i < table->numShards; ++i) {
+      parts.push_back({"Shard " + std::to_string(i), i});
+      backupPaths.push_back(shardFileName(path, i));
+    }
+    PartitionMap *map = table->partitionMap;
+    if (map != nullptr) {
+      for (const std::pair<const uint64_t, Table *> &partition :
+           map->partitions) {
+        parts.push_back({"Partition " + std::to_string(partition.first),
+                         partition.first});
+        backupPaths.push_back(partitionFileName(path, partition.first));
+      }
+      int fd = backup ? open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                             S_IWUSR | S_IRUSR)
+                      : -1;
+      if (fd != -1) {
+        partitionSaveManifest(map, fd);
+        close(fd);
+      }
+    }
+    for (size_t i = 0; i < parts.size(); ++i) {
+      std::string partLine = inputLine;
+      if (backup) {
+        partLine = ".backup " + backupPaths[i] + " " + mode;
+      }
+      std::cout << parts[i].first << " :\n";
+      uint64_t part = parts[i].second;
+      Table *partRows = map != nullptr ? partitionTable(map, part, false)
+                                       : table->shards[part];
+      META_COMMAND_RESULT result = selectAndDoMetaCommand(partLine, partRows);
+      if (map != nullptr) {
+        partitionRelease(map, part);
+      }
+      if (result == META_UNRECOGNIZED_COMMAND) {
+        return META_UNRECOGNIZED_COMMAND;
+      }
+    }
+    return META_COMMAND_SUCCESS;
+  } else if (inputLine.rfind(".drop_partition ", 0) == 0) {
+    return dropPartition(inputLine, table);
+  } else if (inputLine.rfind(".attach ", 0) == 0) {
+    return attachTable(inputLine, table);
+  } else if (inputLine.rfind(".detach ", 0) == 0) {
+    return detachTable(inputLine, table);
+  } else if (inputLine == ".tables") {
+    std::cout << "main\n";
+    if (table->catalog != nullptr) {
+      for (const std::pair<const std::string, Table *> &attached :
+           table->catalog->attached) {
+        std::cout << attached.first << "\n";
+      }
+    }
+    return META_COMMAND_SUCCESS;
+  } else if (inputLine == ".btree") {
+    std::cout << "Tree :\n";
+    if (table->lsm != nullptr) {
+      printLsmTree(table->lsm);
+      return META_COMMAND_SUCCESS;
+    }
+    std::lock_guard<std::mutex> guard(table->pager->lock);
+    pagerBeginStatement(table->pager);
+    table->pager->useOnce = true;
+    printTree(table->pager, table->rootPageNum, 0);
+    table->pager->useOnce = false;
+    pagerEndStatement(table->pager);
+    return META_COMMAND_SUCCESS;
+  } else if (inputLine == ".constants") {
+    std::cout << "Constants :\n";
+    printConstants();
+    return META_COMMAND_SUCCESS;
+  } else if (inputLine.rfind(".pragma ", 0) == 0) {
+    return doPragma(inputLine, table);
+  } else if (inputLine.rfind(".backup ", 0) == 0) {
+    return startBackup(inputLine, table);
+  } else {
+    return META_UNRECOGNIZED_COMMAND;
+  }
+}
+
+/* Splits a condition into words, operators being words of their own :
+   `id>=5` is `id >= 5` */
+std::vector<std::string> splitConditionTokens(const std::string &clause) {
+  std::vector<std::string> tokens;
+  for (size_t i = 0; i < clause.size();) {
+    size_t start = i;
+    if (isspace(clause[i])) {
+      ++i;
+      continue;
+    } else if (strchr("<>=", clause[i]) != nullptr) {
+      i += (i + 1 < clause.size() && clause[i + 1] == '=') ? 2 : 1;
+    } else {
+      while (i < clause.size() && !isspace(clause[i]) &&
+             strchr("<>=", clause[i]) == nullptr) {
+        ++i;
+      }
+    }
+    tokens.push_back(clause.substr(start, i - start));
+  }
+  return tokens;
+}
+
+/* COLUMN_MASK bit of a column name, 0 if there is no such column */
+uint32_t columnNamed(const std::string &name) {
+  if (name == "id") {
+    return COLUMN_ID;
+  } else if (name == "username") {
+    return COLUMN_USERNAME;
+  } else if (name == "email") {
+    return COLUMN_EMAIL;
+  }
+  return 0;
+}
+
+/**
+ * @brief Parses the `ON` of a JOIN : `a.col = b.col`, one column of each
+ *        table, either way round. The id only joins with an id, a text
+ *        column with either text column.
+ */
+PREPARE_RESULT parseJoinCondition(const std::string &condition,
+                                  Command &command) {
+  std::vector<std::string> tokens = splitConditionTokens(condition);
+  if (tokens.size() != 3 || tokens[1] != "=") {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  std::string tables[2];
+  uint32_t columns[2];
+  for (uint32_t side = 0; side < 2; ++side) {
+    const std::string &name = tokens[side * 2];
+    size_t dot = name.find('.');
+    if (dot == std::string::npos) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    tables[side] = name.substr(0, dot);
+    columns[side] = columnNamed(name.substr(dot + 1));
+    if (columns[side] == 0) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+  }
+  if (tables[0] == command.joinTable && tables[1] == command.fromTable &&
+      command.fromTable != command.joinTable) {
+    std::swap(tables[0], tables[1]);
+    std::swap(columns[0], columns[1]);
+  }
+  if (tables[0] != command.fromTable || tables[1] != command.joinTable ||
+      (columns[0] == COLUMN_ID) != (columns[1] == COLUMN_ID)) {
+    return PREPARE_SYNTAX_ERROR;
+  }
+  command.fromColumn = columns[0];
+  command.joinColumn = columns[1];
+  return PREPARE_SUCCESS;
+}
+
+/**
+ * @brief Parses the optional `WHERE` of SELECT : conditions on the id
+ *        joined by AND, such as `id = 5`, `id >= 10 AND id < 20` or
+ *        `id BETWEEN 10 AND 19`. Narrows [minId, maxId] to the ids they
+ *        allow.
+ */
+PREPARE_RESULT parseWhereClause(const std::string &clause, uint64_t &minId,
+                                uint64_t &maxId) {
+  std::vector<std::string> tokens = splitConditionTokens(clause);
+  auto number = [&](size_t i, uint64_t &value) {
+    return i < tokens.size() && parseUnsigned(tokens[i], UINT64_MAX, value);
+  };
+
+  size_t i = 0;
+  do {
+    uint64_t value, upper;
+    if (tokens.size() < i + 3 || tokens[i] != "id") {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    const std::string &op = tokens[i + 1];
+    if (op == "BETWEEN") {
+      if (!number(i + 2, value) || tokens.size() < i + 5 ||
+          tokens[i + 3] != "AND" || !number(i + 4, upper)) {
+        return PREPARE_SYNTAX_ERROR;
+      }
+      minId = std::max(minId, value);
+      maxId = std::min(maxId, upper);
+      i += 5;
+    } else if (number(i + 2, value)) {
+      if (op == "=" || op == ">=") {
+        minId = std::max(minId, value);
+      }
+      if (op == "=" || op == "<=") {
+        maxId = std::min(maxId, value);
+      }
+      if ((op == ">" && value == UINT64_MAX) || (op == "<" && value == 0)) {
+        minId = 1; // No id at all
+        maxId = 0;
+      } else if (op == ">") {
+        minId = std::max(minId, value + 1);
+      } else if (op == "<") {
+        maxId = std::min(maxId, value - 1);
+      } else if (op != "=" && op != ">=" && op != "<=") {
+        return PREPARE_SYNTAX_ERROR;
+      }
+      i += 3;
+    } else {
+      return PREPARE_SYNTAX_ERROR;
+    }
+  } while (i < tokens.size() && tokens[i++] == "AND");
+  return i == tokens.size() ? PREPARE_SUCCESS : PREPARE_SYNTAX_ERROR;
+}
+
+/**
+ * @brief Parses the optional projection of SELECT : nothing or `*` for
+ *        every column, `COUNT(*)` for the number of rows, else a comma
+ *        separated list such as `id, email`.
+ */
+PREPARE_RESULT parseColumnList(std::istringstream &inputArgStream,
+                               uint32_t &columns, bool &countRows) {
+  std::string list, word;
+  while (inputArgStream >> word) {
+    list += word;
+  }
+  countRows = list == "COUNT(*)";
+  if (countRows) {
+    columns = 0;
+    return PREPARE_SUCCESS;
+  }
+  if (list.empty() || list == "*") {
+    columns = ALL_COLUMNS;
+    return PREPARE_SUCCESS;
+  }
+
+  columns = 0;
+  std::istringstream listStream(list);
+  std::string column;
+  while (std::getline(listStream, column, ',')) {
+    if (columnNamed(column) == 0) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    columns |= columnNamed(column);
+  }
+  return columns != 0 ? PREPARE_SUCCESS : PREPARE_SYNTAX_ERROR;
+}
+
+/* Matches the command with their type */
+PREPARE_RESULT prepareCommand(const std::string &inputLine, Command &command) {
+  std::istringstream inputArgStream(inputLine);
+  std::string whichCommand;
+  inputArgStream >> whichCommand;
+  command.explain = false;
+
+  if (whichCommand == "EXPLAIN") {
+    std::string statement;
+    std::getline(inputArgStream, statement);
+    PREPARE_RESULT result = prepareCommand(statement, command);
+    if (result == PREPARE_SUCCESS && command.type != COMMAND_SELECT) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    command.explain = true;
+    return result;
+  } else if (whichCommand == "ANALYZE") {
+    command.type = COMMAND_ANALYZE;
+    command.fromTable.clear();
+    inputArgStream >> command.fromTable;
+    std::string extra;
+    return inputArgStream >> extra ? PREPARE_SYNTAX_ERROR : PREPARE_SUCCESS;
+  } else if (whichCommand == "SELECT") {
+    command.type = COMMAND_SELECT;
+    command.minId = 0;
+    command.maxId = UINT64_MAX;
+    command.fromTable = "main";
+    command.joinTable.clear();
+    // SELECT <columns> [FROM a [JOIN b ON <condition>]] [WHERE <clause>]
+    std::vector<std::string> words;
+    std::string word;
+    while (inputArgStream >> word) {
+      words.push_back(word);
+    }
+    size_t i = 0;
+    auto wordsUntil = [&](const char *keyword1, const char *keyword2) {
+      std::string text;
+      for (; i < words.size() && words[i] != keyword1 && words[i] != keyword2;
+           ++i) {
+        text += words[i] + " ";
+      }
+      return text;
+    };
+    std::istringstream projectionStream(wordsUntil("FROM", "WHERE"));
+    PREPARE_RESULT result = parseColumnList(projectionStream, command.columns,
+                                            command.countRows);
+    if (result != PREPARE_SUCCESS) {
+      return result;
+    }
+    if (i < words.size() && words[i] == "FROM") {
+      if (i + 1 >= words.size()) {
+        return PREPARE_SYNTAX_ERROR;
+      }
+      command.fromTable = words[i + 1];
+      i += 2;
+      if (i < words.size() && words[i] == "JOIN") {
+        if (i + 2 >= words.size() || words[i + 2] != "ON") {
+          return PREPARE_SYNTAX_ERROR;
+        }
+        command.joinTable = words[i + 1];
+        i += 3;
+        result = parseJoinCondition(wordsUntil("WHERE", "WHERE"), command);
+        if (result != PREPARE_SUCCESS) {
+          return result;
+        }
+      }
+    }
+    if (i == words.size()) {
+      return PREPARE_SUCCESS;
+    }
+    if (words[i] != "WHERE") {
+      return PREPARE_SYNTAX_ERROR;
+    }
+    i += 1;
+    return parseWhereClause(wordsUntil("", ""), command.minId, command.maxId);
+  } else if (whichCommand == "INSERT") {
+    command.type = COMMAND_INSERT;
+    std::string idText, usrName, email;
+    uint64_t id;
+
+    if (!(inputArgStream >> idText >> usrName >> email)) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+
+    if (idText[0] == '-' && parseUnsigned(idText.substr(1), UINT64_MAX, id)) {
+      return PREPARE_NEGATIVE_ID;
+    }
+    if (!parseUnsigned(idText, UINT64_MAX, id)) {
+      return PREPARE_SYNTAX_ERROR;
+    }
+
+    if (usrName.size() > COLUMN_USERNAME_SIZE ||
+        email.size() > COLUMN_EMAIL_SIZE) {
+      return PREPARE_STRING_TOO_LONG;
+    }
+
+    command.toBeInserted.id = id;
+    strncpy(command.toBeInserted.username, usrName.c_str(),
+            COLUMN_USERNAME_SIZE);
+    command.toBeInserted.username[COLUMN_USERNAME_SIZE] = '\0';
+
+    strncpy(command.toBeInserted.email, email.c_str(), COLUMN_EMAIL_SIZE);
+    command.toBeInserted.email[COLUMN_EMAIL_SIZE] = '\0';
+
+    return PREPARE_SUCCESS;
+  }
+  return PREPARE_UNRECOGNIZED_STATE;
+}
+
+/* Executing the INSERT command */
+EXECUTE_RESULT executeInsertCommand(Command &command, Table &table) {
+  if (table.pager != nullptr && table.pager->replica) {
+    return EXECUTE_READ_ONLY;
+  }
+  if (table.lsm != nullptr) {
+    uint8_t key[KEY_SIZE], value[ROW_SIZE];
+    encodeRowKey(&command.toBeInserted, key);
+    if (lsmGet(table.lsm, key, nullptr)) {
+      return EXECUTE_DUPLICATE_KEY;
+    }
+    structureRow(&command.toBeInserted, value);
+    lsmPut(table.lsm, key, value);
+    return EXECUTE_SUCCESS;
+  }
+
+  // A split may cascade up to the root and add one page per level plus one.
+  // A buffer flush does that once per message of the batch, plus new buffers.
+  uint32_t pagesNeeded = treeHeight(&table) + 1;
+  if (table.internalFormat == NODE_INTERNAL_BUFFERED) {
+    pagesNeeded *= MESSAGE_BUFFER_MAX_MESSAGES + 1;
+  }
+  if (table.pager->numPages + pagesNeeded > TABLE_MAX_PAGES) {
+    return EXECUTE_TABLE_FULL;
+  }
+  Row *rowToinsert = &(command.toBeInserted);
+  uint8_t keyToBeInserted[KEY_SIZE];
+  encodeRowKey(rowToinsert, keyToBeInserted);
+  if (messageBuffersContain(&table, keyToBeInserted)) {
+    return EXECUTE_DUPLICATE_KEY;
+  }
+  Cursor *cursor = tableFind(&table, keyToBeInserted);
+
+  void *node = getPage(table.pager, cursor->pageNum);
   uint32_t numCells = *leafNodeNumCells(node);
+  if (cursor->cellNum < numCells) {
+    uint8_t keyAtIndex[KEY_SIZE];
+    leafNodeGetKey(node, cursor->cellNum, keyAtIndex);
+    if (compareKeys(keyAtIndex, keyToBeInserted) == 0) {
+      free(cursor);
+      return EXECUTE_DUPLICATE_KEY;
+    }
+  }
+  if (table.internalFormat == NODE_INTERNAL_BUFFERED) {
+    free(cursor);
+    uint8_t serialised[ROW_SIZE];
+    structureRow(rowToinsert, serialised);
+    bufferedInsert(&table, keyToBeInserted, serialised, 0);
+    return EXECUTE_SUCCESS;
+  }
+  leafNodeInsert(cursor, keyToBeInserted, rowToinsert);
+  free(cursor);
+
+  return EXECUTE_SUCCESS;
+}
+
+/* Prints row \p i of \p batch, restricted to \p columns, then \p end */
+void printBatchRow(const ColumnBatch *batch, uint32_t i, uint32_t columns,
+                   const char *end = "\n") {
+  const char *separator = "";
+  if (columns & COLUMN_ID) {
+    std::cout << "ID: " << batch->ids[i];
+    separator = ", ";
+  }
+  if (columns & COLUMN_USERNAME) {
+    std::cout << separator << "Username: " << batch->usernames[i];
+    separator = ", ";
+  }
+  if (columns & COLUMN_EMAIL) {
+    std::cout << separator << "Email: " << batch->emails[i];
+  }
+  std::cout << end;
+}
+
+/* Appends row \p i of \p src to \p dst, which must have room for it */
+void batchAppendRow(ColumnBatch *dst, const ColumnBatch *src, uint32_t i,
+                    uint32_t columns) {
+  uint32_t j = dst->numRows++;
+  dst->ids[j] = src->ids[i];
+  if (columns & COLUMN_USERNAME) {
+    memcpy(dst->usernames[j], src->usernames[i], USERNAME_SIZE);
+  }
+  if (columns & COLUMN_EMAIL) {
+    memcpy(dst->emails[j], src->emails[i], EMAIL_SIZE);
+  }
+}
+
+/**
+ * @brief Keeps the rows of \p batch whose id is in [minId, maxId], in
+ *        order. The ids must have been read.
+ */
+void batchKeepRange(ColumnBatch *batch, uint32_t columns, uint64_t minId,
+                    uint64_t maxId) {
+  uint32_t kept = 0;
+  for (uint32_t i = 0; i < batch->numRows; ++i) {
+    if (batch->ids[i] < minId || batch->ids[i] > maxId) {
+      continue;
+    }
+    if (kept != i) {
+      batch->ids[kept] = batch->ids[i];
+      if (columns & COLUMN_USERNAME) {
+        memcpy(batch->usernames[kept], batch->usernames[i], USERNAME_SIZE);
+      }
+      if (columns & COLUMN_EMAIL) {
+        memcpy(batch->emails[kept], batch->emails[i], EMAIL_SIZE);
+      }
+    }
+    kept += 1;
+  }
+  batch->numRows = kept;
+}
+
+/**
+ * @brief SELECT on an LSM table : the merged entries, batched like leaves.
+ * @note Runs are not indexed by range, a WHERE only filters the entries.
+ */
+EXECUTE_RESULT executeLsmSelect(Command &command, Table &table,
+                                const BatchSink &sink) {
+  ColumnBatch *batch = (ColumnBatch *)malloc(sizeof(ColumnBatch));
+  batch->numRows = 0;
+  auto printBatch = [&]() {
+    sink(batch);
+    batch->numRows = 0;
+  };
+
+  lsmScan(table.lsm, [&](const uint8_t *key, const uint8_t *value) {
+    uint64_t id = decodeKeyColumn(key);
+    if (id < command.minId || id > command.maxId) {
+      return;
+    }
+    uint32_t i = batch->numRows++;
+    batch->ids[i] = id;
+    memcpy(batch->usernames[i], value + USERNAME_OFFSET, USERNAME_SIZE);
+    memcpy(batch->emails[i], value + EMAIL_OFFSET, EMAIL_SIZE);
+    if (batch->numRows == LEAF_MAX_CELLS_ANY_FORMAT) {
+      printBatch();
+    }
+  });
+  printBatch();
+
+  free(batch);
+  return EXECUTE_SUCCESS;
+}
+
+/* Executing the SELECT command, one leaf at a time */
+EXECUTE_RESULT executeSelectCommand(Command &command, Table &table,
+                                    const BatchSink &sink) {
+  if (table.lsm != nullptr) {
+    return executeLsmSelect(command, table, sink);
+  }
+  flushAllMessageBuffers(&table);
+
+  // A WHERE starts at the leaf of its smallest id, stops past its largest
+  bool ranged = command.minId != 0 || command.maxId != UINT64_MAX;
+  uint32_t columns = command.columns | (ranged ? COLUMN_ID : 0);
+  Cursor *cursor = tableSeek(&table, command.minId);
+  ColumnBatch *batch = (ColumnBatch *)malloc(sizeof(ColumnBatch));
+
+  table.pager->useOnce = true; // Leaves must not push hot pages out
+  while (!(cursor->endOfTable)) {
+    pagerBeginOperation(table.pager); // Only the current leaf is in use
+    void *node = getPage(table.pager, cursor->pageNum);
+    leafNodeReadColumns(node, columns, batch);
+    cursor->pageNum = *leafNodeNextLeaf(node);
+    cursor->endOfTable = (cursor->pageNum == 0);
+    if (ranged) {
+      cursor->endOfTable |= batch->numRows == 0 ||
+                            batch->ids[batch->numRows - 1] >= command.maxId;
+      batchKeepRange(batch, columns, command.minId, command.maxId);
+    }
+    sink(batch);
+  }
+  table.pager->useOnce = false;
+
+  free(batch);
+  free(cursor);
+
+  return EXECUTE_SUCCESS;
+}
+
+/* Prints the rows of a SELECT, or only counts them for COUNT(*) */
+BatchSink printingSink(const Command &command, uint64_t &rowCount) {
+  return [&command, &rowCount](const ColumnBatch *batch) {
+    rowCount += batch->numRows;
+    for (uint32_t i = 0; i < batch->numRows && !command.countRows; ++i) {
+      printBatchRow(batch, i, command.columns);
+    }
+  };
+}
+
+/**
+ * @brief Execute the logic behind the command
+ * @param sink Gets the rows of a SELECT instead of them being printed
+ */
+EXECUTE_RESULT executeCommand(Command &command, Table &table,
+                              const BatchSink &sink = nullptr) {
+  EXECUTE_RESULT result = EXECUTE_TABLE_FULL;
+  uint64_t rowCount = 0;
+  std::unique_lock<std::mutex> guard;
+  if (table.pager != nullptr) {
+    guard = std::unique_lock<std::mutex>(table.pager->lock);
+  }
+  pagerBeginStatement(table.pager);
+  if (table.pager != nullptr && table.pager->shm != nullptr) {
+    // Another process may have switched buffering, and a SELECT flushes
+    // the buffers : both are writes
+    NodeType rootType = getNodeType(getPage(table.pager, table.rootPageNum));
+    if (command.type == COMMAND_INSERT ||
+        rootType == NODE_INTERNAL_BUFFERED) {
+      pagerBeginWrite(table.pager);
+      rootType = getNodeType(getPage(table.pager, table.rootPageNum));
+    }
+    if (rootType == NODE_INTERNAL || rootType == NODE_INTERNAL_BUFFERED) {
+      table.internalFormat = rootType;
+    }
+  }
+  pagerBeginOperation(table.pager);
+  switch (command.type) {
+  case COMMAND_INSERT:
+    result = executeInsertCommand(command, table);
+    break;
+  case COMMAND_SELECT:
+    result = executeSelectCommand(command, table,
+                                  sink != nullptr
+                                      ? sink
+                                      : printingSink(command, rowCount));
+    break;
+  case COMMAND_ANALYZE:
+    break; // Runs SELECTs, see executeStatement()
+  }
+
+  // Shadow paged and WAL mode files commit every statement
+  if (table.pager != nullptr) {
+    Pager *pager = table.pager;
+    pagerCommit(pager);
+    pagerEndStatement(pager);
+    if (pager->wal && pager->synchronous == SYNCHRONOUS_FULL) {
+      uint64_t salt = pager->walSalt, end = pager->walEnd;
+      guard.unlock();
+      walSyncTo(pager, salt, end);
+    }
+  }
+  if (command.type == COMMAND_SELECT && command.countRows &&
+      sink == nullptr) {
+    std::cout << "Count: " << rowCount << "\n";
+  }
+  return result;
+}
+
+const uint32_t BATCH_QUEUE_BATCHES = 4; // Scanned ahead of the consumer
+
+/**
+ * @brief Batches a scan on another thread hands over to the one consuming
+ *        them, holding at most BATCH_QUEUE_BATCHES : the scan waits for
+ *        the consumer instead of buffering its whole result.
+ */
+struct BatchQueue {
+  std::mutex lock;
+  std::condition_variable changed;
+  std::deque<ColumnBatch *> batches;
+  bool done = false;     // The scan is over
+  bool stopping = false; // No more batches wanted
+};
+
+/* Queues a copy of \p batch once there is room, unless stopped */
+void batchQueuePush(BatchQueue *queue, const ColumnBatch *batch) {
+  std::unique_lock<std::mutex> guard(queue->lock);
+  queue->changed.wait(guard, [queue] {
+    return queue->stopping || queue->batches.size() < BATCH_QUEUE_BATCHES;
+  });
+  if (queue->stopping || batch->numRows == 0) {
+    return;
+  }
+  ColumnBatch *copy = (ColumnBatch *)malloc(sizeof(ColumnBatch));
+  memcpy(copy, batch, sizeof(ColumnBatch));
+  queue->batches.push_back(copy);
+  queue->changed.notify_all();
+}
+
+/* Tells the consumer the scan is over */
+void batchQueueFinish(BatchQueue *queue) {
+  std::lock_guard<std::mutex> guard(queue->lock);
+  queue->done = true;
+  queue->changed.notify_all();
+}
+
+/* Next batch, freed by the caller, nullptr once the scan is over */
+ColumnBatch *batchQueuePop(BatchQueue *queue) {
+  std::unique_lock<std::mutex> guard(queue->lock);
+  queue->changed.wait(
+      guard, [queue] { return queue->done || !queue->batches.empty(); });
+  if (queue->batches.empty()) {
+    return nullptr;
+  }
+  ColumnBatch *batch = queue->batches.front();
+  queue->batches.pop_front();
+  queue->changed.notify_all();
+  return batch;
+}
+
+/* Drops what is queued and whatever the scan still hands over */
+void batchQueueStop(BatchQueue *queue) {
+  std::lock_guard<std::mutex> guard(queue->lock);
+  queue->stopping = true;
+  for (ColumnBatch *batch : queue->batches) {
+    free(batch);
+  }
+  queue->batches.clear();
+  queue->changed.notify_all();
+}
+
+/**
+ * @brief Runs a statement on a sharded table : an INSERT or a SELECT of a
+ *        single id on the shard it hashes to, a COUNT(*) on every shard at
+ *        once (see ShardPool). Other SELECTs scan every shard on a thread of
+ *        its own, into a BatchQueue, and their rows are merged back into id
+ *        order as they come.
+ */
+EXECUTE_RESULT executeShardedCommand(Command &command, Table &table,
+                                     const BatchSink &sink = nullptr) {
+  if (command.type == COMMAND_INSERT) {
+    Table *shard = table.shards[shardOf(&table, &command.toBeInserted)];
+    return executeCommand(command, *shard);
+  }
+  if (command.minId == command.maxId) { // WHERE id = ...
+    Row row;
+    row.id = command.minId;
+    return executeCommand(command, *table.shards[shardOf(&table, &row)],
+                          sink);
+  }
 
-  Cursor *cursor = (Cursor *)malloc(sizeof(Cursor));
-  cursor->table = table;
-  cursor->pageNum = pageNum;
+  if (command.countRows && sink == nullptr) {
+    std::vector<uint64_t> rowCounts(table.numShards, 0);
+    std::vector<EXECUTE_RESULT> results(table.numShards, EXECUTE_SUCCESS);
+    shardPoolRun(table.shardPool, table.numShards, [&](uint32_t shard) {
+      results[shard] = executeCommand(
+          command, *table.shards[shard], [&](const ColumnBatch *batch) {
+            rowCounts[shard] += batch->numRows;
+          });
+    });
+    uint64_t rowCount = 0;
+    for (uint32_t shard = 0; shard < table.numShards; ++shard) {
+      if (results[shard] != EXECUTE_SUCCESS) {
+        return results[shard];
+      }
+      rowCount += rowCounts[shard];
+    }
+    std::cout << "Count: " << rowCount << "\n";
+    return EXECUTE_SUCCESS;
+  }
 
-  // Binary Search
-  uint32_t minInd = 0;
-  uint32_t oneBeforeMaxInd = numCells;
-  while (oneBeforeMaxInd != minInd) {
-    uint32_t ind = (minInd + oneBeforeMaxInd) / 2;
-    uint32_t keyAtInd = *leafNodeKey(node, ind);
-    if (key == keyAtInd) {
-      cursor->cellNum = ind;
-      return cursor;
+  Command shardCommand = command;
+  shardCommand.columns |= COLUMN_ID; // To merge on
+  std::vector<BatchQueue> queues(table.numShards);
+  std::vector<EXECUTE_RESULT> results(table.numShards, EXECUTE_SUCCESS);
+  std::vector<std::thread> scanners;
+  for (uint32_t shard = 0; shard < table.numShards; ++shard) {
+    scanners.emplace_back([&, shard] {
+      results[shard] =
+          executeCommand(shardCommand, *table.shards[shard],
+                         [&](const ColumnBatch *batch) {
+                           batchQueuePush(&queues[shard], batch);
+                         });
+      batchQueueFinish(&queues[shard]);
+    });
+  }
+
+  // Each shard is in id order : merge on the smallest next id
+  ColumnBatch *merged = nullptr; // For the sink
+  if (sink != nullptr) {
+    merged = (ColumnBatch *)malloc(sizeof(ColumnBatch));
+    merged->numRows = 0;
+  }
+  typedef std::pair<uint64_t, uint32_t> NextRow; // id, shard
+  std::priority_queue<NextRow, std::vector<NextRow>, std::greater<NextRow>>
+      nextRows;
+  std::vector<ColumnBatch *> batches(table.numShards); // Being merged
+  std::vector<uint32_t> positions(table.numShards, 0);
+  for (uint32_t shard = 0; shard < table.numShards; ++shard) {
+    batches[shard] = batchQueuePop(&queues[shard]);
+    if (batches[shard] != nullptr) {
+      nextRows.push({batches[shard]->ids[0], shard});
     }
-    if (key < keyAtInd) {
-      oneBeforeMaxInd = ind;
+  }
+  while (!nextRows.empty()) {
+    uint32_t shard = nextRows.top().second;
+    nextRows.pop();
+    ColumnBatch *batch = batches[shard];
+    uint32_t &position = positions[shard];
+    if (merged == nullptr) {
+      printBatchRow(batch, position, command.columns);
     } else {
-      minInd = ind + 1;
+      batchAppendRow(merged, batch, position, shardCommand.columns);
+      if (merged->numRows == LEAF_MAX_CELLS_ANY_FORMAT) {
+        sink(merged);
+        merged->numRows = 0;
+      }
+    }
+    if (++position == batch->numRows) {
+      free(batch);
+      batch = batches[shard] = batchQueuePop(&queues[shard]);
+      position = 0;
+    }
+    if (batch != nullptr) {
+      nextRows.push({batch->ids[position], shard});
     }
   }
+  if (merged != nullptr) {
+    sink(merged);
+    free(merged);
+  }
 
-  cursor->cellNum = minInd;
-  return cursor;
+  for (uint32_t shard = 0; shard < table.numShards; ++shard) {
+    scanners[shard].join();
+  }
+  for (uint32_t shard = 0; shard < table.numShards; ++shard) {
+    if (results[shard] != EXECUTE_SUCCESS) {
+      return results[shard];
+    }
+  }
+  return EXECUTE_SUCCESS;
 }
 
-Cursor *tableFind(Table *table, uint32_t key) {
-  uint32_t rootPageNum = table->rootPageNum;
-  void *rootNode = getPage(table->pager, rootPageNum);
+/**
+ * @brief Runs a statement on a partitioned table : an INSERT in the
+ *        partition of its id, created if need be, a SELECT on the
+ *        partitions its WHERE overlaps only, in order.
+ */
+EXECUTE_RESULT executePartitionedCommand(Command &command, Table &table,
+                                         const BatchSink &sink = nullptr) {
+  PartitionMap *map = table.partitionMap;
+  if (command.type == COMMAND_INSERT) {
+    uint64_t k = command.toBeInserted.id / map->width;
+    EXECUTE_RESULT result =
+        executeCommand(command, *partitionTable(map, k, true));
+    partitionRelease(map, k);
+    return result;
+  }
 
-  if (NODE_LEAF == getNodeType(rootNode)) {
-    return leafNodeFind(table, rootPageNum, key);
-  } else {
-    std::cerr << "Need to implement searching an internal node\n";
-    exit(EXIT_FAILURE);
+  EXECUTE_RESULT result = EXECUTE_SUCCESS;
+  uint64_t rowCount = 0, scanned = 0;
+  BatchSink print =
+      sink != nullptr ? sink : printingSink(command, rowCount);
+  if (command.minId <= command.maxId) {
+    auto last = map->partitions.upper_bound(command.maxId / map->width);
+    for (auto partition =
+             map->partitions.lower_bound(command.minId / map->width);
+         partition != last && result == EXECUTE_SUCCESS; ++partition) {
+      Table *partitionRows = partitionTable(map, partition->first, false);
+      result = executeCommand(command, *partitionRows, print);
+      partitionRelease(map, partition->first);
+      scanned += 1;
+    }
   }
+  std::lock_guard<std::mutex> guard(map->lock);
+  map->scans += map->partitions.size();
+  map->pruned += map->partitions.size() - scanned;
+  if (command.countRows && sink == nullptr) {
+    std::cout << "Count: " << rowCount << "\n";
+  }
+  return result;
 }
 
-/* Structure and De-structure Rows */
-void structureRow(Row *src, void *dst) {
-  memcpy((char *)dst + ID_OFFSET, &(src->id), ID_SIZE);
-  memcpy((char *)dst + USERNAME_OFFSET, &(src->username), USERNAME_SIZE);
-  memcpy((char *)dst + EMAIL_OFFSET, &(src->email), EMAIL_SIZE);
+/* Runs a statement on any kind of table, see executeCommand() */
+EXECUTE_RESULT executeOnTable(Command &command, Table &table,
+                              const BatchSink &sink = nullptr) {
+  if (table.numShards != 0) {
+    return executeShardedCommand(command, table, sink);
+  } else if (table.partitionMap != nullptr) {
+    return executePartitionedCommand(command, table, sink);
+  }
+  return executeCommand(command, table, sink);
 }
 
-void destructureRow(void *src, Row *dst) {
-  memcpy(&(dst->id), (char *)src + ID_OFFSET, ID_SIZE);
-  memcpy(&(dst->username), (char *)src + USERNAME_OFFSET, USERNAME_SIZE);
-  memcpy(&(dst->email), (char *)src + EMAIL_OFFSET, EMAIL_SIZE);
-}
+/**
+ * @brief Joins : every row of the FROM table is paired with the rows of
+ *        the JOIN table whose column holds the same value. On the ids both
+ *        tables come in id order and are merged (mergeJoin()), on other
+ *        columns the JOIN table is hashed (hashJoin()).
+ */
 
-/* Page Management */
-void *cursorValue(Cursor *cursor) {
-  uint32_t pageNum = cursor->pageNum;
-  void *page = getPage(cursor->table->pager, pageNum);
-  return leafNodeValue(page, cursor->cellNum);
+/* Gets a pair of rows joined : row i of the left batch, j of the right */
+typedef std::function<void(const ColumnBatch *, uint32_t, const ColumnBatch *,
+                           uint32_t)>
+    JoinSink;
+
+/* The bytes of row \p i a join compares on \p column */
+std::string joinKey(const ColumnBatch *batch, uint32_t i, uint32_t column) {
+  if (column == COLUMN_ID) {
+    return std::string((const char *)&batch->ids[i], sizeof(uint64_t));
+  } else if (column == COLUMN_USERNAME) {
+    return std::string(batch->usernames[i],
+                       strnlen(batch->usernames[i], USERNAME_SIZE));
+  }
+  return std::string(batch->emails[i], strnlen(batch->emails[i], EMAIL_SIZE));
 }
 
-void pagerFlush(Pager *pager, uint32_t pageNum) {
-  if (pager->pages[pageNum] == nullptr) {
-    std::cerr << "Tried to flush unallocated page\n";
-    exit(EXIT_FAILURE);
+/**
+ * @brief Merge join on the ids : the JOIN table is scanned on another
+ *        thread, a few batches ahead of the FROM table, and the two are
+ *        walked side by side. Every row is read once, nothing is held but
+ *        the batches in flight.
+ */
+EXECUTE_RESULT mergeJoin(Command &scan, Table &left, Table &right,
+                         const JoinSink &emit) {
+  if (&left == &right) { // Ids are unique, a row only matches itself
+    return executeOnTable(scan, left, [&](const ColumnBatch *batch) {
+      for (uint32_t i = 0; i < batch->numRows; ++i) {
+        emit(batch, i, batch, i);
+      }
+    });
   }
 
-  off_t offset = lseek(pager->fd, pageNum * PAGE_SIZE, SEEK_SET);
-  if (offset == -1) {
-    std::cerr << "Error seeking to page: " << std::strerror(errno) << '\n';
-    exit(EXIT_FAILURE);
+  BatchQueue queue;
+  EXECUTE_RESULT rightResult = EXECUTE_SUCCESS;
+  std::thread scanner([&] {
+    rightResult = executeOnTable(scan, right, [&](const ColumnBatch *batch) {
+      batchQueuePush(&queue, batch); // Past a stop the rest matches nothing
+    });
+    batchQueueFinish(&queue);
+  });
+
+  ColumnBatch *rightBatch = nullptr;
+  uint32_t j = 0;
+  auto nextRight = [&]() { // False once the JOIN table is over
+    if (rightBatch != nullptr && ++j < rightBatch->numRows) {
+      return true;
+    }
+    free(rightBatch);
+    rightBatch = batchQueuePop(&queue);
+    j = 0;
+    return rightBatch != nullptr;
+  };
+  bool more = nextRight();
+  EXECUTE_RESULT result =
+      executeOnTable(scan, left, [&](const ColumnBatch *batch) {
+        for (uint32_t i = 0; i < batch->numRows && more; ++i) {
+          while (more && rightBatch->ids[j] < batch->ids[i]) {
+            more = nextRight();
+          }
+          if (more && rightBatch->ids[j] == batch->ids[i]) {
+            emit(batch, i, rightBatch, j);
+          }
+        }
+      });
+
+  batchQueueStop(&queue);
+  scanner.join();
+  free(rightBatch);
+  return result != EXECUTE_SUCCESS ? result : rightResult;
+}
+
+const uint32_t JOIN_SPILL_PARTITIONS = 16;
+const uint32_t JOIN_SPILL_BUFFER_SIZE = 64 * 1024; // Per partition
+const uint32_t JOIN_RECORD_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
+
+/* The rows of a hash join held in memory, in full batches */
+typedef struct {
+  std::vector<ColumnBatch *> batches;
+  uint64_t numRows = 0;
+} JoinRows;
+
+void joinRowsAdd(JoinRows &rows, const ColumnBatch *batch, uint32_t i) {
+  if (rows.batches.empty() ||
+      rows.batches.back()->numRows == LEAF_MAX_CELLS_ANY_FORMAT) {
+    rows.batches.push_back((ColumnBatch *)malloc(sizeof(ColumnBatch)));
+    rows.batches.back()->numRows = 0;
   }
-  ssize_t bytes = write(pager->fd, pager->pages[pageNum], PAGE_SIZE);
-  if (bytes < 0) {
-    std::cerr << "Error writing to file: " << std::strerror(errno) << '\n';
-    exit(EXIT_FAILURE);
+  batchAppendRow(rows.batches.back(), batch, i, ALL_COLUMNS);
+  rows.numRows += 1;
+}
+
+void joinRowsClear(JoinRows &rows) {
+  for (ColumnBatch *batch : rows.batches) {
+    free(batch);
   }
+  rows.batches.clear();
+  rows.numRows = 0;
 }
 
-void leafNodeInsert(Cursor *cursor, uint32_t key, Row *value) {
-  void *node = getPage(cursor->table->pager, cursor->pageNum);
-  uint32_t numCells = *leafNodeNumCells(node);
+/* Key → batch and row of JoinRows */
+typedef std::unordered_multimap<std::string, std::pair<uint32_t, uint32_t>>
+    JoinHashTable;
 
-  if (numCells >= LEAF_NODE_MAX_CELLS) { // Node is Full.
-    std::cout << "Need to implement splitting a leaf node.\n";
-    exit(EXIT_FAILURE);
+void joinHashRows(const JoinRows &rows, uint32_t column,
+                  JoinHashTable &hashTable) {
+  hashTable.reserve(rows.numRows);
+  for (uint32_t b = 0; b < rows.batches.size(); ++b) {
+    for (uint32_t i = 0; i < rows.batches[b]->numRows; ++i) {
+      hashTable.emplace(joinKey(rows.batches[b], i, column),
+                        std::make_pair(b, i));
+    }
   }
+}
 
-  if (cursor->cellNum < numCells) { // Make room for new cell.
-    for (uint32_t i = numCells; i > cursor->cellNum; --i) {
-      memcpy(leafNodeCell(node, i), leafNodeCell(node, i - 1),
-             LEAF_NODE_CELL_SIZE);
+/* Pairs each row of \p batch with the rows hashed under the same key */
+void joinProbe(const JoinHashTable &hashTable, const JoinRows &rows,
+               const ColumnBatch *batch, uint32_t column,
+               const JoinSink &emit) {
+  for (uint32_t i = 0; i < batch->numRows; ++i) {
+    auto matches = hashTable.equal_range(joinKey(batch, i, column));
+    for (auto match = matches.first; match != matches.second; ++match) {
+      emit(batch, i, rows.batches[match->second.first], match->second.second);
     }
   }
+}
 
-  *leafNodeNumCells(node) += 1;
-  *leafNodeKey(node, cursor->cellNum) = key;
-  structureRow(value, leafNodeValue(node, cursor->cellNum));
+/**
+ * @brief The rows of one table a hash join has no memory for, split by
+ *        key into temporary files (removed as soon as created), each
+ *        written through a buffer.
+ */
+typedef struct {
+  int fds[JOIN_SPILL_PARTITIONS];
+  uint64_t sizes[JOIN_SPILL_PARTITIONS];
+  std::vector<uint8_t> buffers[JOIN_SPILL_PARTITIONS];
+} JoinSpill;
+
+void joinSpillOpen(JoinSpill &spill) {
+  const char *tmpDir = getenv("TMPDIR");
+  for (uint32_t p = 0; p < JOIN_SPILL_PARTITIONS; ++p) {
+    std::string path = std::string(tmpDir != nullptr ? tmpDir : "/tmp") +
+                       "/sqlcpp-join-XXXXXX";
+    spill.fds[p] = mkstemp(&path[0]);
+    if (spill.fds[p] == -1) {
+      std::cerr << "Unable to create a temporary file for a join: "
+                << std::strerror(errno) << '\n';
+      exit(EXIT_FAILURE);
+    }
+    unlink(path.c_str());
+    spill.sizes[p] = 0;
+  }
+}
+
+/* Partition of a key, unrelated to the buckets of JoinHashTable */
+uint32_t joinPartition(const std::string &key) {
+  uint64_t hash = std::hash<std::string>()(key) * 0x9E3779B97F4A7C15ull;
+  return (hash >> 32) % JOIN_SPILL_PARTITIONS;
+}
+
+void joinSpillFlush(JoinSpill &spill, uint32_t p) {
+  std::vector<uint8_t> &buffer = spill.buffers[p];
+  writeFully(spill.fds[p], buffer.data(), buffer.size(), spill.sizes[p]);
+  spill.sizes[p] += buffer.size();
+  buffer.clear();
+}
+
+void joinSpillWrite(JoinSpill &spill, uint32_t column, const ColumnBatch *batch,
+                    uint32_t i) {
+  uint32_t p = joinPartition(joinKey(batch, i, column));
+  std::vector<uint8_t> &buffer = spill.buffers[p];
+  size_t at = buffer.size();
+  buffer.resize(at + JOIN_RECORD_SIZE);
+  memcpy(&buffer[at], &batch->ids[i], ID_SIZE);
+  memcpy(&buffer[at + ID_SIZE], batch->usernames[i], USERNAME_SIZE);
+  memcpy(&buffer[at + ID_SIZE + USERNAME_SIZE], batch->emails[i], EMAIL_SIZE);
+  if (buffer.size() >= JOIN_SPILL_BUFFER_SIZE) {
+    joinSpillFlush(spill, p);
+  }
+}
+
+/* Reads partition \p p back a batch at a time, then closes its file */
+void joinSpillRead(JoinSpill &spill, uint32_t p, const BatchSink &sink) {
+  joinSpillFlush(spill, p);
+  ColumnBatch *batch = (ColumnBatch *)malloc(sizeof(ColumnBatch));
+  std::vector<uint8_t> records(LEAF_MAX_CELLS_ANY_FORMAT * JOIN_RECORD_SIZE);
+  for (uint64_t offset = 0; offset < spill.sizes[p];) {
+    batch->numRows = std::min<uint64_t>(LEAF_MAX_CELLS_ANY_FORMAT,
+                                        (spill.sizes[p] - offset) /
+                                            JOIN_RECORD_SIZE);
+    readFully(spill.fds[p], records.data(),
+              batch->numRows * JOIN_RECORD_SIZE, offset);
+    offset += batch->numRows * JOIN_RECORD_SIZE;
+    for (uint32_t i = 0; i < batch->numRows; ++i) {
+      const uint8_t *record = &records[i * JOIN_RECORD_SIZE];
+      memcpy(&batch->ids[i], record, ID_SIZE);
+      memcpy(batch->usernames[i], record + ID_SIZE, USERNAME_SIZE);
+      memcpy(batch->emails[i], record + ID_SIZE + USERNAME_SIZE, EMAIL_SIZE);
+    }
+    sink(batch);
+  }
+  free(batch);
+  close(spill.fds[p]);
 }
 
 /**
- * @brief Flushes the page cache to disk, closes the DB file, frees the Pager &
- *        Table structures
- *
- * @param table pointer to the table structure
- * @note  Wait to flush the cache to disk until the user closes the DB
- *        connection.
+ * @brief Hash join : the rows of the \p build table are hashed on their
+ *        column, then looked up for every row of the \p probe table, both
+ *        passed to \p emit in that order. Past Catalog::joinMemoryRows rows
+ *        to hash, both tables are split by key over JOIN_SPILL_PARTITIONS
+ *        temporary files instead, and joined one pair of them at a time
+ *        (Grace hash join).
+ * @note A partition is joined in memory whatever its size.
  */
-void dbClose(Table *table) {
-  Pager *pager = table->pager;
+EXECUTE_RESULT hashJoin(Catalog *catalog, Command &buildScan, Table &build,
+                        uint32_t buildColumn, Command &probeScan, Table &probe,
+                        uint32_t probeColumn, const JoinSink &emit) {
+  JoinRows rows;
+  JoinSpill buildSpill, probeSpill;
+  bool spilled = false;
+  EXECUTE_RESULT result =
+      executeOnTable(buildScan, build, [&](const ColumnBatch *batch) {
+        for (uint32_t i = 0; i < batch->numRows; ++i) {
+          if (spilled) {
+            joinSpillWrite(buildSpill, buildColumn, batch, i);
+            continue;
+          }
+          joinRowsAdd(rows, batch, i);
+          if (rows.numRows > catalog->joinMemoryRows) {
+            spilled = true;
+            joinSpillOpen(buildSpill);
+            for (const ColumnBatch *held : rows.batches) {
+              for (uint32_t j = 0; j < held->numRows; ++j) {
+                joinSpillWrite(buildSpill, buildColumn, held, j);
+              }
+            }
+            joinRowsClear(rows);
+          }
+        }
+      });
+  catalog->hashJoins += 1;
 
-  for (uint32_t i = 0; i < pager->numPages; ++i) {
-    if (pager->pages[i] == nullptr)
-      continue;
-    pagerFlush(pager, i);
-    free(pager->pages[i]);
-    pager->pages[i] = nullptr;
+  if (!spilled) {
+    JoinHashTable hashTable;
+    joinHashRows(rows, buildColumn, hashTable);
+    if (result == EXECUTE_SUCCESS) {
+      result = executeOnTable(probeScan, probe, [&](const ColumnBatch *batch) {
+        joinProbe(hashTable, rows, batch, probeColumn, emit);
+      });
+    }
+    joinRowsClear(rows);
+    return result;
   }
 
-  int result = close(pager->fd);
-  if (result == -1) {
-    std::cerr << "Error closing DB file: " << std::strerror(errno) << '\n';
-    exit(EXIT_FAILURE);
+  catalog->spilledJoins += 1;
+  joinSpillOpen(probeSpill);
+  if (result == EXECUTE_SUCCESS) {
+    result = executeOnTable(probeScan, probe, [&](const ColumnBatch *batch) {
+      for (uint32_t i = 0; i < batch->numRows; ++i) {
+        joinSpillWrite(probeSpill, probeColumn, batch, i);
+      }
+    });
   }
-  free(pager);
-  free(table);
+  for (uint32_t p = 0; p < JOIN_SPILL_PARTITIONS; ++p) {
+    joinSpillRead(buildSpill, p, [&](const ColumnBatch *batch) {
+      for (uint32_t i = 0; i < batch->numRows; ++i) {
+        joinRowsAdd(rows, batch, i);
+      }
+    });
+    JoinHashTable hashTable;
+    joinHashRows(rows, buildColumn, hashTable);
+    joinSpillRead(probeSpill, p, [&](const ColumnBatch *batch) {
+      joinProbe(hashTable, rows, batch, probeColumn, emit);
+    });
+    joinRowsClear(rows);
+  }
+  return result;
 }
 
 /**
- * @brief Displays the default SQLite prompt
+ * @brief Lookup join on the ids : a SELECT of one id on the \p inner table
+ *        for every row of the \p outer one, both passed to \p emit in that
+ *        order. Beats scanning the inner table when the outer one is
+ *        small, see planJoin().
  */
-inline void displayDefault() { std::cout << "SQLite > "; }
+EXECUTE_RESULT lookupJoin(Command &outerScan, Table &outer, Table &inner,
+                          const JoinSink &emit) {
+  Command lookup = outerScan;
+  EXECUTE_RESULT lookupResult = EXECUTE_SUCCESS;
+  EXECUTE_RESULT result =
+      executeOnTable(outerScan, outer, [&](const ColumnBatch *batch) {
+        for (uint32_t i = 0; i < batch->numRows; ++i) {
+          lookup.minId = lookup.maxId = batch->ids[i];
+          EXECUTE_RESULT found = executeOnTable(
+              lookup, inner, [&](const ColumnBatch *innerBatch) {
+                for (uint32_t j = 0; j < innerBatch->numRows; ++j) {
+                  emit(batch, i, innerBatch, j);
+                }
+              });
+          if (found != EXECUTE_SUCCESS) {
+            lookupResult = found;
+          }
+        }
+      });
+  return result != EXECUTE_SUCCESS ? result : lookupResult;
+}
 
 /**
- * @brief Cleanup function called before exit
+ * @brief ANALYZE : reads every row of \p table for its TableStats, kept by
+ *        the catalog until the next ANALYZE of the table.
+ * @note Distinct values are counted by their hash.
  */
-void closeInput() { std::cout << "Goodbye!\n"; }
+EXECUTE_RESULT analyzeTable(Catalog *catalog, const std::string &name,
+                            Table &table) {
+  Command scan;
+  scan.type = COMMAND_SELECT;
+  scan.columns = ALL_COLUMNS;
+  scan.countRows = false;
+  scan.minId = 0;
+  scan.maxId = UINT64_MAX;
+  scan.explain = false;
+  std::vector<uint64_t> ids; // In order, whatever the kind of table
+  std::unordered_set<uint64_t> usernames, emails;
+  std::hash<std::string> hasher;
+  EXECUTE_RESULT result =
+      executeOnTable(scan, table, [&](const ColumnBatch *batch) {
+        for (uint32_t i = 0; i < batch->numRows; ++i) {
+          ids.push_back(batch->ids[i]);
+          usernames.insert(hasher(joinKey(batch, i, COLUMN_USERNAME)));
+          emails.insert(hasher(joinKey(batch, i, COLUMN_EMAIL)));
+        }
+      });
+  if (result != EXECUTE_SUCCESS) {
+    return result;
+  }
+
+  TableStats &stats = catalog->stats[&table];
+  stats.numRows = ids.size();
+  stats.distinctUsernames = usernames.size();
+  stats.distinctEmails = emails.size();
+  stats.idBounds.clear();
+  uint64_t buckets = std::min<uint64_t>(STATS_HISTOGRAM_BUCKETS, ids.size());
+  if (buckets != 0) {
+    stats.idBounds.push_back(ids[0]);
+  }
+  for (uint64_t k = 1; k <= buckets; ++k) {
+    stats.idBounds.push_back(ids[k * ids.size() / buckets - 1]);
+  }
+  std::cout << name << " : " << stats.numRows << " rows, "
+            << stats.distinctUsernames << " usernames, "
+            << stats.distinctEmails << " emails\n";
+  return EXECUTE_SUCCESS;
+}
 
 /**
- * @brief   Efficiently reads a line of input using std::getline
- * @param   inputBuffer Reference to string where input will be stored
- * @return  Number of bytes read, -1 on error
+ * @brief Cost model of the planner : a row read by a scan is the unit. The
+ *        estimates come from ANALYZE (see TableStats), from defaults for
+ *        the tables never analyzed.
  */
-ssize_t readLine(std::string &inputBuffer) {
-  // Clear any existing content for safety
-  inputBuffer.clear();
+const double COST_LOOKUP = 64;    // A SELECT of one id, a descent of the tree
+const double COST_HASH_BUILD = 2; // Per row put in a hash table
+const double COST_HASH_PROBE = 1; // Per row looked up in one
+const double COST_SPILL = 4;      // Per row written to a file and read back
+const uint64_t STATS_DEFAULT_ROWS = 1 << 20; // Of a table never analyzed
 
-  // Read entire line at once
-  if (!std::getline(std::cin, inputBuffer)) {
-    // Handle EOF or error
-    return -1;
+/* The statistics of \p table, made up if it was never analyzed */
+TableStats plannerStats(Catalog *catalog, Table *table) {
+  auto analyzed = catalog->stats.find(table);
+  if (analyzed != catalog->stats.end()) {
+    return analyzed->second;
   }
+  TableStats stats;
+  stats.numRows = STATS_DEFAULT_ROWS;
+  stats.distinctUsernames = STATS_DEFAULT_ROWS / 10;
+  stats.distinctEmails = STATS_DEFAULT_ROWS / 10;
+  return stats;
+}
 
-  return inputBuffer.size();
+double statsDistinct(const TableStats &stats, uint32_t column) {
+  if (column == COLUMN_USERNAME) {
+    return stats.distinctUsernames;
+  } else if (column == COLUMN_EMAIL) {
+    return stats.distinctEmails;
+  }
+  return stats.numRows;
 }
 
-META_COMMAND_RESULT selectAndDoMetaCommand(const std::string &inputLine,
-                                           Table *table) {
-  if (inputLine == ".exit") {
-    dbClose(table);
-    closeInput();
-    exit(EXIT_SUCCESS);
-  } else if (inputLine == ".btree") {
-    std::cout << "Tree :\n";
-    printLeafNode(getPage(table->pager, 0));
-    return META_COMMAND_SUCCESS;
-  } else if (inputLine == ".constants") {
-    std::cout << "Constants :\n";
-    printConstants();
-    return META_COMMAND_SUCCESS;
-  } else {
-    return META_UNRECOGNIZED_COMMAND;
+/* Rows of a table whose id is in [minId, maxId], by its histogram */
+double estimateRows(const TableStats &stats, uint64_t minId, uint64_t maxId) {
+  if (minId > maxId) {
+    return 0;
+  } else if (minId == 0 && maxId == UINT64_MAX) {
+    return stats.numRows;
+  } else if (stats.idBounds.size() < 2) { // Never analyzed, or empty
+    return minId == maxId ? std::min<double>(1, stats.numRows)
+                          : stats.numRows / 4.0;
+  }
+  const std::vector<uint64_t> &bounds = stats.idBounds;
+  double buckets = 0;
+  for (size_t k = 1; k < bounds.size(); ++k) {
+    // Bucket k holds the ids past bounds[k - 1] up to bounds[k], the first
+    // one bounds[0] too. Ids are taken as evenly spread in a bucket
+    double low = bounds[k - 1] + (k > 1 ? 1 : 0), high = bounds[k];
+    double overlapLow = std::max<double>(low, minId);
+    double overlapHigh = std::min<double>(high, maxId);
+    if (overlapLow <= overlapHigh) {
+      buckets += (overlapHigh - overlapLow + 1) / (high - low + 1);
+    }
   }
+  return buckets * stats.numRows / (bounds.size() - 1);
 }
 
-/* Matches the command with their type */
-PREPARE_RESULT prepareCommand(const std::string &inputLine, Command &command) {
-  std::istringstream inputArgStream(inputLine);
-  std::string whichCommand;
-  inputArgStream >> whichCommand;
+/* Whether a SELECT of one id on \p table descends a tree, see lookupJoin() */
+bool tableIndexed(Table *table) {
+  if (table->numShards != 0) {
+    return tableIndexed(table->shards[0]);
+  } else if (table->partitionMap != nullptr) {
+    return !table->partitionMap->options.lsm;
+  }
+  return table->lsm == nullptr; // LSM runs are not indexed by range
+}
 
-  if (whichCommand == "SELECT") {
-    command.type = COMMAND_SELECT;
-    return PREPARE_SUCCESS;
-  } else if (whichCommand == "INSERT") {
-    command.type = COMMAND_INSERT;
-    std::string usrName, email;
-    int64_t id;
+/* A way to run a join, see planJoin() */
+typedef struct {
+  JOIN_ALGORITHM algorithm; // JOIN_MERGE, JOIN_HASH or JOIN_LOOKUP
+  bool innerFrom;  // The FROM table is hashed, or looked up in
+  double cost;
+  double fromRows; // Estimates : rows read from the FROM table,
+  double joinRows; // from the JOIN table,
+  double rows;     // and pairs of them joined
+} JoinPlan;
 
-    if (!(inputArgStream >> id >> usrName >> email)) {
-      return PREPARE_SYNTAX_ERROR;
-    }
+/**
+ * @brief Picks the cheapest of the joins \p command can run as : a merge
+ *        join on the ids, a hash join built on the smaller table, or a
+ *        lookup join from the smaller table when the other is large.
+ *        `.pragma join` narrows the choice down to one algorithm.
+ */
+JoinPlan planJoin(Catalog *catalog, const Command &command, Table *left,
+                  Table *right) {
+  TableStats leftStats = plannerStats(catalog, left);
+  TableStats rightStats = plannerStats(catalog, right);
+  bool onIds = command.fromColumn == COLUMN_ID;
+  JoinPlan plan;
+  plan.fromRows = estimateRows(leftStats, command.minId, command.maxId);
+  plan.joinRows = onIds ? estimateRows(rightStats, command.minId, command.maxId)
+                        : rightStats.numRows;
+  plan.rows =
+      onIds ? std::min(plan.fromRows, plan.joinRows)
+            : plan.fromRows * plan.joinRows /
+                  std::max({1.0, statsDistinct(leftStats, command.fromColumn),
+                            statsDistinct(rightStats, command.joinColumn)});
 
-    if (id < 0) {
-      return PREPARE_NEGATIVE_ID;
+  std::vector<JoinPlan> candidates;
+  auto candidate = [&](JOIN_ALGORITHM algorithm, bool innerFrom, double cost) {
+    plan.algorithm = algorithm;
+    plan.innerFrom = innerFrom;
+    plan.cost = cost;
+    candidates.push_back(plan);
+  };
+  double scans = plan.fromRows + plan.joinRows;
+  if (onIds) {
+    candidate(JOIN_MERGE, false, left == right ? plan.fromRows : scans);
+  }
+  for (bool innerFrom : {false, true}) {
+    double built = innerFrom ? plan.fromRows : plan.joinRows;
+    double probed = innerFrom ? plan.joinRows : plan.fromRows;
+    double spills = built > catalog->joinMemoryRows ? COST_SPILL * scans : 0;
+    candidate(JOIN_HASH, innerFrom,
+              scans + COST_HASH_BUILD * built + COST_HASH_PROBE * probed +
+                  spills);
+  }
+  for (bool innerFrom : {false, true}) {
+    Table *inner = innerFrom ? left : right;
+    double outerRows = innerFrom ? plan.joinRows : plan.fromRows;
+    double innerRows = innerFrom ? plan.fromRows : plan.joinRows;
+    if (onIds && left != right) { // The lookups would wait on the scan
+      candidate(JOIN_LOOKUP, innerFrom,
+                outerRows * (1 + (tableIndexed(inner) ? COST_LOOKUP
+                                                      : innerRows)));
     }
+  }
 
-    if (usrName.size() > COLUMN_USERNAME_SIZE ||
-        email.size() > COLUMN_EMAIL_SIZE) {
-      return PREPARE_STRING_TOO_LONG;
+  JoinPlan *best = nullptr;
+  for (JoinPlan &option : candidates) {
+    bool allowed = catalog->joinAlgorithm == JOIN_AUTO ||
+                   catalog->joinAlgorithm == option.algorithm;
+    if (allowed && (best == nullptr || option.cost < best->cost)) {
+      best = &option;
     }
-
-    command.toBeInserted.id = id;
-    strncpy(command.toBeInserted.username, usrName.c_str(),
-            COLUMN_USERNAME_SIZE);
-    command.toBeInserted.username[COLUMN_USERNAME_SIZE] = '\0';
-
-    strncpy(command.toBeInserted.email, email.c_str(), COLUMN_EMAIL_SIZE);
-    command.toBeInserted.email[COLUMN_EMAIL_SIZE] = '\0';
-
-    return PREPARE_SUCCESS;
   }
-  return PREPARE_UNRECOGNIZED_STATE;
-}
-
-/* Executing the INSERT command */
-EXECUTE_RESULT executeInsertCommand(Command &command, Table &table) {
-  void *node = getPage(table.pager, table.rootPageNum);
-  uint32_t numCells = *leafNodeNumCells(node);
-  if (numCells >= LEAF_NODE_MAX_CELLS) {
-    return EXECUTE_TABLE_FULL;
+  // An algorithm that cannot run this join leaves the choice to the costs
+  for (JoinPlan &option : candidates) {
+    if (best == nullptr || (best->algorithm != catalog->joinAlgorithm &&
+                            option.cost < best->cost)) {
+      best = &option;
+    }
   }
-  Row *rowToinsert = &(command.toBeInserted);
-  uint32_t keyToBeInserted = rowToinsert->id;
-  Cursor *cursor = tableFind(&table, keyToBeInserted);
+  return *best;
+}
 
-  if (cursor->cellNum < numCells) {
-    uint32_t keyAtIndex = *leafNodeKey(node, cursor->cellNum);
-    if (keyAtIndex == keyToBeInserted) {
-      return EXECUTE_DUPLICATE_KEY;
+/* How a SELECT reads a table, as EXPLAIN shows it */
+std::string accessPath(const std::string &name, Table *table, uint64_t minId,
+                       uint64_t maxId, double rows) {
+  std::string path = "SCAN " + name;
+  if ((minId != 0 || maxId != UINT64_MAX) && tableIndexed(table)) {
+    std::string range = "BETWEEN " + std::to_string(minId) + " AND " +
+                        std::to_string(maxId);
+    if (minId == maxId) {
+      range = "= " + std::to_string(minId);
+    } else if (maxId == UINT64_MAX) {
+      range = ">= " + std::to_string(minId);
+    } else if (minId == 0) {
+      range = "<= " + std::to_string(maxId);
     }
+    path = "SEARCH " + name + " USING PRIMARY KEY (id " + range + ")";
   }
-  leafNodeInsert(cursor, rowToinsert->id, rowToinsert);
-  free(cursor);
-
-  return EXECUTE_SUCCESS;
+  return path + " (~" + std::to_string((uint64_t)(rows + 0.5)) +
+         " rows)";
 }
 
-/* Executing the SELECT command */
-EXECUTE_RESULT executeSelectCommand(Command &command, Table &table) {
-  Cursor *cursor = tableStart(&table);
-  Row row;
+/* EXPLAIN SELECT : the plan of \p command with its estimates */
+void explainStatement(Catalog *catalog, const Command &command, Table *left,
+                      Table *right) {
+  TableStats leftStats = plannerStats(catalog, left);
+  if (right == nullptr) {
+    double rows = estimateRows(leftStats, command.minId, command.maxId);
+    std::cout << "QUERY PLAN\n  "
+              << accessPath(command.fromTable, left, command.minId,
+                            command.maxId, rows)
+              << "\n";
+    return;
+  }
 
-  while (!(cursor->endOfTable)) {
-    destructureRow(cursorValue(cursor), &row);
-    printRow(&row);
-    cursorAdvance(cursor);
+  JoinPlan plan = planJoin(catalog, command, left, right);
+  uint64_t joinMinId = 0, joinMaxId = UINT64_MAX;
+  if (command.fromColumn == COLUMN_ID) {
+    joinMinId = command.minId;
+    joinMaxId = command.maxId;
+  }
+  std::string fromPath = accessPath(command.fromTable, left, command.minId,
+                                    command.maxId, plan.fromRows);
+  std::string joinPath = accessPath(command.joinTable, right, joinMinId,
+                                    joinMaxId, plan.joinRows);
+  std::cout << "QUERY PLAN (cost " << (uint64_t)(plan.cost + 0.5) << ", ~"
+            << (uint64_t)(plan.rows + 0.5) << " rows)\n";
+  if (plan.algorithm == JOIN_MERGE) {
+    std::cout << "  MERGE JOIN ON id\n    " << fromPath << "\n    "
+              << joinPath << "\n";
+  } else if (plan.algorithm == JOIN_HASH) {
+    double built = plan.innerFrom ? plan.fromRows : plan.joinRows;
+    std::cout << "  HASH JOIN"
+              << (built > catalog->joinMemoryRows ? ", spilled to disk" : "")
+              << "\n    BUILD " << (plan.innerFrom ? fromPath : joinPath)
+              << "\n    PROBE " << (plan.innerFrom ? joinPath : fromPath)
+              << "\n";
+  } else {
+    const std::string &innerName =
+        plan.innerFrom ? command.fromTable : command.joinTable;
+    std::cout << "  LOOKUP JOIN\n    "
+              << (plan.innerFrom ? joinPath : fromPath) << "\n    "
+              << (tableIndexed(plan.innerFrom ? left : right) ? "SEARCH "
+                                                              : "SCAN ")
+              << innerName << " USING PRIMARY KEY (id = ?) for each row\n";
   }
+}
 
-  free(cursor);
+/**
+ * @brief SELECT ... FROM a JOIN b ON a.x = b.y : the columns asked for of
+ *        each pair of rows, side by side, joined as planJoin() finds
+ *        cheapest. The WHERE is on the ids of the FROM table, and of the
+ *        JOIN one too when joining on the ids.
+ */
+EXECUTE_RESULT executeJoin(Catalog *catalog, Command &command, Table &left,
+                           Table &right) {
+  JoinPlan plan = planJoin(catalog, command, &left, &right);
+  Command leftScan = command;
+  leftScan.columns = ALL_COLUMNS;
+  leftScan.countRows = false;
+  Command rightScan = leftScan;
+  bool onIds = command.fromColumn == COLUMN_ID; // So is joinColumn
+  if (!onIds) {
+    rightScan.minId = 0;
+    rightScan.maxId = UINT64_MAX;
+  }
 
-  return EXECUTE_SUCCESS;
+  uint64_t rowCount = 0;
+  JoinSink emit = [&](const ColumnBatch *leftBatch, uint32_t i,
+                      const ColumnBatch *rightBatch, uint32_t j) {
+    rowCount += 1;
+    if (!command.countRows) {
+      printBatchRow(leftBatch, i, command.columns, " | ");
+      printBatchRow(rightBatch, j, command.columns);
+    }
+  };
+  JoinSink emitSwapped = [&](const ColumnBatch *rightBatch, uint32_t j,
+                             const ColumnBatch *leftBatch, uint32_t i) {
+    emit(leftBatch, i, rightBatch, j);
+  };
+  EXECUTE_RESULT result;
+  if (plan.algorithm == JOIN_MERGE) {
+    catalog->mergeJoins += 1;
+    result = mergeJoin(leftScan, left, right, emit);
+  } else if (plan.algorithm == JOIN_HASH && plan.innerFrom) {
+    result = hashJoin(catalog, leftScan, left, command.fromColumn, rightScan,
+                      right, command.joinColumn, emitSwapped);
+  } else if (plan.algorithm == JOIN_HASH) {
+    result = hashJoin(catalog, rightScan, right, command.joinColumn, leftScan,
+                      left, command.fromColumn, emit);
+  } else {
+    catalog->lookupJoins += 1;
+    result = plan.innerFrom ? lookupJoin(rightScan, right, left, emitSwapped)
+                            : lookupJoin(leftScan, left, right, emit);
+  }
+  if (command.countRows) {
+    std::cout << "Count: " << rowCount << "\n";
+  }
+  return result;
 }
 
-/* Execute the logic behind the command */
-EXECUTE_RESULT executeCommand(Command &command, Table &table) {
-  switch (command.type) {
-  case COMMAND_INSERT:
-    return executeInsertCommand(command, table);
-  case COMMAND_SELECT:
-    return executeSelectCommand(command, table);
+/**
+ * @brief Runs a statement of the session : an INSERT on \p mainTable, a
+ *        SELECT or an ANALYZE on the tables it names (see Catalog).
+ */
+EXECUTE_RESULT executeStatement(Command &command, Table &mainTable) {
+  if (command.type == COMMAND_INSERT) {
+    return executeOnTable(command, mainTable);
   }
-  return EXECUTE_TABLE_FULL;
+  auto named = [&mainTable](const std::string &name) -> Table * {
+    if (name == "main") {
+      return &mainTable;
+    }
+    if (mainTable.catalog == nullptr) {
+      return nullptr;
+    }
+    auto attached = mainTable.catalog->attached.find(name);
+    return attached != mainTable.catalog->attached.end() ? attached->second
+                                                         : nullptr;
+  };
+  if (command.type == COMMAND_ANALYZE && command.fromTable.empty()) {
+    EXECUTE_RESULT result =
+        analyzeTable(tableCatalog(&mainTable), "main", mainTable);
+    for (const std::pair<const std::string, Table *> &attached :
+         mainTable.catalog->attached) {
+      if (result == EXECUTE_SUCCESS) {
+        result = analyzeTable(mainTable.catalog, attached.first,
+                              *attached.second);
+      }
+    }
+    return result;
+  }
+  Table *from = named(command.fromTable);
+  if (from == nullptr) {
+    return EXECUTE_UNKNOWN_TABLE;
+  }
+  if (command.type == COMMAND_ANALYZE) {
+    return analyzeTable(tableCatalog(&mainTable), command.fromTable, *from);
+  }
+  Table *join = nullptr;
+  if (!command.joinTable.empty()) {
+    join = named(command.joinTable);
+    if (join == nullptr) {
+      return EXECUTE_UNKNOWN_TABLE;
+    }
+  }
+  if (command.explain) {
+    explainStatement(tableCatalog(&mainTable), command, from, join);
+    return EXECUTE_SUCCESS;
+  }
+  if (join == nullptr) {
+    return executeOnTable(command, *from);
+  }
+  return executeJoin(tableCatalog(&mainTable), command, *from, *join);
 }
 
 /**
@@ -673,9 +8511,17 @@ int main(int argc, char **argv) {
     exit(EXIT_FAILURE);
   }
 
+  OpenOptions options;
+  for (int i = 2; i < argc; ++i) {
+    if (!parseOpenOption(argv[i], options)) {
+      std::cerr << "Unknown or invalid option " << argv[i] << '\n';
+      exit(EXIT_FAILURE);
+    }
+  }
+
   std::string inputLine;
   std::string filename = argv[1];
-  Table *table = dbOpen(filename);
+  Table *table = dbOpen(filename, options);
 
   while (true) {
     displayDefault();
@@ -728,7 +8574,7 @@ int main(int argc, char **argv) {
     }
 
     /* execute the command */
-    switch (executeCommand(command, *table)) {
+    switch (executeStatement(command, *table)) {
     case EXECUTE_SUCCESS:
       std::cout << "Executed\n";
       break;
@@ -738,6 +8584,12 @@ int main(int argc, char **argv) {
     case EXECUTE_TABLE_FULL:
       std::cout << "Error: Table full.\n";
       break;
+    case EXECUTE_READ_ONLY:
+      std::cout << "Error: read-only replica.\n";
+      break;
+    case EXECUTE_UNKNOWN_TABLE:
+      std::cout << "Error: no such table.\n";
+      break;
     }
   }
 
@@ -0,0 +1,229 @@
+#!/usr/bin/env bash
+# REPL transcript tests : each test feeds statements to the REPL and diffs
+# what it printed against the expected transcript.
+#
+#   tests/repl.sh [path to the db binary, ./db by default]
+
+DB=$(realpath "${1:-./db}")
+DIR=$(mktemp -d)
+trap 'kill -9 $(jobs -p) 2>/dev/null; rm -rf "$DIR"' EXIT
+cd "$DIR" || exit 1
+failures=0
+
+# Runs the REPL on file $1 with the options that follow, statements on stdin
+repl() {
+  "$DB" "$@" 2>&1
+}
+
+# Compares the output of test $1, in the file out, with the transcript on
+# stdin
+expect() {
+  if diff -u - out > diff; then
+    echo "PASS $1"
+  else
+    echo "FAIL $1"
+    cat diff
+    failures=$((failures + 1))
+  fi
+}
+
+# Starts REPL $1 in the background on the file and options that follow, fed
+# through the fifo $1.in opened on fd $2, printing to $1.out
+start() {
+  local name=$1 fd=$2
+  shift 2
+  mkfifo "$name.in"
+  "$DB" "$@" < "$name.in" > "$name.out" 2>&1 &
+  eval "${name}_pid=$!"
+  eval "exec $fd> $name.in"
+}
+
+# Waits (10s at most) until $2 lines of $1.out match $3
+waitFor() {
+  for _ in $(seq 100); do
+    if [ "$(grep -c -- "$3" "$1.out")" -ge "$2" ]; then
+      return 0
+    fi
+    sleep 0.1
+  done
+  echo "timed out waiting for '$3' in $1.out"
+  return 1
+}
+
+inserts() {
+  for i in "$@"; do
+    echo "INSERT $i user$i person$i@example.com"
+  done
+}
+
+# Sharded SELECTs merge the shards back into id order
+{ inserts 5 1 4 2 3; cat <<'SQL'; } | repl sharded.db --shards=4 > /dev/null
+.exit
+SQL
+repl sharded.db > out <<'SQL'
+SELECT id
+SELECT id WHERE id > 2
+SELECT COUNT(*)
+.exit
+SQL
+expect "sharded SELECT ordering" <<'OUT'
+SQLite > ID: 1
+ID: 2
+ID: 3
+ID: 4
+ID: 5
+Executed
+SQLite > ID: 3
+ID: 4
+ID: 5
+Executed
+SQLite > Count: 5
+Executed
+SQLite > Goodbye!
+OUT
+
+# Range partitions are scanned in id order, pruned by the WHERE bounds
+{ inserts 9 1 6 3 7 2; echo .exit; } |
+  repl part.db --partition-width=3 > /dev/null
+repl part.db > out <<'SQL'
+SELECT id
+SELECT id WHERE id >= 3 AND id < 7
+.exit
+SQL
+expect "partitioned SELECT ordering" <<'OUT'
+SQLite > ID: 1
+ID: 2
+ID: 3
+ID: 6
+ID: 7
+ID: 9
+Executed
+SQLite > ID: 3
+ID: 6
+Executed
+SQLite > Goodbye!
+OUT
+
+# Commits in the log survive a crash and are replayed on the next open
+start crash 3 crash.db --wal
+inserts $(seq 50) >&3
+waitFor crash 50 Executed
+{ kill -9 "$crash_pid"; wait "$crash_pid"; } 2> /dev/null
+exec 3>&-
+{
+  [ -e crash.db-wal ] || echo "crash.db-wal is missing"
+  repl crash.db <<'SQL'
+SELECT COUNT(*)
+SELECT id WHERE id >= 49
+.exit
+SQL
+} > out
+expect "WAL crash recovery" <<'OUT'
+SQLite > Count: 50
+Executed
+SQLite > ID: 49
+ID: 50
+Executed
+SQLite > Goodbye!
+OUT
+
+# Processes sharing a WAL mode file see each other's commits through -shm
+start first 3 shared.db --wal
+start second 4 shared.db --wal
+inserts $(seq 1 2 39) >&3
+inserts $(seq 2 2 40) >&4
+waitFor first 20 Executed
+waitFor second 20 Executed
+echo "SELECT COUNT(*)" >&3
+echo "SELECT COUNT(*)" >&4
+waitFor first 1 Count
+waitFor second 1 Count
+echo .exit >&3
+echo .exit >&4
+exec 3>&- 4>&-
+wait "$first_pid" "$second_pid"
+grep -ho "Count: [0-9]*" first.out second.out > out
+ls shared.db-* >> out 2>&1
+repl shared.db >> out <<'SQL'
+SELECT COUNT(*)
+.exit
+SQL
+expect "multi-process WAL" <<'OUT'
+Count: 40
+Count: 40
+ls: cannot access 'shared.db-*': No such file or directory
+SQLite > Count: 40
+Executed
+SQLite > Goodbye!
+OUT
+
+# A replica follows the commits of its primary and refuses writes
+start primary 3 primary.db --wal
+inserts $(seq 10) >&3
+waitFor primary 10 Executed
+start replica 4 replica.db --replica-of=primary.db
+inserts $(seq 11 20) >&3
+waitFor primary 20 Executed
+for _ in $(seq 50); do
+  echo "SELECT COUNT(*)" >&4
+  sleep 0.1
+  if grep -q "Count: 20" replica.out; then
+    break
+  fi
+done
+grep -o "Count: 20" replica.out | head -n 1 > out
+inserts 21 >&4
+waitFor replica 1 read-only
+grep -o "Error: read-only replica." replica.out >> out
+echo .exit >&3
+echo .exit >&4
+exec 3>&- 4>&-
+wait "$primary_pid" "$replica_pid"
+expect "replica following" <<'OUT'
+Count: 20
+Error: read-only replica.
+OUT
+
+# .attach reports the files it cannot open and the session goes on
+{ inserts 1; echo .exit; } | repl old.db > /dev/null
+printf '\001' | dd of=old.db bs=1 seek=1 conv=notrunc 2> /dev/null
+{ inserts 1 2; echo .exit; } | repl other.db > /dev/null
+{ inserts 1 2 3; echo .exit; } | repl split.db --shards=3 > /dev/null
+repl main.db > out <<'SQL'
+INSERT 7 main main@example.com
+.attach old.db old
+.attach main.db self
+.attach other.db other --shards=2
+.attach split.db split --shards=2
+.attach missing/new.db new
+.attach other.db other
+SELECT id FROM other
+.attach split.db split
+SELECT id FROM split
+SELECT
+.exit
+SQL
+expect ".attach errors" <<'OUT'
+SQLite > Executed
+SQLite > Database old.db was written by an older version (file format 1, expected 2).
+SQLite > Database main.db is locked by another process.
+SQLite > Database other.db is not sharded.
+SQLite > Database split.db has 3 shards.
+SQLite > Unable to open file missing/new.db
+SQLite > SQLite > ID: 1
+ID: 2
+Executed
+SQLite > SQLite > ID: 1
+ID: 2
+ID: 3
+Executed
+SQLite > ID: 7, Username: main, Email: main@example.com
+Executed
+SQLite > Goodbye!
+OUT
+
+if [ "$failures" -ne 0 ]; then
+  echo "$failures test(s) failed"
+  exit 1
+fi
+echo "All tests passed"